@@ -1 +1,44 @@
 #include "aligned-mem-pool.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace cnn {
+
+AlignedMemoryPool::AlignedMemoryPool(size_t chunk_size, MemAllocator* a) :
+    current(0), chunk_size(a->round_up_align(chunk_size)), used(0), peak(0), a(a) {
+  chunks.push_back(new_chunk(this->chunk_size));
+}
+
+AlignedMemoryPool::~AlignedMemoryPool() {
+  for (auto& c : chunks) a->release(c.mem, c.capacity);
+}
+
+size_t AlignedMemoryPool::reserved_bytes() const {
+  size_t n = 0;
+  for (auto& c : chunks) n += c.capacity;
+  return n;
+}
+
+void* AlignedMemoryPool::allocate_in_next_chunk(size_t rounded_n) {
+  // the chunks after current are empty; one of them is reused if it is
+  // large enough, so a pool that is freed and refilled stops growing
+  ++current;
+  if (current == chunks.size() || chunks[current].capacity < rounded_n)
+    chunks.insert(chunks.begin() + current, new_chunk(max(chunk_size, rounded_n)));
+  Chunk& c = chunks[current];
+  c.used = rounded_n;
+  add_used(rounded_n);
+  return c.mem;
+}
+
+AlignedMemoryPool::Chunk AlignedMemoryPool::new_chunk(size_t n) {
+  Chunk c;
+  c.mem = a->reserve(n);
+  c.capacity = n;
+  c.used = 0;
+  return c;
+}
+
+} // namespace cnn
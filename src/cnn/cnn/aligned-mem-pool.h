@@ -2,56 +2,73 @@
 #define CNN_ALIGNED_MEM_POOL_H
 
 #include <iostream>
+#include <vector>
 #include "cnn/mem.h"
 
 namespace cnn {
 
+// hands out aligned pieces of memory, which are all released together by
+// free(). the memory is reserved from the allocator in chunks of (at least)
+// chunk_size bytes when it is first needed, and the allocator only commits
+// the pages of a chunk when they are first written to (where it can), so
+// chunk_size is not a limit, and reserving much more than is used is cheap
 class AlignedMemoryPool {
  public:
-  explicit AlignedMemoryPool(size_t cap, MemAllocator* a) : a(a) {
-    sys_alloc(cap);
-    zero_all();
-  }
+  explicit AlignedMemoryPool(size_t chunk_size, MemAllocator* a);
+  AlignedMemoryPool(const AlignedMemoryPool&) = delete;
+  AlignedMemoryPool& operator=(const AlignedMemoryPool&) = delete;
+  ~AlignedMemoryPool();
 
   void* allocate(size_t n) {
     auto rounded_n = a->round_up_align(n);
-    if (rounded_n + used > capacity) {
-      std::cerr << "cnn is out of memory, try increasing with --cnn-mem\n";
-      abort();
-    }
-    void* res = static_cast<char*>(mem) + used;
-    used += rounded_n;
+    Chunk& c = chunks[current];
+    if (c.used + rounded_n > c.capacity) return allocate_in_next_chunk(rounded_n);
+    void* res = static_cast<char*>(c.mem) + c.used;
+    c.used += rounded_n;
+    add_used(rounded_n);
     return res;
   }
   void free() {
     //std::cerr << "freeing " << used << " bytes\n";
+    for (unsigned i = 0; i <= current; ++i) chunks[i].used = 0;
+    current = 0;
     used = 0;
   }
   // zeros out the amount of allocations
   void zero_allocated_memory() {
-    if (used == 0) return;
-    a->zero(mem, used);
+    for (unsigned i = 0; i <= current; ++i)
+      if (chunks[i].used > 0) a->zero(chunks[i].mem, chunks[i].used);
   }
 
   bool is_shared() {
     return shared;
   }
+
+  // bytes currently allocated
+  size_t used_bytes() const { return used; }
+  // the largest number of bytes that were allocated at the same time
+  size_t peak_bytes() const { return peak; }
+  // bytes reserved from the allocator
+  size_t reserved_bytes() const;
  private:
-  void sys_alloc(size_t cap) {
-    capacity = a->round_up_align(cap);
-    //std::cerr << "Allocating " << capacity << " ...\n";
-    mem = a->malloc(capacity);
-    if (!mem) { std::cerr << "Failed to allocate " << capacity << std::endl; abort(); }
-    used = 0;
-  }
-  void zero_all() {
-    a->zero(mem, capacity);
+  struct Chunk {
+    void* mem;
+    size_t capacity;
+    size_t used;
+  };
+  void* allocate_in_next_chunk(size_t rounded_n);
+  Chunk new_chunk(size_t n);
+  void add_used(size_t n) {
+    used += n;
+    if (used > peak) peak = used;
   }
-  size_t capacity;
+  std::vector<Chunk> chunks;
+  unsigned current; // the chunk allocations are taken from; the later ones are unused
+  size_t chunk_size;
   size_t used;
+  size_t peak;
   bool shared;
   MemAllocator* a;
-  void* mem;
 };
 
 } // namespace cnn
@@ -12,6 +12,13 @@ using namespace expr;
 inline bool is_ws(char x) { return (x == ' ' || x == '\t'); }
 inline bool not_ws(char x) { return (x != ' ' && x != '\t'); }
 
+// pickneglogsoftmax of the same index in every batch element of x
+inline Expression pick_nls_all(const Expression& x, unsigned idx) {
+  const unsigned bd = x.pg->nodes[x.i]->dim.bd;
+  if (bd == 1) return pickneglogsoftmax(x, idx);
+  return pickneglogsoftmax(x, vector<unsigned>(bd, idx));
+}
+
 NonFactoredSoftmaxBuilder::NonFactoredSoftmaxBuilder(unsigned rep_dim, unsigned vocab_size, Model* model) {
   p_w = model->add_parameters({vocab_size, rep_dim});
   p_b = model->add_parameters({vocab_size});
@@ -24,7 +31,7 @@ void NonFactoredSoftmaxBuilder::new_graph(ComputationGraph& cg) {
 }
 
 Expression NonFactoredSoftmaxBuilder::neg_log_softmax(const Expression& rep, unsigned wordidx) {
-  return pickneglogsoftmax(affine_transform({b, w, rep}), wordidx);
+  return pick_nls_all(affine_transform({b, w, rep}), wordidx);
 }
 
 unsigned NonFactoredSoftmaxBuilder::sample(const expr::Expression& rep) {
@@ -80,7 +87,7 @@ Expression ClassFactoredSoftmaxBuilder::neg_log_softmax(const Expression& rep, u
   int clusteridx = widx2cidx[wordidx];
   assert(clusteridx >= 0);  // if this fails, wordid is missing from clusters
   Expression cscores = affine_transform({cbias, r2c, rep});
-  Expression cnlp = pickneglogsoftmax(cscores, clusteridx);
+  Expression cnlp = pick_nls_all(cscores, clusteridx);
   if (singleton_cluster[clusteridx]) return cnlp;
   // if there is only one word in the cluster, just return -log p(class | rep)
   // otherwise predict word too
@@ -88,7 +95,7 @@ Expression ClassFactoredSoftmaxBuilder::neg_log_softmax(const Expression& rep, u
   Expression& cwbias = get_rc2wbias(clusteridx);
   Expression& r2cw = get_rc2w(clusteridx);
   Expression wscores = affine_transform({cwbias, r2cw, rep});
-  Expression wnlp = pickneglogsoftmax(wscores, wordrow);
+  Expression wnlp = pick_nls_all(wscores, wordrow);
   return cnlp + wnlp;
 }
 
@@ -17,6 +17,7 @@ public:
   virtual void new_graph(ComputationGraph& cg) = 0;
 
   // -log(p(c | rep) * p(w | c, rep))
+  // rep may be a mini-batch, in which case every batch element predicts wordidx
   virtual expr::Expression neg_log_softmax(const expr::Expression& rep, unsigned wordidx) = 0;
 
   // samples a word from p(w,c | rep)
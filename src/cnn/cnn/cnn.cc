@@ -13,7 +13,6 @@ namespace cnn {
 float* kSCALAR_MINUSONE;
 float* kSCALAR_ONE;
 float* kSCALAR_ZERO;
-int n_hgs = 0;
 
 Node::~Node() {}
 size_t Node::aux_storage_size() const { return 0; }
@@ -57,102 +56,85 @@ void Node::backward(const std::vector<const Tensor*>& xs,
 }
 
 ComputationGraph::ComputationGraph() :
-  ee(new SimpleExecutionEngine(*this)) {
-  ++n_hgs;
-  if (n_hgs > 1) {
-    cerr << "Memory allocator assumes only a single ComputationGraph at a time.\n";
-    throw std::runtime_error("Attempted to create >1 CG");
-  }
+  ee(autobatch ? new BatchedExecutionEngine(*this) :
+     graph_optimize ? static_cast<ExecutionEngine*>(new OptimizingExecutionEngine(*this)) :
+     num_threads > 1 ? static_cast<ExecutionEngine*>(new ParallelExecutionEngine(*this)) :
+     new SimpleExecutionEngine(*this)) {
 }
 
 ComputationGraph::~ComputationGraph() {
   this->clear();
   delete ee;
-  --n_hgs;
 }
 
 void ComputationGraph::clear() {
   parameter_nodes.clear();
-  for (auto n : nodes) delete n;
+  // the memory of the nodes belongs to node_arena
+  for (auto n : nodes) n->~Node();
   nodes.clear();
+  node_arena.reset();
 }
 
 VariableIndex ComputationGraph::add_input(real s) {
-  VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new ScalarInputNode(s));
+  VariableIndex new_node_index = new_node<ScalarInputNode>(s);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_input(const real* ps) {
-  VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new ScalarInputNode(ps));
+  VariableIndex new_node_index = new_node<ScalarInputNode>(ps);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_input(const Dim& d, const vector<float>& pm) {
-  VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new InputNode(d, pm));
+  VariableIndex new_node_index = new_node<InputNode>(d, pm);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_input(const Dim& d, const vector<float>* pm) {
-  VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new InputNode(d, pm));
+  VariableIndex new_node_index = new_node<InputNode>(d, pm);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_parameters(Parameters* p) {
-  VariableIndex new_node_index(nodes.size());
-  ParameterNode* new_node = new ParameterNode(p);
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<ParameterNode>(p);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_const_parameters(Parameters* p) {
-  VariableIndex new_node_index(nodes.size());
-  ConstParameterNode* new_node = new ConstParameterNode(p);
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<ConstParameterNode>(p);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const unsigned* pindex) {
-  VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, pindex);
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<LookupNode>(p, pindex);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_lookup(LookupParameters* p, unsigned index) {
-  VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, index);
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<LookupNode>(p, index);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const std::vector<unsigned>& indices) {
-  VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, indices);
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<LookupNode>(p, indices);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const std::vector<unsigned>* indices) {
-  VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, indices);
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<LookupNode>(p, indices);
   parameter_nodes.push_back(new_node_index);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
@@ -160,35 +142,27 @@ VariableIndex ComputationGraph::add_lookup(LookupParameters* p, const std::vecto
 
 
 VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, const unsigned* pindex) {
-  VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, pindex);
   // get rid of the following in favor of using parameter_nodes to see the needs_derivative
   // expression
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<LookupNode>(p, pindex);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, unsigned index) {
-  VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, index);
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<LookupNode>(p, index);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, const std::vector<unsigned>& indices) {
-  VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, indices);
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<LookupNode>(p, indices);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, const std::vector<unsigned>* indices) {
-  VariableIndex new_node_index(nodes.size());
-  LookupNode* new_node = new LookupNode(p, indices);
-  nodes.push_back(new_node);
+  VariableIndex new_node_index = new_node<LookupNode>(p, indices);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
@@ -197,13 +171,13 @@ VariableIndex ComputationGraph::add_const_lookup(LookupParameters* p, const std:
 // to set its dimensions properly
 void ComputationGraph::set_dim_for_new_node(const VariableIndex& i) {
   Node* node = nodes[i];
-  vector<Dim> xds(node->arity());
+  arg_dims.resize(node->arity());
   unsigned ai = 0;
   for (VariableIndex arg : node->args) {
-    xds[ai] = nodes[arg]->dim;
+    arg_dims[ai] = nodes[arg]->dim;
     ++ai;
   }
-  node->dim = node->dim_forward(xds);
+  node->dim = node->dim_forward(arg_dims);
 }
 
 const Tensor& ComputationGraph::incremental_forward() { return ee->incremental_forward(); }
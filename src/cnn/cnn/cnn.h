@@ -6,6 +6,8 @@
 #include <iostream>
 #include <initializer_list>
 #include <utility>
+#include <algorithm>
+#include <new>
 #include <boost/serialization/strong_typedef.hpp>
 
 #include "cnn/init.h"
@@ -13,6 +15,7 @@
 #include "cnn/tensor.h"
 #include "cnn/model.h"
 #include "cnn/devices.h"
+#include "cnn/node-arena.h"
 
 // Computation graph where nodes represent forward and backward intermediate
 // values, and edges represent functions of multiple values. To represent the
@@ -25,12 +28,13 @@
 
 namespace cnn {
 
-extern AlignedMemoryPool* fxs;
-extern AlignedMemoryPool* dEdfs;
 extern AlignedMemoryPool* ps;
 extern float* kSCALAR_MINUSONE;
 extern float* kSCALAR_ONE;
 extern float* kSCALAR_ZERO;
+extern bool autobatch; // use BatchedExecutionEngine for new graphs (--cnn-autobatch)
+extern bool graph_optimize; // use OptimizingExecutionEngine for new graphs, unless autobatch (--cnn-optimize)
+extern unsigned num_threads; // if > 1, use ParallelExecutionEngine for new graphs, unless one of the above (--cnn-threads)
 
 // devices provide information about GPUs and CPUs
 // these include any API information that is required to make calls
@@ -88,6 +92,11 @@ struct ComputationGraph {
   inline VariableIndex add_function(const std::initializer_list<VariableIndex>& arguments,
                                     Args&&... side_information);
   template <class Function, typename T> inline VariableIndex add_function(const T& arguments);
+  // replaces node i, which must not have been evaluated yet, by a node that
+  // computes the same value in a different way (see GraphOptimize)
+  template <class Function, typename... Args>
+  inline void replace_function(VariableIndex i, const std::vector<VariableIndex>& arguments,
+                               Args&&... side_information);
 
   // reset ComputationGraph to a newly created state
   void clear();
@@ -120,7 +129,31 @@ struct ComputationGraph {
 
   ExecutionEngine* ee;  // handles the execution
  private:
+  // creates a node in node_arena
+  template <class Function, typename... Args> inline Node* make_node(Args&&... args);
+  // ... and appends it to nodes
+  template <class Function, typename... Args> inline VariableIndex new_node(Args&&... args);
   void set_dim_for_new_node(const VariableIndex& i);
+
+  NodeArena node_arena;  // the nodes and their argument lists
+  std::vector<Dim> arg_dims;  // scratch space for set_dim_for_new_node
+};
+
+// the arguments of a node. a node is constructed with a view of its
+// argument list, which ComputationGraph then copies to its node arena
+class NodeArgs {
+ public:
+  NodeArgs() : first(nullptr), n(0) {}
+  NodeArgs(const VariableIndex* first, unsigned n) : first(first), n(n) {}
+  const VariableIndex* begin() const { return first; }
+  const VariableIndex* end() const { return first + n; }
+  unsigned size() const { return n; }
+  bool empty() const { return n == 0; }
+  const VariableIndex& operator[](unsigned i) const { return first[i]; }
+
+ private:
+  const VariableIndex* first;
+  unsigned n;
 };
 
 // represents an SSA variable
@@ -154,12 +187,22 @@ struct Node {
                              const Tensor& dEdf,
                              unsigned i,
                              Tensor& dEdxi) const = 0;
+  // called once per backward pass, before backward_impl for the arguments
+  // that need a derivative, so a node can compute what these calls share
+  // (only for nodes that support multibatch, with the whole batch)
+  virtual void backward_prepare(const std::vector<const Tensor*>& xs,
+                                const Tensor& fx,
+                                const Tensor& dEdf) const {}
 
   // whether this node supports computing multiple batches in one call.
   // if true, forward and backward will be called once with a multi-batch tensor.
   // if false, forward and backward will be called multiple times for each item.
   virtual bool supports_multibatch() const { return false; }
 
+  // whether forward draws from rndeng; ParallelExecutionEngine runs such
+  // nodes in the thread that evaluates the graph
+  virtual bool uses_random_numbers() const { return false; }
+
   // perform the forward/backward passes in one or multiple calls
   virtual void forward(const std::vector<const Tensor*>& xs,
                        Tensor& fx) const final;
@@ -173,16 +216,16 @@ struct Node {
   inline unsigned arity() const { return args.size(); }
 
   // dependency structure
-  std::vector<VariableIndex> args;
+  NodeArgs args;
 
   // memory size
   Dim dim;  // will be .size() = 0 initially filled in by forward() -- TODO fix this
 
  protected:
   Node() : args() {}
-  explicit Node(const std::initializer_list<VariableIndex>& a) : args(a) {}
+  explicit Node(const std::initializer_list<VariableIndex>& a) : args(a.begin(), a.size()) {}
   template <typename T>
-  explicit Node(const T&c) : args(c.begin(), c.end()) {}
+  explicit Node(const T&c) : args(c.data(), c.size()) {}
 
  public:
   // auxiliary memory
@@ -193,10 +236,30 @@ struct Node {
                  // backend
 };
 
+template <class Function, typename... Args>
+inline Node* ComputationGraph::make_node(Args&&... args) {
+  static_assert(alignof(Function) <= NodeArena::kAlign, "node type is overaligned");
+  Node* node = new (node_arena.allocate(sizeof(Function))) Function(std::forward<Args>(args)...);
+  if (!node->args.empty()) {
+    // the node was given a view of the caller's argument list
+    const unsigned n = node->args.size();
+    VariableIndex* a = static_cast<VariableIndex*>(node_arena.allocate(n * sizeof(VariableIndex)));
+    std::copy(node->args.begin(), node->args.end(), a);
+    node->args = NodeArgs(a, n);
+  }
+  return node;
+}
+
+template <class Function, typename... Args>
+inline VariableIndex ComputationGraph::new_node(Args&&... args) {
+  VariableIndex new_node_index(nodes.size());
+  nodes.push_back(make_node<Function>(std::forward<Args>(args)...));
+  return new_node_index;
+}
+
 template <class Function>
 inline VariableIndex ComputationGraph::add_function(const std::initializer_list<VariableIndex>& arguments) {
-  VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new Function(arguments));
+  VariableIndex new_node_index = new_node<Function>(arguments);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
@@ -205,20 +268,30 @@ inline VariableIndex ComputationGraph::add_function(const std::initializer_list<
 template <class Function, typename... Args>
 inline VariableIndex ComputationGraph::add_function(const std::initializer_list<VariableIndex>& arguments,
                                               Args&&... side_information) {
-  VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new Function(arguments, std::forward<Args>(side_information)...));
+  VariableIndex new_node_index = new_node<Function>(arguments, std::forward<Args>(side_information)...);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
 template <class Function, typename T>
 inline VariableIndex ComputationGraph::add_function(const T& arguments) {
-  VariableIndex new_node_index(nodes.size());
-  nodes.push_back(new Function(arguments));
+  VariableIndex new_node_index = new_node<Function>(arguments);
   set_dim_for_new_node(new_node_index);
   return new_node_index;
 }
 
+template <class Function, typename... Args>
+inline void ComputationGraph::replace_function(VariableIndex i, const std::vector<VariableIndex>& arguments,
+                                               Args&&... side_information) {
+  Node* node = make_node<Function>(arguments, std::forward<Args>(side_information)...);
+  const Dim d = nodes[i]->dim;
+  nodes[i]->~Node();
+  nodes[i] = node;
+  set_dim_for_new_node(i);
+  assert(nodes[i]->dim == d);
+  (void)d;
+}
+
 } // namespace cnn
 
 #endif
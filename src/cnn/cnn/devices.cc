@@ -1,5 +1,6 @@
 #include "cnn/devices.h"
 
+#include <algorithm>
 #include <iostream>
 
 #include "cnn/cuda.h"
@@ -10,9 +11,63 @@ namespace cnn {
 
 Device::~Device() {}
 
+void Device::init_graph_pools(size_t byte_count) {
+  graph_pool_bytes = byte_count;
+  graph_pools.push_back(make_pair(fxs, dEdfs));
+  unused_graph_pools.push_back(make_pair(fxs, dEdfs));
+}
+
+void Device::acquire_graph_pools(AlignedMemoryPool** fx_pool, AlignedMemoryPool** dEdf_pool) {
+  {
+    lock_guard<mutex> lock(graph_pools_mutex);
+    if (unused_graph_pools.size() > 0) {
+      *fx_pool = unused_graph_pools.back().first;
+      *dEdf_pool = unused_graph_pools.back().second;
+      unused_graph_pools.pop_back();
+      return;
+    }
+  }
+  *fx_pool = new AlignedMemoryPool(graph_pool_bytes, mem);
+  *dEdf_pool = new AlignedMemoryPool(graph_pool_bytes, mem);
+  lock_guard<mutex> lock(graph_pools_mutex);
+  graph_pools.push_back(make_pair(*fx_pool, *dEdf_pool));
+}
+
+void Device::release_graph_pools(AlignedMemoryPool* fx_pool, AlignedMemoryPool* dEdf_pool) {
+  lock_guard<mutex> lock(graph_pools_mutex);
+  unused_graph_pools.push_back(make_pair(fx_pool, dEdf_pool));
+}
+
+void Device::free_graph_pools() {
+  lock_guard<mutex> lock(graph_pools_mutex);
+  for (auto& p : unused_graph_pools) {
+    graph_pools.erase(find(graph_pools.begin(), graph_pools.end(), p));
+    delete p.first;
+    delete p.second;
+  }
+  unused_graph_pools.clear();
+}
+
+static void show_pool(ostream& out, const string& name, const AlignedMemoryPool& pool) {
+  const double mb = 1 << 20;
+  out << "[cnn] " << name << ": " << pool.used_bytes() / mb << "MB used, "
+      << pool.peak_bytes() / mb << "MB peak, " << pool.reserved_bytes() / mb << "MB reserved\n";
+}
+
+void Device::show_pool_mem_info(ostream& out) {
+  lock_guard<mutex> lock(graph_pools_mutex);
+  for (unsigned i = 0; i < graph_pools.size(); ++i) {
+    const string suffix = graph_pools.size() > 1 ? " " + to_string(i) : "";
+    show_pool(out, name + " forward pool" + suffix, *graph_pools[i].first);
+    show_pool(out, name + " backward pool" + suffix, *graph_pools[i].second);
+  }
+  show_pool(out, name + " parameter pool", *ps);
+}
+
 #if HAVE_CUDA
 Device_GPU::Device_GPU(int mb, int device_id) :
     Device(DeviceType::GPU, &gpu_mem), cuda_device_id(device_id), gpu_mem(device_id) {
+  name = "GPU:" + to_string(device_id);
   CUDA_CHECK(cudaSetDevice(device_id));
   CUBLAS_CHECK(cublasCreate(&cublas_handle));
   CUBLAS_CHECK(cublasSetPointerMode(cublas_handle, CUBLAS_POINTER_MODE_DEVICE));
@@ -32,7 +87,7 @@ Device_GPU::Device_GPU(int mb, int device_id) :
   fxs = new AlignedMemoryPool(byte_count, mem); // memory for node values
   dEdfs = new AlignedMemoryPool(byte_count, mem); // memory for node gradients
   ps = new AlignedMemoryPool(byte_count, mem); // memory for parameters
-
+  init_graph_pools(byte_count);
 }
 
 Device_GPU::~Device_GPU() {}
@@ -45,6 +100,7 @@ Device_GPU::~Device_GPU() {}
 //     -- 50mb dEdfx
 Device_CPU::Device_CPU(int mb, bool shared) :
     Device(DeviceType::CPU, &cpu_mem), shmem(mem) {
+  name = "CPU";
   if (shared) shmem = new SharedAllocator();
   kSCALAR_MINUSONE = (float*) mem->malloc(sizeof(float));
   *kSCALAR_MINUSONE = -1;
@@ -59,7 +115,7 @@ Device_CPU::Device_CPU(int mb, bool shared) :
   fxs = new AlignedMemoryPool(byte_count, mem); // memory for node values
   dEdfs = new AlignedMemoryPool(byte_count, mem); // memory for node gradients
   ps = new AlignedMemoryPool(byte_count, mem); // memory for parameters
-
+  init_graph_pools(byte_count);
 }
 
 Device_CPU::~Device_CPU() {}
@@ -1,7 +1,11 @@
 #ifndef CNN_DEVICES_H
 #define CNN_DEVICES_H
 
+#include <iosfwd>
 #include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
 #include "cnn/aligned-mem-pool.h"
 #include "cnn/cuda.h"
 
@@ -15,7 +19,21 @@ class Device {
   Device(const Device&) = delete;
   Device& operator=(const Device&) = delete;
   virtual ~Device();
+  // makes fxs and dEdfs (of byte_count bytes each) the first graph pools
+  void init_graph_pools(size_t byte_count);
  public:
+  // the pools for the node values and derivatives of a ComputationGraph:
+  // every graph that exists at the same time (e.g. in different threads)
+  // needs pools of its own. fxs and dEdfs are used by the first graph, and
+  // more pools of the same size are allocated when needed; they are kept
+  // for reuse by later graphs once released
+  void acquire_graph_pools(AlignedMemoryPool** fx_pool, AlignedMemoryPool** dEdf_pool);
+  void release_graph_pools(AlignedMemoryPool* fx_pool, AlignedMemoryPool* dEdf_pool);
+  void free_graph_pools();
+  // writes the bytes in use, the high-water mark and the bytes reserved of
+  // every memory pool of the device to out
+  void show_pool_mem_info(std::ostream& out);
+
   DeviceType type;
   MemAllocator* mem;
   AlignedMemoryPool* fxs;
@@ -25,6 +43,11 @@ class Device {
   float* kSCALAR_ONE;
   float* kSCALAR_ZERO;
   std::string name;
+ private:
+  size_t graph_pool_bytes;
+  std::vector<std::pair<AlignedMemoryPool*, AlignedMemoryPool*>> graph_pools;
+  std::vector<std::pair<AlignedMemoryPool*, AlignedMemoryPool*>> unused_graph_pools;
+  std::mutex graph_pools_mutex;
 };
 
 #if HAVE_CUDA
@@ -1,12 +1,32 @@
 #include "cnn/exec.h"
 
 #include "cnn/param-nodes.h"
+#include "cnn/nodes.h"
+#include "cnn/graph.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <typeinfo>
+
+#include <pthread.h>
 
 using namespace std;
 
 namespace cnn {
 
-ExecutionEngine::~ExecutionEngine() {}
+ExecutionEngine::ExecutionEngine(const ComputationGraph& cg) : cg(cg) {
+  default_device->acquire_graph_pools(&fxs, &dEdfs);
+}
+
+ExecutionEngine::~ExecutionEngine() {
+  default_device->release_graph_pools(fxs, dEdfs);
+}
 
 void SimpleExecutionEngine::invalidate() {
   num_nodes_evaluated = 0;
@@ -45,37 +65,48 @@ const Tensor& SimpleExecutionEngine::incremental_forward(VariableIndex i) {
     nfxs.resize(i + 1);
 
     //vector<string> dummy(5, "x");
-    vector<const Tensor*> xs(16);
-    for (; num_nodes_evaluated <= i; ++num_nodes_evaluated) {
-      const Node* node = cg.nodes[num_nodes_evaluated];
-      xs.resize(node->arity());
-      unsigned ai = 0;
-      for (VariableIndex arg : node->args) {
-        xs[ai] = &nfxs[arg];
-        ++ai;
-      }
-      nfxs[num_nodes_evaluated].d = node->dim;
-      nfxs[num_nodes_evaluated].v = static_cast<float*>(fxs->allocate(node->dim.size() * sizeof(float)));
-      if (nfxs[num_nodes_evaluated].v == nullptr) {
-        cerr << "out of memory\n";
-        abort();
-      }
-      void* aux_mem = nullptr;
-      size_t aux_size = node->aux_storage_size();
-      if (aux_size) {
-        aux_mem = fxs->allocate(aux_size);
-        if (!aux_mem) {
-          cerr << "aux out of memory\n";
-          abort();
-        }
-      }
-      node->aux_mem = aux_mem;
-      node->forward(xs, nfxs[num_nodes_evaluated]);
-    }
+    for (; num_nodes_evaluated <= i; ++num_nodes_evaluated)
+      forward_node(num_nodes_evaluated);
   }
   return nfxs[i];
 }
 
+void SimpleExecutionEngine::forward_node(VariableIndex i) {
+  allocate_node(i);
+  compute_node(i, &xs);
+}
+
+void SimpleExecutionEngine::allocate_node(VariableIndex i) {
+  const Node* node = cg.nodes[i];
+  nfxs[i].d = node->dim;
+  nfxs[i].v = static_cast<float*>(fxs->allocate(node->dim.size() * sizeof(float)));
+  if (nfxs[i].v == nullptr) {
+    cerr << "out of memory\n";
+    abort();
+  }
+  void* aux_mem = nullptr;
+  size_t aux_size = node->aux_storage_size();
+  if (aux_size) {
+    aux_mem = fxs->allocate(aux_size);
+    if (!aux_mem) {
+      cerr << "aux out of memory\n";
+      abort();
+    }
+  }
+  node->aux_mem = aux_mem;
+}
+
+void SimpleExecutionEngine::compute_node(VariableIndex i, vector<const Tensor*>* xs) {
+  const Node* node = cg.nodes[i];
+  xs->resize(node->arity());
+  unsigned ai = 0;
+  for (VariableIndex arg : node->args) {
+    (*xs)[ai] = &nfxs[arg];
+    ++ai;
+  }
+  node->forward(*xs, nfxs[i]);
+}
+
 void SimpleExecutionEngine::backward() {
   assert(nfxs.size() == cg.nodes.size());
   backward((VariableIndex)(cg.nodes.size()-1));
@@ -83,6 +114,22 @@ void SimpleExecutionEngine::backward() {
 
 // TODO what is happening with parameter nodes if from_where > param_node_id ?
 void SimpleExecutionEngine::backward(VariableIndex from_where) {
+  vector<bool> needs_derivative, in_computation;
+  prepare_backward(from_where, &needs_derivative, &in_computation);
+
+  // loop in reverse topological order
+  // consider only nodes that participate in the computation.
+  for (int i = from_where; i >= 0; --i) {
+    if (in_computation[i])
+      backward_node((VariableIndex)i, needs_derivative);
+  }
+
+  accumulate_parameter_gradients();
+}
+
+void SimpleExecutionEngine::prepare_backward(VariableIndex from_where,
+                                             vector<bool>* needs_derivative,
+                                             vector<bool>* in_computation) {
   assert(from_where+1 <= nfxs.size());
   assert(from_where+1 <= cg.nodes.size());
   if (nfxs[from_where].d.size() != 1) {
@@ -94,7 +141,7 @@ void SimpleExecutionEngine::backward(VariableIndex from_where) {
   ndEdfs.resize(num_nodes);
   dEdfs->free();
   for (unsigned i = 0; i < num_nodes; ++i) {
-    const auto dim = nfxs[i].d;
+    const auto dim = cg.nodes[i]->dim;
     ndEdfs[i].d = dim;
     ndEdfs[i].v = static_cast<float*>(dEdfs->allocate(dim.size() * sizeof(float)));
     if (!ndEdfs[i].v) {
@@ -112,47 +159,480 @@ void SimpleExecutionEngine::backward(VariableIndex from_where) {
   //   2) it depends on a non-constant node
   // (thus, functions of constants and inputs end up being
   //  false in this computation)
-  vector<bool> needs_derivative(num_nodes, false);
+  needs_derivative->assign(num_nodes, false);
   for (auto i : cg.parameter_nodes)
-    needs_derivative[i] = true;
+    if (i < num_nodes) (*needs_derivative)[i] = true;
 
   for (unsigned ni = 0; ni < num_nodes; ++ni) {
-    bool nd = needs_derivative[ni];
+    bool nd = (*needs_derivative)[ni];
     for (auto arg : cg.nodes[ni]->args)
-      nd |= needs_derivative[arg];
-    needs_derivative[ni] = nd;
+      nd = nd || (*needs_derivative)[arg];
+    (*needs_derivative)[ni] = nd;
   }
 
-  // loop in reverse topological order
-  // consider only nodes that participate in the computation.
-  vector<bool> in_computation(num_nodes, false);
-  in_computation[num_nodes - 1] = true;
-  vector<const Tensor*> xs;
+  // nodes that participate in the computation of from_where
+  in_computation->assign(num_nodes, false);
+  (*in_computation)[num_nodes - 1] = true;
   for (int i = num_nodes - 1; i >= 0; --i) {
-    if (!in_computation[i]) continue;
+    if (!(*in_computation)[i]) continue;
+    for (VariableIndex arg : cg.nodes[i]->args)
+      (*in_computation)[arg] = true;
+  }
+}
+
+void SimpleExecutionEngine::backward_node(VariableIndex i, const vector<bool>& needs_derivative) {
+  const Node* node = cg.nodes[i];
+  xs.resize(node->arity());
+  unsigned ai = 0;
+  for (VariableIndex arg : node->args) {
+    xs[ai] = &nfxs[arg];
+    ++ai;
+  }
+  if (needs_derivative[i]) node->backward_prepare(xs, nfxs[i], ndEdfs[i]);
+  ai = 0;
+  for (VariableIndex arg : node->args) {
+    if (needs_derivative[arg]) {
+      node->backward(xs, nfxs[i], ndEdfs[i], ai, ndEdfs[arg]);
+    }
+    ++ai;
+  }
+}
+
+// accumulate gradients into parameters
+// this is simpler than you might find in some other frameworks
+// since we assume parameters come into the graph as a "function"
+// that returns the current value of the parameters
+void SimpleExecutionEngine::accumulate_parameter_gradients() {
+  for (VariableIndex i : cg.parameter_nodes)
+    if (i < ndEdfs.size())
+      static_cast<ParameterNodeBase*>(cg.nodes[i])->accumulate_grad(ndEdfs[i]);
+}
+
+void SimpleExecutionEngine::compute_levels(VariableIndex first, VariableIndex last,
+                                           vector<vector<VariableIndex>>* levels) const {
+  levels->clear();
+  vector<unsigned> depth(last + 1 - first);
+  for (VariableIndex i = first; i <= last; ++i) {
+    unsigned d = 0;
+    for (VariableIndex arg : cg.nodes[i]->args)
+      if (arg >= first) d = max(d, depth[arg - first] + 1);
+    depth[i - first] = d;
+    if (d >= levels->size()) levels->resize(d + 1);
+    (*levels)[d].push_back(i);
+  }
+}
+
+const Tensor& BatchedExecutionEngine::incremental_forward(VariableIndex i) {
+  assert(i < cg.nodes.size());
+
+  // free any old memory if this is a new CG
+  if (num_nodes_evaluated == 0) fxs->free();
+
+  if (i >= num_nodes_evaluated) {
+    nfxs.resize(i + 1);
+    vector<vector<VariableIndex>> levels, groups;
+    compute_levels(num_nodes_evaluated, i, &levels);
+    for (auto& level : levels) {
+      group_nodes(level, &groups);
+      for (auto& group : groups) {
+        if (group.size() > 1)
+          forward_affine_group(group);
+        else
+          forward_node(group[0]);
+      }
+    }
+    num_nodes_evaluated = i + 1;
+  }
+  return nfxs[i];
+}
+
+void BatchedExecutionEngine::backward(VariableIndex from_where) {
+  vector<bool> needs_derivative, in_computation;
+  prepare_backward(from_where, &needs_derivative, &in_computation);
+
+  // every node that uses a node is in a deeper level, so running the levels
+  // in reverse order is a reverse topological order
+  vector<vector<VariableIndex>> levels, groups;
+  compute_levels((VariableIndex)0, from_where, &levels);
+  vector<VariableIndex> level;
+  for (int l = levels.size() - 1; l >= 0; --l) {
+    level.clear();
+    for (auto i : levels[l])
+      if (in_computation[i]) level.push_back(i);
+    group_nodes(level, &groups);
+    for (auto& group : groups) {
+      if (group.size() > 1)
+        backward_affine_group(group, needs_derivative);
+      else
+        backward_node(group[0], needs_derivative);
+    }
+  }
+
+  accumulate_parameter_gradients();
+}
+
+// an AffineTransform of column vectors with at least one product
+static bool is_batchable_affine(const ComputationGraph& cg, const Node* node) {
+#if HAVE_CUDA
+  return false;
+#else
+  if (node->arity() < 3 || typeid(*node) != typeid(AffineTransform)) return false;
+  if (node->dim.bd != 1 || node->dim.cols() != 1) return false;
+  for (VariableIndex arg : node->args) {
+    const Dim& d = cg.nodes[arg]->dim;
+    if (d.bd != 1) return false;
+  }
+  for (unsigned ai = 2; ai < node->arity(); ai += 2)
+    if (cg.nodes[node->args[ai]]->dim.cols() != 1) return false;
+  return true;
+#endif
+}
+
+void BatchedExecutionEngine::group_nodes(const vector<VariableIndex>& level,
+                                         vector<vector<VariableIndex>>* groups) const {
+  groups->clear();
+  // affine transforms with the same bias and weights go in one group
+  map<vector<VariableIndex>, unsigned> affine_groups;
+  vector<VariableIndex> key;
+  for (auto i : level) {
     const Node* node = cg.nodes[i];
-    xs.resize(node->arity());
-    unsigned ai = 0;
-    for (VariableIndex arg : node->args) {
-      in_computation[arg] = true;
-      xs[ai] = &nfxs[arg];
-      ++ai;
-    }
-    ai = 0;
-    for (VariableIndex arg : node->args) {
-      if (needs_derivative[arg]) {
-        node->backward(xs, nfxs[i], ndEdfs[i], ai, ndEdfs[arg]);
+    if (!is_batchable_affine(cg, node)) {
+      groups->push_back(vector<VariableIndex>(1, i));
+      continue;
+    }
+    key.clear();
+    key.push_back(node->args[0]);
+    for (unsigned ai = 1; ai < node->arity(); ai += 2)
+      key.push_back(node->args[ai]);
+    auto it = affine_groups.find(key);
+    if (it == affine_groups.end()) {
+      affine_groups[key] = groups->size();
+      groups->push_back(vector<VariableIndex>(1, i));
+    } else {
+      (*groups)[it->second].push_back(i);
+    }
+  }
+}
+
+float* BatchedExecutionEngine::gather_columns(const vector<Tensor>& ts,
+                                              const vector<VariableIndex>& idx,
+                                              AlignedMemoryPool* pool) const {
+  const unsigned n = ts[idx[0]].d.size();
+  bool adjacent = true;
+  for (unsigned j = 1; j < idx.size() && adjacent; ++j)
+    adjacent = (ts[idx[j]].v == ts[idx[0]].v + j * n);
+  if (adjacent) return ts[idx[0]].v;
+  float* m = static_cast<float*>(pool->allocate(n * idx.size() * sizeof(float)));
+  if (!m) {
+    cerr << "out of memory while batching operations\n";
+    abort();
+  }
+  for (unsigned j = 0; j < idx.size(); ++j)
+    memcpy(m + j * n, ts[idx[j]].v, n * sizeof(float));
+  return m;
+}
+
+void BatchedExecutionEngine::forward_affine_group(const vector<VariableIndex>& group) {
+  const Node* node = cg.nodes[group[0]];
+  const unsigned rows = node->dim.rows();
+  const unsigned ncols = group.size();
+  // the values of the group are adjacent, so together they form the output matrix
+  float* out = static_cast<float*>(fxs->allocate(rows * ncols * sizeof(float)));
+  if (!out) {
+    cerr << "out of memory\n";
+    abort();
+  }
+  for (unsigned j = 0; j < ncols; ++j) {
+    nfxs[group[j]].d = node->dim;
+    nfxs[group[j]].v = out + j * rows;
+    cg.nodes[group[j]]->aux_mem = nullptr;
+  }
+  Eigen::Map<Eigen::MatrixXf> y(out, rows, ncols);
+  y.colwise() = nfxs[node->args[0]].vec();
+  vector<VariableIndex> xi(ncols);
+  for (unsigned ai = 1; ai < node->arity(); ai += 2) {
+    const Tensor& w = nfxs[node->args[ai]];
+    for (unsigned j = 0; j < ncols; ++j) xi[j] = cg.nodes[group[j]]->args[ai + 1];
+    const unsigned xrows = w.d.cols();
+    Eigen::Map<Eigen::MatrixXf> x(gather_columns(nfxs, xi, fxs), xrows, ncols);
+    y.noalias() += *w * x;
+  }
+}
+
+void BatchedExecutionEngine::backward_affine_group(const vector<VariableIndex>& group,
+                                                   const vector<bool>& needs_derivative) {
+  const Node* node = cg.nodes[group[0]];
+  const unsigned rows = node->dim.rows();
+  const unsigned ncols = group.size();
+  Eigen::Map<Eigen::MatrixXf> g(gather_columns(ndEdfs, group, dEdfs), rows, ncols);
+  const VariableIndex bias = node->args[0];
+  if (needs_derivative[bias])
+    ndEdfs[bias].vec() += g.rowwise().sum();
+  vector<VariableIndex> xi(ncols);
+  for (unsigned ai = 1; ai < node->arity(); ai += 2) {
+    const VariableIndex wi = node->args[ai];
+    const Tensor& w = nfxs[wi];
+    const unsigned xrows = w.d.cols();
+    bool any_x_derivative = false;
+    for (unsigned j = 0; j < ncols; ++j) {
+      xi[j] = cg.nodes[group[j]]->args[ai + 1];
+      any_x_derivative = any_x_derivative || needs_derivative[xi[j]];
+    }
+    if (needs_derivative[wi]) {
+      Eigen::Map<Eigen::MatrixXf> x(gather_columns(nfxs, xi, dEdfs), xrows, ncols);
+      (*ndEdfs[wi]).noalias() += g * x.transpose();
+    }
+    if (any_x_derivative) {
+      float* mem = static_cast<float*>(dEdfs->allocate(xrows * ncols * sizeof(float)));
+      if (!mem) {
+        cerr << "out of memory while attempting to allocate space for derivatives\n";
+        abort();
       }
-      ++ai;
+      Eigen::Map<Eigen::MatrixXf> dx(mem, xrows, ncols);
+      dx.noalias() = (*w).transpose() * g;
+      for (unsigned j = 0; j < ncols; ++j)
+        if (needs_derivative[xi[j]]) ndEdfs[xi[j]].vec() += dx.col(j);
     }
   }
+}
 
-  // accumulate gradients into parameters
-  // this is simpler than you might find in some other frameworks
-  // since we assume parameters come into the graph as a "function"
-  // that returns the current value of the parameters
-  for (VariableIndex i : cg.parameter_nodes)
-    static_cast<ParameterNodeBase*>(cg.nodes[i])->accumulate_grad(ndEdfs[i]);
+namespace {
+
+// the threads that help ParallelExecutionEngine, shared by all graphs
+class WorkerPool {
+ public:
+  explicit WorkerPool(unsigned n) {
+    Eigen::initParallel();
+    for (unsigned t = 0; t < n; ++t)
+      thread([this] { work(); }).detach();
+  }
+
+  // calls f(0), ..., f(n - 1) in this thread and in any idle workers, and
+  // returns when all the calls are done
+  void run(unsigned n, const function<void(unsigned)>& f) {
+    Job job(n, f);
+    {
+      lock_guard<mutex> lock(m);
+      jobs.push_back(&job);
+    }
+    job_added.notify_all();
+    job.help();
+    unique_lock<mutex> lock(m);
+    remove(&job);
+    job_left.wait(lock, [&job] { return job.num_workers == 0; });
+  }
+
+ private:
+  struct Job {
+    Job(unsigned n, const function<void(unsigned)>& f) : n(n), f(f), next(0), num_workers(0) {}
+    // runs calls until there are none left to start
+    void help() {
+      for (unsigned k = next++; k < n; k = next++) f(k);
+    }
+    const unsigned n;
+    const function<void(unsigned)>& f;
+    atomic<unsigned> next;
+    unsigned num_workers;  // other than the one that submitted it, guarded by m
+  };
+
+  void work() {
+    unique_lock<mutex> lock(m);
+    while (true) {
+      job_added.wait(lock, [this] { return !jobs.empty(); });
+      Job* job = jobs.front();
+      ++job->num_workers;
+      lock.unlock();
+      job->help();
+      lock.lock();
+      // every call has been started, so no one else needs to join
+      remove(job);
+      --job->num_workers;
+      job_left.notify_all();
+    }
+  }
+
+  void remove(Job* job) {
+    auto it = find(jobs.begin(), jobs.end(), job);
+    if (it != jobs.end()) jobs.erase(it);
+  }
+
+  mutex m;
+  condition_variable job_added, job_left;
+  vector<Job*> jobs;
+};
+
+// set in a process forked after the pool was started (e.g. a worker of
+// mp::ParallelMap): fork() only copies the calling thread, so the child has
+// no workers, and may even have copied m while a worker held it
+bool forked_child = false;
+
+// the pool, or null in a forked child, which evaluates serially
+WorkerPool* worker_pool() {
+  // never destroyed, as the workers never stop
+  static WorkerPool* pool = [] {
+    pthread_atfork(nullptr, nullptr, [] { forked_child = true; });
+    return new WorkerPool(num_threads - 1);
+  }();
+  return forked_child ? nullptr : pool;
+}
+
+} // namespace
+
+size_t ParallelExecutionEngine::min_parallel_work = 1 << 15;
+
+size_t ParallelExecutionEngine::work(const vector<VariableIndex>& level) const {
+  size_t w = 0, max_w = 0;
+  for (auto i : level) {
+    const Node* node = cg.nodes[i];
+    size_t wi = node->dim.size();
+    for (VariableIndex arg : node->args)
+      wi += cg.nodes[arg]->dim.size();
+    w += wi;
+    max_w = max(max_w, wi);
+  }
+  // the level takes at least as long as its largest node
+  return w - max_w;
+}
+
+const Tensor& ParallelExecutionEngine::incremental_forward(VariableIndex i) {
+  assert(i < cg.nodes.size());
+
+  // free any old memory if this is a new CG
+  if (num_nodes_evaluated == 0) fxs->free();
+
+  if (i >= num_nodes_evaluated) {
+    nfxs.resize(i + 1);
+    vector<vector<VariableIndex>> levels;
+    compute_levels(num_nodes_evaluated, i, &levels);
+    vector<VariableIndex> parallel;
+    WorkerPool* pool = worker_pool();
+    for (auto& level : levels) {
+      if (!pool || level.size() < 2 || work(level) < min_parallel_work) {
+        for (auto j : level) forward_node(j);
+        continue;
+      }
+      parallel.clear();
+      for (auto j : level) {
+        allocate_node(j);
+        if (cg.nodes[j]->uses_random_numbers())
+          compute_node(j, &xs);
+        else
+          parallel.push_back(j);
+      }
+      pool->run(parallel.size(), [this, &parallel](unsigned k) {
+        thread_local vector<const Tensor*> args;
+        compute_node(parallel[k], &args);
+      });
+    }
+    num_nodes_evaluated = i + 1;
+  }
+  return nfxs[i];
+}
+
+void ParallelExecutionEngine::backward(VariableIndex from_where) {
+  vector<bool> needs_derivative, in_computation;
+  prepare_backward(from_where, &needs_derivative, &in_computation);
+
+  vector<vector<VariableIndex>> levels;
+  compute_levels((VariableIndex)0, from_where, &levels);
+  num_updates.assign(from_where + 1, 0);
+  vector<VariableIndex> level;
+  WorkerPool* pool = worker_pool();
+  for (int l = levels.size() - 1; l >= 0; --l) {
+    level.clear();
+    for (auto i : levels[l])
+      if (in_computation[i]) level.push_back(i);
+    if (!pool || level.size() < 2 || work(level) < min_parallel_work) {
+      for (auto i : level) SimpleExecutionEngine::backward_node(i, needs_derivative);
+      continue;
+    }
+    for (auto i : level)
+      for (VariableIndex arg : cg.nodes[i]->args) ++num_updates[arg];
+    pool->run(level.size(), [this, &level, &needs_derivative](unsigned k) {
+      thread_local vector<const Tensor*> args;
+      backward_node(level[k], needs_derivative, false, &args);
+    });
+    for (auto i : level)
+      backward_node(i, needs_derivative, true, &xs);
+    for (auto i : level)
+      for (VariableIndex arg : cg.nodes[i]->args) num_updates[arg] = 0;
+  }
+
+  accumulate_parameter_gradients();
+}
+
+void ParallelExecutionEngine::backward_node(VariableIndex i, const vector<bool>& needs_derivative,
+                                            bool shared, vector<const Tensor*>* xs) {
+  const Node* node = cg.nodes[i];
+  xs->resize(node->arity());
+  unsigned ai = 0;
+  for (VariableIndex arg : node->args) {
+    (*xs)[ai] = &nfxs[arg];
+    ++ai;
+  }
+  // the unshared arguments go first
+  if (!shared && needs_derivative[i]) node->backward_prepare(*xs, nfxs[i], ndEdfs[i]);
+  ai = 0;
+  for (VariableIndex arg : node->args) {
+    if (needs_derivative[arg] && (num_updates[arg] > 1) == shared)
+      node->backward(*xs, nfxs[i], ndEdfs[i], ai, ndEdfs[arg]);
+    ++ai;
+  }
+}
+
+void OptimizingExecutionEngine::invalidate() {
+  SimpleExecutionEngine::invalidate();
+  evaluated.clear();
+}
+
+const Tensor& OptimizingExecutionEngine::incremental_forward(VariableIndex i) {
+  assert(i < cg.nodes.size());
+
+  // free any old memory if this is a new CG
+  if (num_nodes_evaluated == 0) fxs->free();
+
+  if (i >= num_nodes_evaluated) {
+    GraphOptimize(&graph, num_nodes_evaluated, i);
+    num_nodes_evaluated = i + 1;
+  }
+  evaluate(i);
+  return nfxs[i];
+}
+
+const Tensor& OptimizingExecutionEngine::get_value(VariableIndex i) {
+  return incremental_forward(i);
+}
+
+void OptimizingExecutionEngine::backward(VariableIndex from_where) {
+  incremental_forward(from_where);
+  SimpleExecutionEngine::backward(from_where);
+}
+
+void OptimizingExecutionEngine::evaluate(VariableIndex i) {
+  if (evaluated.size() <= (unsigned)i) {
+    evaluated.resize(cg.nodes.size(), false);
+    nfxs.resize(cg.nodes.size());
+  }
+  if (evaluated[i]) return;
+  // the arguments of a node come before it, so computing the nodes that are
+  // needed in order of their indices computes every argument before its uses
+  pending.clear();
+  stack.assign(1, i);
+  evaluated[i] = true;
+  while (!stack.empty()) {
+    const VariableIndex j = stack.back();
+    stack.pop_back();
+    pending.push_back(j);
+    for (VariableIndex arg : cg.nodes[j]->args) {
+      if (!evaluated[arg]) {
+        evaluated[arg] = true;
+        stack.push_back(arg);
+      }
+    }
+  }
+  sort(pending.begin(), pending.end());
+  for (VariableIndex j : pending)
+    forward_node(j);
 }
 
 } // namespace cnn
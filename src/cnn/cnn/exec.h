@@ -17,8 +17,12 @@ class ExecutionEngine {
   virtual void backward() = 0;
   virtual void backward(VariableIndex i) = 0;
  protected:
-  explicit ExecutionEngine(const ComputationGraph& cg) : cg(cg) {}
+  explicit ExecutionEngine(const ComputationGraph& cg);
   const ComputationGraph& cg;
+  // memory for the node values and derivatives of this graph only
+  // (see Device::acquire_graph_pools)
+  AlignedMemoryPool* fxs;
+  AlignedMemoryPool* dEdfs;
 };
 
 class SimpleExecutionEngine : public ExecutionEngine {
@@ -32,12 +36,117 @@ class SimpleExecutionEngine : public ExecutionEngine {
   const Tensor& get_value(VariableIndex i) override;
   void backward() override;
   void backward(VariableIndex i) override;
- private:
+ protected:
+  // allocates memory for the value of node i and computes it
+  void forward_node(VariableIndex i);
+  // ... in two steps; only the first one uses the memory pools
+  void allocate_node(VariableIndex i);
+  void compute_node(VariableIndex i, std::vector<const Tensor*>* xs);
+  // allocates and zeroes the derivatives of nodes [0, from_where] and finds
+  // the nodes that need derivatives and those that from_where depends on
+  void prepare_backward(VariableIndex from_where,
+                        std::vector<bool>* needs_derivative,
+                        std::vector<bool>* in_computation);
+  // backpropagates the derivative of node i to its arguments
+  void backward_node(VariableIndex i, const std::vector<bool>& needs_derivative);
+  // adds the derivatives of the parameter nodes to the parameter gradients
+  void accumulate_parameter_gradients();
+  // nodes [first, last] by depth, where nodes before first have depth 0
+  void compute_levels(VariableIndex first, VariableIndex last,
+                      std::vector<std::vector<VariableIndex>>* levels) const;
+
   std::vector<Tensor> nfxs;
   std::vector<Tensor> ndEdfs;
+  std::vector<const Tensor*> xs;
   VariableIndex num_nodes_evaluated;
 };
 
+// evaluates the graph one depth level at a time (a node's level is one more
+// than that of its deepest argument), so that identical operations from
+// independent parts of the graph, e.g. different sentences or different
+// parser states, can be run together. currently AffineTransform nodes in
+// a level that share their bias and weight arguments are computed with a
+// single matrix-matrix product per weight matrix, both in the forward and
+// in the backward pass; all other nodes are run one at a time.
+// enabled for every ComputationGraph with --cnn-autobatch
+class BatchedExecutionEngine : public SimpleExecutionEngine {
+ public:
+  explicit BatchedExecutionEngine(const ComputationGraph& cg) : SimpleExecutionEngine(cg) {}
+  using SimpleExecutionEngine::incremental_forward;
+  using SimpleExecutionEngine::backward;
+  const Tensor& incremental_forward(VariableIndex i) override;
+  void backward(VariableIndex i) override;
+ private:
+  // splits a level into groups of nodes that can be run together
+  void group_nodes(const std::vector<VariableIndex>& level,
+                   std::vector<std::vector<VariableIndex>>* groups) const;
+  // ts[idx[j]] (which must all have the same size) as the columns of a
+  // matrix; only copied (into memory from pool) if not already adjacent
+  float* gather_columns(const std::vector<Tensor>& ts,
+                        const std::vector<VariableIndex>& idx,
+                        AlignedMemoryPool* pool) const;
+  void forward_affine_group(const std::vector<VariableIndex>& group);
+  void backward_affine_group(const std::vector<VariableIndex>& group,
+                             const std::vector<bool>& needs_derivative);
+};
+
+// optimizes each part of the graph with GraphOptimize when it is first
+// evaluated, and then evaluates only the nodes that the requested value
+// depends on, so nodes that were replaced by fused nodes (and any others
+// whose values are never used) are not computed. the values of other nodes
+// are computed if get_value asks for them.
+// enabled for every ComputationGraph with --cnn-optimize
+class OptimizingExecutionEngine : public SimpleExecutionEngine {
+ public:
+  explicit OptimizingExecutionEngine(ComputationGraph& cg) : SimpleExecutionEngine(cg), graph(cg) {}
+  using SimpleExecutionEngine::incremental_forward;
+  using SimpleExecutionEngine::backward;
+  void invalidate() override;
+  const Tensor& incremental_forward(VariableIndex i) override;
+  const Tensor& get_value(VariableIndex i) override;
+  void backward(VariableIndex i) override;
+ private:
+  // computes node i and those of its arguments that have not been computed
+  void evaluate(VariableIndex i);
+
+  ComputationGraph& graph;
+  // (num_nodes_evaluated is the number of nodes that have been optimized)
+  std::vector<bool> evaluated;
+  std::vector<VariableIndex> stack, pending;
+};
+
+// evaluates the graph one depth level at a time, like
+// BatchedExecutionEngine, and splits the nodes of each level among
+// num_threads threads (the one that evaluates the graph and a pool of
+// workers shared by all graphs), which take the next node of the level
+// whenever they are done with one. levels with less work than
+// min_parallel_work are run in the calling thread only. in the backward
+// pass, the derivatives of the arguments that several nodes of the level
+// add to are computed in the calling thread after the others, so the
+// results do not depend on the scheduling. a process forked after the
+// pool was started (e.g. by mp::ParallelMap) evaluates serially.
+// enabled for every ComputationGraph with --cnn-threads N, N > 1
+class ParallelExecutionEngine : public SimpleExecutionEngine {
+ public:
+  explicit ParallelExecutionEngine(const ComputationGraph& cg) : SimpleExecutionEngine(cg) {}
+  using SimpleExecutionEngine::incremental_forward;
+  using SimpleExecutionEngine::backward;
+  const Tensor& incremental_forward(VariableIndex i) override;
+  void backward(VariableIndex i) override;
+  // roughly, the number of floats that the nodes of a level other than the
+  // largest one read and write
+  static size_t min_parallel_work;
+ private:
+  size_t work(const std::vector<VariableIndex>& level) const;
+  // backpropagates the derivative of node i to those of its arguments that
+  // other nodes of its level also add to (shared) or to the others (!shared)
+  void backward_node(VariableIndex i, const std::vector<bool>& needs_derivative,
+                     bool shared, std::vector<const Tensor*>* xs);
+
+  // the number of nodes of the current level that add to each derivative
+  std::vector<unsigned> num_updates;
+};
+
 } // namespace cnn
 
 #endif
@@ -59,6 +59,9 @@ Expression hinge(const Expression& x, unsigned index, float m) { return Expressi
 Expression hinge(const Expression& x, const unsigned* pindex, float m) { return Expression(x.pg, x.pg->add_function<Hinge>({x.i}, pindex, m)); }
 Expression log_softmax(const Expression& x) { return Expression(x.pg, x.pg->add_function<LogSoftmax>({x.i})); }
 Expression log_softmax(const Expression& x, const vector<unsigned>& d) { return Expression(x.pg, x.pg->add_function<RestrictedLogSoftmax>({x.i}, d)); }
+Expression restricted_affine_log_softmax(const Expression& b, const Expression& W, const Expression& x, const vector<unsigned>& d) {
+  return Expression(x.pg, x.pg->add_function<RestrictedAffineLogSoftmax>({b.i, W.i, x.i}, d));
+}
 Expression sparsemax(const Expression& x) { return Expression(x.pg, x.pg->add_function<Sparsemax>({x.i})); }
 Expression sparsemax_loss(const Expression& x, const vector<unsigned>& target_support) { return Expression(x.pg, x.pg->add_function<SparsemaxLoss>({x.i}, target_support)); }
 Expression sparsemax_loss(const Expression& x, const vector<unsigned>* ptarget_support) { return Expression(x.pg, x.pg->add_function<SparsemaxLoss>({x.i}, ptarget_support)); }
@@ -105,6 +108,8 @@ Expression pick(const Expression& x, unsigned* pv) { return Expression(x.pg, x.p
 Expression pick(const Expression& x, const vector<unsigned> * pv) { return Expression(x.pg, x.pg->add_function<PickElement>({x.i}, pv)); }
 
 Expression pickrange(const Expression& x, unsigned v, unsigned u) { return Expression(x.pg, x.pg->add_function<PickRange>({x.i}, v, u)); }
+Expression pick_batch_elem(const Expression& x, unsigned v) { return Expression(x.pg, x.pg->add_function<PickBatchElement>({x.i}, v)); }
+Expression pick_batch_elem(const Expression& x, const unsigned* pv) { return Expression(x.pg, x.pg->add_function<PickBatchElement>({x.i}, pv)); }
 
 Expression pickneglogsoftmax(const Expression& x, unsigned v) { return Expression(x.pg, x.pg->add_function<PickNegLogSoftmax>({x.i}, v)); }
 Expression pickneglogsoftmax(const Expression& x, const vector<unsigned> & v) { return Expression(x.pg, x.pg->add_function<PickNegLogSoftmax>({x.i}, v)); }
@@ -117,4 +122,26 @@ Expression sum_batches(const Expression& x) { return Expression(x.pg, x.pg->add_
 
 Expression kmh_ngram(const Expression& x, unsigned n) { return Expression(x.pg, x.pg->add_function<KMHNGram>({x.i}, n)); }
 
+#if HAVE_CUDA
+// LSTMCell has no GPU implementation yet, so the cell is put together from
+// the nodes it replaces
+static Expression lstm_cell_parts(const Expression& a, const Expression* c_tm1,
+                                  const Expression* C2I, const Expression& C2O) {
+  const unsigned hd = a.pg->nodes[a.i]->dim.rows() / 3;
+  Expression it = pickrange(a, 0, hd);
+  if (c_tm1) it = it + *C2I * *c_tm1;
+  it = logistic(it);
+  Expression ct = cwise_multiply(it, tanh(pickrange(a, hd, 2 * hd)));
+  if (c_tm1) ct = cwise_multiply(1.f - it, *c_tm1) + ct;
+  Expression ot = logistic(pickrange(a, 2 * hd, 3 * hd) + C2O * ct);
+  return concatenate({cwise_multiply(ot, tanh(ct)), ct});
+}
+
+Expression lstm_cell(const Expression& a, const Expression& C2O) { return lstm_cell_parts(a, nullptr, nullptr, C2O); }
+Expression lstm_cell(const Expression& a, const Expression& c_tm1, const Expression& C2I, const Expression& C2O) { return lstm_cell_parts(a, &c_tm1, &C2I, C2O); }
+#else
+Expression lstm_cell(const Expression& a, const Expression& C2O) { return Expression(a.pg, a.pg->add_function<LSTMCell>({a.i, C2O.i})); }
+Expression lstm_cell(const Expression& a, const Expression& c_tm1, const Expression& C2I, const Expression& C2O) { return Expression(a.pg, a.pg->add_function<LSTMCell>({a.i, c_tm1.i, C2I.i, C2O.i})); }
+#endif
+
 } }
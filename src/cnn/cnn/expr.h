@@ -75,6 +75,9 @@ Expression hinge(const Expression& x, unsigned index, float m = 1.0);
 Expression hinge(const Expression& x, const unsigned* pindex, float m = 1.0);
 Expression log_softmax(const Expression& x);
 Expression log_softmax(const Expression& x, const std::vector<unsigned>& restriction);
+// log_softmax(affine_transform({b, W, x}), restriction), computing only the restricted rows
+Expression restricted_affine_log_softmax(const Expression& b, const Expression& W, const Expression& x,
+                                         const std::vector<unsigned>& restriction);
 Expression sparsemax(const Expression& x);
 Expression sparsemax_loss(const Expression& x, const std::vector<unsigned>& target_support);
 Expression sparsemax_loss(const Expression& x, const std::vector<unsigned>* ptarget_support);
@@ -130,11 +133,19 @@ Expression pick(const Expression& x, const std::vector<unsigned> & v);
 Expression pick(const Expression& x, unsigned * pv);
 Expression pick(const Expression& x, const std::vector<unsigned> * pv);
 Expression pickrange(const Expression& x, unsigned v, unsigned u);
+Expression pick_batch_elem(const Expression& x, unsigned v);
+Expression pick_batch_elem(const Expression& x, const unsigned* pv);
 Expression pickneglogsoftmax(const Expression& x, unsigned v);
 Expression pickneglogsoftmax(const Expression& x, const std::vector<unsigned> & v);
 Expression pickneglogsoftmax(const Expression& x, unsigned * pv);
 Expression pickneglogsoftmax(const Expression& x, const std::vector<unsigned> * pv);
 
+// the LSTM cell of LSTMBuilder in a single node (see LSTMCell): a holds the
+// pre-activations of the input gate, the memory cell and the output gate
+// without the peephole terms; the result is [h_t; c_t]
+Expression lstm_cell(const Expression& a, const Expression& C2O);
+Expression lstm_cell(const Expression& a, const Expression& c_tm1, const Expression& C2I, const Expression& C2O);
+
 namespace detail {
   template <typename F, typename T>
   Expression f(const T& xs) {
@@ -170,6 +181,11 @@ template <typename T>
 inline Expression concatenate(const T& xs) { return detail::f<Concatenate>(xs); }
 inline Expression concatenate(const std::initializer_list<Expression>& xs) { return detail::f<Concatenate>(xs); }
 
+// stack same-shaped expressions into a single mini-batch
+template <typename T>
+inline Expression concatenate_to_batch(const T& xs) { return detail::f<ConcatenateToBatch>(xs); }
+inline Expression concatenate_to_batch(const std::initializer_list<Expression>& xs) { return detail::f<ConcatenateToBatch>(xs); }
+
 template <typename T>
 inline Expression affine_transform(const T& xs) { return detail::f<AffineTransform>(xs); }
 inline Expression affine_transform(const std::initializer_list<Expression>& xs) { return detail::f<AffineTransform>(xs); }
@@ -1,34 +1,77 @@
 #include "cnn/graph.h"
-#include "cnn/cnn.h"
+#include "cnn/nodes.h"
+
+#include <typeinfo>
 #include <vector>
-#include "cnn/cnn-helper.h"
 
 using namespace std;
 
 namespace cnn {
 
-void GraphOptimize(ComputationGraph* cg) {
-  // topo sort
+void GraphOptimize(ComputationGraph* cg, VariableIndex first, VariableIndex last) {
+#if !HAVE_CUDA
   vector<Node*>& nodes = cg->nodes;
-  vector<int> longest_paths(nodes.size());
-  for (unsigned i = 0; i < nodes.size(); ++i) {
-    auto& v = *nodes[i];  // vertex v_i
-    auto& lp = longest_paths[i]; // distance to v_i
-    for (auto e : v.args) {
-      int weight = 0;
-      if (v.args.size() == 7) weight = 1;
-      int pte = longest_paths[e] + weight;
-      if (pte > lp) lp = pte;
-    }
-  }
-  for (unsigned i = 0; i < nodes.size(); ++i) {
-    vector<string> x;
-    for (auto e : nodes[i]->args) {
-      x.push_back(string("x") + to_string(e));
+  assert(first <= last && last < nodes.size());
+  // the number of uses of each node from first on; the nodes before first
+  // may be used by any of the nodes before them, so they are never fused
+  vector<unsigned> uses(nodes.size() - first);
+  for (unsigned i = first; i < nodes.size(); ++i)
+    for (VariableIndex arg : nodes[i]->args)
+      if (arg >= first) ++uses[arg - first];
+  auto fusable = [&](VariableIndex j, const type_info& type) {
+    return j >= first && uses[j - first] == 1 && typeid(*nodes[j]) == type;
+  };
+
+  vector<VariableIndex> args;
+  for (VariableIndex i = first; i <= last; ++i) {
+    const Node* node = nodes[i];
+    const type_info& type = typeid(*node);
+    if (type == typeid(Rectify) || type == typeid(Tanh) || type == typeid(LogisticSigmoid)) {
+      const VariableIndex a = node->args[0];
+      if (!fusable(a, typeid(AffineTransform)) || nodes[a]->arity() < 3) continue;
+      args.assign(nodes[a]->args.begin(), nodes[a]->args.end());
+      AffineActivation::Activation f = AffineActivation::RECTIFY;
+      if (type == typeid(Tanh)) f = AffineActivation::TANH;
+      else if (type == typeid(LogisticSigmoid)) f = AffineActivation::LOGISTIC;
+      cg->replace_function<AffineActivation>(i, args, f);
+    } else if (type == typeid(Sum) && node->arity() == 2) {
+      // only without broadcasting
+      bool same_dims = true;
+      for (VariableIndex arg : node->args)
+        same_dims = same_dims && nodes[arg]->dim == node->dim;
+      if (!same_dims) continue;
+      args.clear();
+      VariableIndex other = node->args[1];
+      for (VariableIndex arg : node->args) {
+        if (fusable(arg, typeid(CwiseMultiply)) &&
+            nodes[nodes[arg]->args[0]]->dim == node->dim &&
+            nodes[nodes[arg]->args[1]]->dim == node->dim) {
+          args.insert(args.end(), nodes[arg]->args.begin(), nodes[arg]->args.end());
+        } else {
+          other = arg;
+        }
+      }
+      if (args.empty()) continue;
+      if (args.size() == 2) args.push_back(other);
+      cg->replace_function<CwiseMultiplyAdd>(i, args);
+    } else if (type == typeid(PickElement)) {
+      const PickElement* pick = static_cast<const PickElement*>(node);
+      const VariableIndex a = node->args[0];
+      if (!pick->pval || !fusable(a, typeid(RestrictedLogSoftmax))) continue;
+      const RestrictedLogSoftmax* softmax = static_cast<const RestrictedLogSoftmax*>(nodes[a]);
+      args.assign(1, softmax->args[0]);
+      if (pick->pval == &pick->val)
+        cg->replace_function<PickRestrictedLogSoftmax>(i, args, softmax->denom, pick->val);
+      else
+        cg->replace_function<PickRestrictedLogSoftmax>(i, args, softmax->denom, pick->pval);
     }
-    cerr << "LONGEST PATH: " << longest_paths[i] << "\tx" << i << " = " << nodes[i]->as_string(x) << endl;
   }
-  abort();// DEBUGGING
+#endif
+}
+
+void GraphOptimize(ComputationGraph* cg) {
+  if (!cg->nodes.empty())
+    GraphOptimize(cg, (VariableIndex)0, (VariableIndex)(cg->nodes.size() - 1));
 }
 
-} // namespaiice cnn
+} // namespace cnn
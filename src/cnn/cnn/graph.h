@@ -1,9 +1,28 @@
 #ifndef CNN_GRAPH_H
 #define CNN_GRAPH_H
 
+#include "cnn/cnn.h"
+
 namespace cnn {
-struct ComputationGraph;
+
+// replaces the nodes [first, last] of cg by fused nodes (see the end of
+// nodes.h) where they compute, together with an argument that nothing else
+// uses, one of
+//   rectify/tanh/logistic(affine_transform(...))
+//   cwise_multiply(a, b) + c  (and cwise_multiply(a, b) + cwise_multiply(c, d))
+//   pick(log_softmax(x, denom), v)
+// none of these nodes may have been evaluated yet. the indices of all nodes
+// are unchanged; the replaced arguments are simply no longer used, so
+// OptimizingExecutionEngine, which only evaluates the nodes that are needed,
+// never computes them (unless their values are asked for).
+// there is no separate dead-node elimination: Expressions hold node indices,
+// so no node can be removed, and which nodes are dead depends on the values
+// that are asked for. skipping them is left to OptimizingExecutionEngine; the
+// other engines still compute every node up to the one they are asked for
+void GraphOptimize(ComputationGraph* cg, VariableIndex first, VariableIndex last);
+// the whole graph
 void GraphOptimize(ComputationGraph* cg);
+
 } // namespace cnn
 
 #endif
@@ -2,9 +2,11 @@
 #include "cnn/aligned-mem-pool.h"
 #include "cnn/cnn.h"
 
+#include <cstdlib>
 #include <iostream>
 #include <random>
 #include <cmath>
+#include <mutex>
 
 #if HAVE_CUDA
 #include "cnn/cuda.h"
@@ -16,10 +18,18 @@ using namespace std;
 namespace cnn {
 
 // these should maybe live in a file called globals.cc or something
-AlignedMemoryPool* fxs = nullptr;
-AlignedMemoryPool* dEdfs = nullptr;
 AlignedMemoryPool* ps = nullptr;
-mt19937* rndeng = nullptr;
+static mt19937 thread_seeds;
+static mutex thread_seeds_mutex;
+static unsigned NextThreadSeed() {
+  lock_guard<mutex> lock(thread_seeds_mutex);
+  return thread_seeds();
+}
+static thread_local mt19937 thread_rndeng(NextThreadSeed());
+thread_local mt19937* rndeng = &thread_rndeng;
+bool autobatch = false;
+bool graph_optimize = false;
+unsigned num_threads = 1;
 std::vector<Device*> devices;
 Device* default_device = nullptr;
 
@@ -37,18 +47,22 @@ void Initialize(int& argc, char**& argv, unsigned random_seed, bool shared_param
   gpudevices = Initialize_GPU(argc, argv);
 #endif
   unsigned long num_mb = 512UL;
+  bool mem_stats = false;
   int argi = 1;
   while(argi < argc) {
     string arg = argv[argi];
     if (arg == "--cnn-mem" || arg == "--cnn_mem") {
       if ((argi + 1) > argc) {
-        cerr << "[cnn] --cnn-mem expects an argument (the memory, in megabytes, to reserve)\n";
+        cerr << "[cnn] --cnn-mem expects an argument (the memory, in megabytes, to reserve at a time)\n";
         abort();
       } else {
         string a2 = argv[argi+1];
         istringstream c(a2); c >> num_mb;
         RemoveArgs(argc, argv, argi, 2);
       }
+    } else if (arg == "--cnn-mem-stats" || arg == "--cnn_mem_stats") {
+      mem_stats = true;
+      RemoveArgs(argc, argv, argi, 1);
     } else if (arg == "--cnn-seed" || arg == "--cnn_seed") {
       if ((argi + 1) > argc) {
         cerr << "[cnn] --cnn-seed expects an argument (the random number seed)\n";
@@ -58,6 +72,22 @@ void Initialize(int& argc, char**& argv, unsigned random_seed, bool shared_param
         istringstream c(a2); c >> random_seed;
         RemoveArgs(argc, argv, argi, 2);
       }
+    } else if (arg == "--cnn-autobatch" || arg == "--cnn_autobatch") {
+      autobatch = true;
+      RemoveArgs(argc, argv, argi, 1);
+    } else if (arg == "--cnn-optimize" || arg == "--cnn_optimize") {
+      graph_optimize = true;
+      RemoveArgs(argc, argv, argi, 1);
+    } else if (arg == "--cnn-threads" || arg == "--cnn_threads") {
+      if ((argi + 1) >= argc) {
+        cerr << "[cnn] --cnn-threads expects an argument (the number of threads to evaluate each graph with)\n";
+        abort();
+      } else {
+        string a2 = argv[argi+1];
+        istringstream c(a2); c >> num_threads;
+        if (num_threads == 0) num_threads = 1;
+        RemoveArgs(argc, argv, argi, 2);
+      }
     } else if (arg.find("--cnn") == 0) {
       cerr << "[cnn] Bad command line argument: " << arg << endl;
       abort();
@@ -68,9 +98,17 @@ void Initialize(int& argc, char**& argv, unsigned random_seed, bool shared_param
     random_seed = rd();
   }
   cerr << "[cnn] random seed: " << random_seed << endl;
-  rndeng = new mt19937(random_seed);
+  if (autobatch) cerr << "[cnn] batching operations across the computation graph\n";
+  else if (graph_optimize) cerr << "[cnn] optimizing the computation graph\n";
+  else if (num_threads > 1) cerr << "[cnn] evaluating the computation graph with " << num_threads << " threads\n";
+  rndeng->seed(random_seed);
+  {
+    lock_guard<mutex> lock(thread_seeds_mutex);
+    seed_seq seq{random_seed, 1u};
+    thread_seeds.seed(seq);
+  }
 
-  cerr << "[cnn] allocating memory: " << num_mb << "MB\n";
+  cerr << "[cnn] allocating memory: " << num_mb << "MB at a time\n";
   devices.push_back(new Device_CPU(num_mb, shared_parameters));
   int default_index = 0;
   if (gpudevices.size() > 0) {
@@ -81,19 +119,20 @@ void Initialize(int& argc, char**& argv, unsigned random_seed, bool shared_param
   default_device = devices[default_index];
 
   // TODO these should be accessed through the relevant device and removed here
-  fxs = default_device->fxs;
-  dEdfs = default_device->dEdfs;
   ps = default_device->ps;
   kSCALAR_MINUSONE = default_device->kSCALAR_MINUSONE;
   kSCALAR_ONE = default_device->kSCALAR_ONE;
   kSCALAR_ZERO = default_device->kSCALAR_ZERO;
   cerr << "[cnn] memory allocation done.\n";
+  if (mem_stats) atexit(ShowMemoryStats);
+}
+
+void ShowMemoryStats() {
+  for (auto d : devices) d->show_pool_mem_info(cerr);
 }
 
 void Cleanup() {
-  delete rndeng;
-  delete fxs;
-  delete dEdfs;
+  default_device->free_graph_pools();
   delete ps;
 }
 
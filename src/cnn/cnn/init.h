@@ -5,6 +5,9 @@ namespace cnn {
 
 void Initialize(int& argc, char**& argv, unsigned random_seed = 0, bool shared_parameters = false);
 void Cleanup();
+// writes the use of the memory pools of every device (the bytes in use,
+// their high-water mark and the bytes reserved) to cerr
+void ShowMemoryStats();
 
 } // namespace cnn
 
@@ -13,6 +13,8 @@ using namespace cnn::expr;
 namespace cnn {
 
 enum { X2I, H2I, C2I, BI, X2O, H2O, C2O, BO, X2C, H2C, BC };
+// the biases, input weights and hidden weights of the three gates
+enum { GB, GX, GH };
 
 LSTMBuilder::LSTMBuilder(unsigned layers,
                          unsigned input_dim,
@@ -46,6 +48,7 @@ LSTMBuilder::LSTMBuilder(unsigned layers,
 
 void LSTMBuilder::new_graph_impl(ComputationGraph& cg){
   param_vars.clear();
+  gate_vars.clear();
 
   for (unsigned i = 0; i < layers; ++i){
     auto& p = params[i];
@@ -67,6 +70,11 @@ void LSTMBuilder::new_graph_impl(ComputationGraph& cg){
 
     vector<Expression> vars = {i_x2i, i_h2i, i_c2i, i_bi, i_x2o, i_h2o, i_c2o, i_bo, i_x2c, i_h2c, i_bc};
     param_vars.push_back(vars);
+
+    vector<Expression> gates = {concatenate({i_bi, i_bc, i_bo}),
+                                concatenate({i_x2i, i_x2c, i_x2o}),
+                                concatenate({i_h2i, i_h2c, i_h2o})};
+    gate_vars.push_back(gates);
   }
 }
 
@@ -89,14 +97,23 @@ void LSTMBuilder::start_new_sequence_impl(const vector<Expression>& hinit) {
   }
 }
 
-Expression LSTMBuilder::add_input_impl(int prev, const Expression& x) {
+Expression LSTMBuilder::project_inputs(const Expression& xs) {
+  const vector<Expression>& gates = gate_vars[0];
+  Expression in = xs;
+  if (dropout_rate) in = dropout(in, dropout_rate);
+  return affine_transform({gates[GB], gates[GX], in});
+}
+
+Expression LSTMBuilder::add_step(int prev, const Expression& x, const Expression* px) {
   h.push_back(vector<Expression>(layers));
   c.push_back(vector<Expression>(layers));
   vector<Expression>& ht = h.back();
   vector<Expression>& ct = c.back();
+  const unsigned hidden_dim = params[0][BI]->dim.rows();
   Expression in = x;
   for (unsigned i = 0; i < layers; ++i) {
     const vector<Expression>& vars = param_vars[i];
+    const vector<Expression>& gates = gate_vars[i];
     Expression i_h_tm1, i_c_tm1;
     bool has_prev_state = (prev >= 0 || has_initial_state);
     if (prev < 0) {
@@ -110,41 +127,29 @@ Expression LSTMBuilder::add_input_impl(int prev, const Expression& x) {
       i_h_tm1 = h[prev][i];
       i_c_tm1 = c[prev][i];
     }
-    // apply dropout according to http://arxiv.org/pdf/1409.2329v5.pdf
-    if (dropout_rate) in = dropout(in, dropout_rate);
-    // input
-    Expression i_ait;
-    if (has_prev_state)
-      i_ait = affine_transform({vars[BI], vars[X2I], in, vars[H2I], i_h_tm1, vars[C2I], i_c_tm1});
-    else
-      i_ait = affine_transform({vars[BI], vars[X2I], in});
-    Expression i_it = logistic(i_ait);
-    // forget
-    Expression i_ft = 1.f - i_it;
-    // write memory cell
-    Expression i_awt;
-    if (has_prev_state)
-      i_awt = affine_transform({vars[BC], vars[X2C], in, vars[H2C], i_h_tm1});
-    else
-      i_awt = affine_transform({vars[BC], vars[X2C], in});
-    Expression i_wt = tanh(i_awt);
-    // output
-    if (has_prev_state) {
-      Expression i_nwt = cwise_multiply(i_it,i_wt);
-      Expression i_crt = cwise_multiply(i_ft,i_c_tm1);
-      ct[i] = i_crt + i_nwt;
+    // pre-activations of the input gate, the memory cell and the output
+    // gate, all but their peephole terms
+    Expression i_a;
+    if (i == 0 && px) {
+      if (has_prev_state)
+        i_a = affine_transform({*px, gates[GH], i_h_tm1});
+      else
+        i_a = *px;
     } else {
-      ct[i] = cwise_multiply(i_it,i_wt);
+      // apply dropout according to http://arxiv.org/pdf/1409.2329v5.pdf
+      if (dropout_rate) in = dropout(in, dropout_rate);
+      if (has_prev_state)
+        i_a = affine_transform({gates[GB], gates[GX], in, gates[GH], i_h_tm1});
+      else
+        i_a = affine_transform({gates[GB], gates[GX], in});
     }
-
-    Expression i_aot;
+    Expression i_hc;
     if (has_prev_state)
-      i_aot = affine_transform({vars[BO], vars[X2O], in, vars[H2O], i_h_tm1, vars[C2O], ct[i]});
+      i_hc = lstm_cell(i_a, i_c_tm1, vars[C2I], vars[C2O]);
     else
-      i_aot = affine_transform({vars[BO], vars[X2O], in, vars[C2O], ct[i]});
-    Expression i_ot = logistic(i_aot);
-    Expression ph_t = tanh(ct[i]);
-    in = ht[i] = cwise_multiply(i_ot,ph_t);
+      i_hc = lstm_cell(i_a, vars[C2O]);
+    ct[i] = pickrange(i_hc, hidden_dim, 2 * hidden_dim);
+    in = ht[i] = pickrange(i_hc, 0, hidden_dim);
   }
   if (dropout_rate) return dropout(ht.back(), dropout_rate);
     else return ht.back();
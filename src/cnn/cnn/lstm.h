@@ -39,10 +39,29 @@ struct LSTMBuilder : public RNNBuilder {
   }
 
   void copy(const RNNBuilder & params) override;
+
+  // computes the contributions of a whole sequence of inputs to the gates
+  // of the first layer in a single matrix product: xs holds one input per
+  // batch element, and batch element t of the result (see pick_batch_elem)
+  // can be added with add_projected_input instead of input t with add_input
+  Expression project_inputs(const Expression& xs);
+  Expression add_projected_input(const Expression& px) {
+    int prev = cur;
+    new_step(cur);
+    return add_step(prev, Expression(), &px);
+  }
+  Expression add_projected_input(const RNNPointer& prev, const Expression& px) {
+    new_step(prev);
+    return add_step(prev, Expression(), &px);
+  }
  protected:
   void new_graph_impl(ComputationGraph& cg) override;
   void start_new_sequence_impl(const std::vector<Expression>& h0) override;
-  Expression add_input_impl(int prev, const Expression& x) override;
+  Expression add_input_impl(int prev, const Expression& x) override {
+    return add_step(prev, x, nullptr);
+  }
+  // adds input x, or, if px is not null, the input projected by project_inputs
+  Expression add_step(int prev, const Expression& x, const Expression* px);
 
  public:
   // first index is layer, then ...
@@ -51,6 +70,11 @@ struct LSTMBuilder : public RNNBuilder {
   // first index is layer, then ...
   std::vector<std::vector<Expression>> param_vars;
 
+  // first index is layer, then the biases, input weights and hidden weights
+  // of the input gate, the memory cell and the output gate, stacked in this
+  // order so that one affine transform computes all three
+  std::vector<std::vector<Expression>> gate_vars;
+
   // first index is time, second is layer
   std::vector<std::vector<Expression>> h, c;
 
@@ -20,6 +20,16 @@ namespace cnn {
 
 MemAllocator::~MemAllocator() {}
 
+void* MemAllocator::reserve(size_t n) {
+  void* ptr = malloc(n);
+  zero(ptr, n);
+  return ptr;
+}
+
+void MemAllocator::release(void* mem, size_t /*n*/) {
+  free(mem);
+}
+
 void* CPUAllocator::malloc(size_t n) {
   void* ptr = _mm_malloc(n, align);
   if (!ptr) {
@@ -37,6 +47,21 @@ void CPUAllocator::zero(void* p, size_t n) {
   memset(p, 0, n);
 }
 
+// anonymous mappings are zeroed, and their pages are only committed when
+// they are first touched
+void* CPUAllocator::reserve(size_t n) {
+  void* ptr = mmap(NULL, n, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE|MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED) {
+    cerr << "CPU memory reservation failed n=" << n << endl;
+    throw cnn::out_of_memory("CPU memory reservation failed");
+  }
+  return ptr;
+}
+
+void CPUAllocator::release(void* mem, size_t n) {
+  munmap(mem, n);
+}
+
 void* SharedAllocator::malloc(size_t n) {
   void* ptr = mmap(NULL, n, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
   if (!ptr) {
@@ -54,6 +79,15 @@ void SharedAllocator::zero(void* p, size_t n) {
   memset(p, 0, n);
 }
 
+// the shared mappings of malloc are already zeroed
+void* SharedAllocator::reserve(size_t n) {
+  return malloc(n);
+}
+
+void SharedAllocator::release(void* mem, size_t n) {
+  munmap(mem, n);
+}
+
 #if HAVE_CUDA
 void* GPUAllocator::malloc(size_t n) {
   void* ptr = nullptr;
@@ -16,6 +16,12 @@ struct MemAllocator {
   virtual void* malloc(std::size_t n) = 0;
   virtual void free(void* mem) = 0;
   virtual void zero(void* p, std::size_t n) = 0;
+  // allocates n bytes of zeroed memory for a memory pool, and frees them.
+  // by default they are allocated with malloc and zeroed; allocators that
+  // can map zeroed pages on first use override them, so that the parts of
+  // a pool that are never used are never committed
+  virtual void* reserve(std::size_t n);
+  virtual void release(void* mem, std::size_t n);
   inline std::size_t round_up_align(std::size_t n) const {
     if (align < 2) return n;
     return ((n + align - 1) / align) * align;
@@ -28,6 +34,8 @@ struct CPUAllocator : public MemAllocator {
   void* malloc(std::size_t n) override;
   void free(void* mem) override;
   void zero(void* p, std::size_t n) override;
+  void* reserve(std::size_t n) override;
+  void release(void* mem, std::size_t n) override;
 };
 
 struct SharedAllocator : public MemAllocator {
@@ -35,6 +43,8 @@ struct SharedAllocator : public MemAllocator {
   void* malloc(std::size_t n) override;
   void free(void* mem) override;
   void zero(void* p, std::size_t n) override;
+  void* reserve(std::size_t n) override;
+  void release(void* mem, std::size_t n) override;
 };
 
 #if HAVE_CUDA
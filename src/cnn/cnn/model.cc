@@ -5,12 +5,21 @@
 
 #include <unordered_set>
 #include <iostream>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
 
 #include <fstream>
 #include <sstream>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #if HAVE_CUDA
 #include "cnn/gpu-ops.h"
 #include "cnn/cuda.h"
@@ -160,6 +169,7 @@ void LookupParameters::clear() {
 
 Model::~Model() {
   for (auto p : all_params) delete p;
+  if (mapped_file) munmap(mapped_file, mapped_size);
 }
 
 void Model::project_weights(float radius) {
@@ -217,16 +227,245 @@ void Model::reset_gradient() {
   for (auto p : lookup_params) { p->clear(); }
 }
 
-void save_cnn_model(std::string filename, Model* model) {
+void save_cnn_model(std::string filename, Model* model, bool binary, const std::string& metadata) {
+    if (binary) {
+      save_cnn_model_binary(filename, *model, metadata);
+      return;
+    }
     std::ofstream out(filename);
     boost::archive::text_oarchive oa(out);
     oa << (*model);
 };
 
-void load_cnn_model(std::string filename, Model* model) {
+void load_cnn_model(std::string filename, Model* model, bool map) {
+    if (is_binary_cnn_model(filename)) {
+      load_cnn_model_binary(filename, model, map);
+      return;
+    }
     std::ifstream in(filename);
     boost::archive::text_iarchive ia(in);
     ia >> (*model);
 };
 
+namespace {
+
+const char kBinaryMagic[8] = {'C', 'N', 'N', 'M', 'O', 'D', 'E', 'L'};
+const uint32_t kBinaryVersion = 1;
+const uint32_t kByteOrderMark = 0x01020304;
+const uint64_t kBinaryAlign = 64;
+
+struct BinaryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // kByteOrderMark as written by the saving machine
+  uint32_t num_params;
+  uint32_t num_lookup_params;
+  uint64_t file_size;
+  uint64_t metadata_offset;
+  uint64_t metadata_size;
+};
+
+// one per parameter (the Parameters, then the LookupParameters), after the
+// header
+struct BinaryEntry {
+  uint32_t nd;
+  uint32_t d[CNN_MAX_TENSOR_DIM];
+  uint32_t bd;
+  uint32_t rows;   // 1 for Parameters
+  uint64_t offset; // of the values of the first row
+  uint64_t stride; // between the values of consecutive rows
+};
+
+inline uint64_t align_up(uint64_t x) { return (x + kBinaryAlign - 1) / kBinaryAlign * kBinaryAlign; }
+
+BinaryEntry make_entry(const Dim& d, unsigned rows, uint64_t* offset) {
+  BinaryEntry e;
+  memset(&e, 0, sizeof(e));
+  e.nd = d.nd;
+  for (unsigned i = 0; i < d.nd; ++i) e.d[i] = d.d[i];
+  e.bd = d.bd;
+  e.rows = rows;
+  e.offset = *offset;
+  e.stride = align_up(d.size() * sizeof(float));
+  *offset += e.stride * rows;
+  return e;
+}
+
+void check_entry(const BinaryEntry& e, const Dim& d, unsigned rows, uint64_t file_size, const string& filename) {
+  bool ok = e.nd == d.nd && e.bd == d.bd && e.rows == rows &&
+      e.stride == align_up(d.size() * sizeof(float)) && e.offset % kBinaryAlign == 0 &&
+      e.offset + e.stride * rows <= file_size;
+  for (unsigned i = 0; ok && i < d.nd; ++i) ok = e.d[i] == d.d[i];
+  if (!ok) {
+    ostringstream os;
+    os << "Parameter of dimension " << d << " (x" << rows << ") does not match the model in " << filename;
+    throw std::runtime_error(os.str());
+  }
+}
+
+void write_values(ofstream& out, const Tensor& t, uint64_t stride) {
+  const size_t bytes = t.d.size() * sizeof(float);
+#if HAVE_CUDA
+  vector<float> vc(t.d.size());
+  CUDA_CHECK(cudaMemcpy(&vc[0], t.v, bytes, cudaMemcpyDeviceToHost));
+  out.write(reinterpret_cast<const char*>(&vc[0]), bytes);
+#else
+  out.write(reinterpret_cast<const char*>(t.v), bytes);
+#endif
+  static const char zeros[kBinaryAlign] = {};
+  out.write(zeros, stride - bytes);
+}
+
+// points t at the values at p, or copies them into t
+void read_values(Tensor& t, const char* p, bool map) {
+#if HAVE_CUDA
+  CUDA_CHECK(cudaMemcpy(t.v, p, t.d.size() * sizeof(float), cudaMemcpyHostToDevice));
+#else
+  if (map)
+    t.v = reinterpret_cast<float*>(const_cast<char*>(p));
+  else
+    memcpy(t.v, p, t.d.size() * sizeof(float));
+#endif
+}
+
+// maps filename (copy-on-write) and checks its header, which is returned
+// in *h
+void* map_model_file(const string& filename, size_t* size, BinaryHeader* h) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) close(fd);
+    throw std::runtime_error("Could not open model file " + filename);
+  }
+  *size = st.st_size;
+  void* file = *size >= sizeof(*h) ? mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (file == MAP_FAILED)
+    throw std::runtime_error("Could not map model file " + filename);
+  const char* data = static_cast<const char*>(file);
+  memcpy(h, data, sizeof(*h));
+  const char* error = nullptr;
+  if (memcmp(h->magic, kBinaryMagic, sizeof(kBinaryMagic)) != 0)
+    error = " is not a binary model file";
+  else if (h->version != kBinaryVersion || h->byte_order != kByteOrderMark)
+    error = " has an unsupported version or byte order";
+  else if (h->file_size != *size || h->metadata_offset + h->metadata_size > *size)
+    error = " is truncated";
+  if (error) {
+    munmap(file, *size);
+    throw std::runtime_error(filename + error);
+  }
+  return file;
+}
+
+} // namespace
+
+void save_cnn_model_binary(const std::string& filename, const Model& model, const std::string& metadata) {
+  const auto& params = model.parameters_list();
+  const auto& lookup_params = model.lookup_parameters_list();
+  vector<BinaryEntry> entries;
+  uint64_t offset = align_up(sizeof(BinaryHeader) + sizeof(BinaryEntry) * (params.size() + lookup_params.size()));
+  for (auto p : params)
+    entries.push_back(make_entry(p->dim, 1, &offset));
+  for (auto p : lookup_params)
+    entries.push_back(make_entry(p->dim, p->values.size(), &offset));
+  BinaryHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kBinaryMagic, sizeof(kBinaryMagic));
+  h.version = kBinaryVersion;
+  h.byte_order = kByteOrderMark;
+  h.num_params = params.size();
+  h.num_lookup_params = lookup_params.size();
+  h.metadata_offset = offset;
+  h.metadata_size = metadata.size();
+  h.file_size = offset + metadata.size();
+
+  // written to a temporary file that is then renamed, so that processes that
+  // have mapped filename (including this one, when a mapped model is saved
+  // to the file it was loaded from) keep seeing the old values
+  ostringstream tmp;
+  tmp << filename << ".tmp" << getpid();
+  ofstream out(tmp.str(), ios::binary);
+  if (!out) throw std::runtime_error("Could not write model to " + filename);
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  out.write(reinterpret_cast<const char*>(&entries[0]), sizeof(BinaryEntry) * entries.size());
+  const uint64_t header_size = sizeof(h) + sizeof(BinaryEntry) * entries.size();
+  static const char zeros[kBinaryAlign] = {};
+  out.write(zeros, align_up(header_size) - header_size);
+  unsigned ei = 0;
+  for (auto p : params)
+    write_values(out, p->values, entries[ei++].stride);
+  for (auto p : lookup_params) {
+    for (auto& v : p->values)
+      write_values(out, v, entries[ei].stride);
+    ++ei;
+  }
+  out.write(metadata.data(), metadata.size());
+  out.close();
+  if (!out || rename(tmp.str().c_str(), filename.c_str()) != 0) {
+    remove(tmp.str().c_str());
+    throw std::runtime_error("Could not write model to " + filename);
+  }
+}
+
+bool is_binary_cnn_model(const std::string& filename) {
+  ifstream in(filename, ios::binary);
+  char magic[sizeof(kBinaryMagic)];
+  return in.read(magic, sizeof(magic)) && memcmp(magic, kBinaryMagic, sizeof(magic)) == 0;
+}
+
+void load_cnn_model_binary(const std::string& filename, Model* model, bool map) {
+#if HAVE_CUDA
+  map = false; // the values have to be copied to the device
+#endif
+  size_t size;
+  BinaryHeader h;
+  void* file = map_model_file(filename, &size, &h);
+  const char* data = static_cast<const char*>(file);
+  try {
+    auto& params = model->params;
+    auto& lookup_params = model->lookup_params;
+    if (h.num_params != params.size() || h.num_lookup_params != lookup_params.size())
+      throw std::runtime_error("Number of parameters does not match the model in " + filename);
+    if (sizeof(BinaryHeader) + sizeof(BinaryEntry) * (params.size() + lookup_params.size()) > size)
+      throw std::runtime_error(filename + " is truncated");
+    const BinaryEntry* entries = reinterpret_cast<const BinaryEntry*>(data + sizeof(BinaryHeader));
+    unsigned ei = 0;
+    for (auto p : params)
+      check_entry(entries[ei++], p->dim, 1, size, filename);
+    for (auto p : lookup_params)
+      check_entry(entries[ei++], p->dim, p->values.size(), size, filename);
+  } catch (...) {
+    munmap(file, size);
+    throw;
+  }
+  const BinaryEntry* entries = reinterpret_cast<const BinaryEntry*>(data + sizeof(BinaryHeader));
+  unsigned ei = 0;
+  for (auto p : model->params) {
+    const BinaryEntry& e = entries[ei++];
+    read_values(p->values, data + e.offset, map);
+  }
+  for (auto p : model->lookup_params) {
+    const BinaryEntry& e = entries[ei++];
+    for (unsigned i = 0; i < p->values.size(); ++i)
+      read_values(p->values[i], data + e.offset + e.stride * i, map);
+  }
+  if (map) {
+    if (model->mapped_file) munmap(model->mapped_file, model->mapped_size);
+    model->mapped_file = file;
+    model->mapped_size = size;
+  } else {
+    munmap(file, size);
+  }
+}
+
+std::string read_cnn_model_metadata(const std::string& filename) {
+  size_t size;
+  BinaryHeader h;
+  void* file = map_model_file(filename, &size, &h);
+  const string metadata(static_cast<const char*>(file) + h.metadata_offset, h.metadata_size);
+  munmap(file, size);
+  return metadata;
+}
+
 } // namespace cnn
@@ -102,7 +102,7 @@ struct LookupParameters : public ParametersBase {
 // parameters know how to track their gradients, but any extra information (like velocity) will live here
 class Model {
  public:
-  Model() : gradient_norm_scratch() {}
+  Model() : gradient_norm_scratch(), mapped_file(), mapped_size() {}
   ~Model();
   float gradient_l2_norm() const;
   void reset_gradient();
@@ -145,15 +145,41 @@ class Model {
     for (auto p : lookup_params) all_params.push_back(p);
   }
   BOOST_SERIALIZATION_SPLIT_MEMBER()
+  friend void load_cnn_model_binary(const std::string& filename, Model* model, bool map);
 
   std::vector<ParametersBase*> all_params;
   std::vector<Parameters*> params;
   std::vector<LookupParameters*> lookup_params;
   mutable float* gradient_norm_scratch;
+  // model file that the parameter values point into, if it was loaded with
+  // load_cnn_model_binary(..., map = true); unmapped by the destructor
+  void* mapped_file;
+  size_t mapped_size;
 };
 
-void save_cnn_model(std::string filename, Model* model);
-void load_cnn_model(std::string filename, Model* model);
+// saves the model as a text archive, or with save_cnn_model_binary if binary
+// is true (metadata is only stored in binary files)
+void save_cnn_model(std::string filename, Model* model, bool binary = false,
+                    const std::string& metadata = std::string());
+// loads a model saved by save_cnn_model or save_cnn_model_binary; map is
+// passed on to load_cnn_model_binary and ignored for text archives
+void load_cnn_model(std::string filename, Model* model, bool map = false);
+
+// binary model files: a versioned header giving the shape of every
+// parameter, followed by the raw values, each tensor (and each row of a
+// lookup table) in its own 64-byte aligned block, and then by metadata, an
+// arbitrary string that the application can use to store e.g. vocabularies.
+// as with the text archives, the model must have been built with the same
+// parameters, in the same order, as the model that was saved
+void save_cnn_model_binary(const std::string& filename, const Model& model,
+                           const std::string& metadata = std::string());
+// if map is true, the file is memory-mapped (copy-on-write) and the
+// parameter values point into it instead of being copied, so that loading
+// costs (almost) nothing until the values are used
+void load_cnn_model_binary(const std::string& filename, Model* model, bool map = false);
+bool is_binary_cnn_model(const std::string& filename);
+// the metadata saved with a binary model, without loading the parameters
+std::string read_cnn_model_metadata(const std::string& filename);
 
 } // namespace cnn
 
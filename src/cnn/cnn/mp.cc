@@ -11,6 +11,45 @@ namespace cnn {
     bool stop_requested = false;
     SharedObject* shared_object = nullptr;
 
+    // read and write may transfer less than was asked for
+    static void ReadAll(int pipe, char* buf, size_t size) {
+      size_t done = 0;
+      while (done < size) {
+        ssize_t r = read(pipe, buf + done, size - done);
+        if (r <= 0) {
+          std::cerr << "Could not read from pipe. Exiting ..." << std::endl;
+          abort();
+        }
+        done += r;
+      }
+    }
+
+    static void WriteAll(int pipe, const char* buf, size_t size) {
+      size_t done = 0;
+      while (done < size) {
+        ssize_t r = write(pipe, buf + done, size - done);
+        if (r <= 0) {
+          std::cerr << "Could not write to pipe. Exiting ..." << std::endl;
+          abort();
+        }
+        done += r;
+      }
+    }
+
+    std::string ReadString(int pipe) {
+      size_t size;
+      ReadAll(pipe, (char*) &size, sizeof(size));
+      std::string s(size, '\0');
+      ReadAll(pipe, &s[0], size);
+      return s;
+    }
+
+    void WriteString(int pipe, const std::string& s) {
+      size_t size = s.size();
+      WriteAll(pipe, (const char*) &size, sizeof(size));
+      WriteAll(pipe, s.data(), size);
+    }
+
     std::string GenerateQueueName() {
       std::ostringstream ss;
       ss << "cnn_mp_work_queue";
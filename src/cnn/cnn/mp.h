@@ -6,6 +6,8 @@
 #include "cnn/lstm.h"
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/interprocess/ipc/message_queue.hpp>
 #include <boost/interprocess/shared_memory_object.hpp>
@@ -95,6 +97,10 @@ namespace cnn {
       assert (err != -1);
     }
 
+    // Like Read and Write, but for strings of any length
+    std::string ReadString(int pipe);
+    void WriteString(int pipe, const std::string& s);
+
     std::string GenerateQueueName();
     std::string GenerateSharedMemoryName();
 
@@ -292,5 +298,74 @@ namespace cnn {
         RunParent(train_data, dev_data, learner, workloads, num_iterations, dev_frequency, report_frequency);
       }
     }
+    // Computes f(0), ..., f(n - 1) in num_workers forked processes and
+    // returns the results in that order. The workers see the parent's memory
+    // (and so its Model) as it was when they were forked, copy-on-write, so
+    // nothing f changes is seen by the parent, and they must not depend on
+    // the random number generator if the results are to be the same as
+    // those of computing them serially. Each worker computes a contiguous
+    // range of indices and then sends its results, which must be
+    // serializable with boost::serialization, to the parent through a pipe.
+    // With fewer than two workers, f is called in this process.
+    template <class R, class F>
+    std::vector<R> ParallelMap(unsigned n, unsigned num_workers, F f) {
+      std::vector<R> results(n);
+      if (num_workers > n) num_workers = n;
+      if (num_workers < 2) {
+        for (unsigned i = 0; i < n; ++i) results[i] = f(i);
+        return results;
+      }
+      // don't let the workers flush the parent's buffered output again
+      std::cout.flush();
+      std::cerr.flush();
+      std::vector<Workload> workloads = CreateWorkloads(num_workers);
+      for (unsigned wid = 0; wid < num_workers; ++wid) {
+        pid_t pid = fork();
+        if (pid == -1) {
+          std::cerr << "Fork failed. Exiting ..." << std::endl;
+          abort();
+        } else if (pid == 0) {
+          for (unsigned j = 0; j < num_workers; ++j) {
+            close(workloads[j].p2c[0]);
+            close(workloads[j].p2c[1]);
+            close(workloads[j].c2p[0]);
+            if (j != wid) close(workloads[j].c2p[1]);
+          }
+          std::ostringstream ss;
+          {
+            boost::archive::binary_oarchive oa(ss);
+            for (unsigned i = wid * n / num_workers; i < (wid + 1) * n / num_workers; ++i) {
+              R r = f(i);
+              oa << r;
+            }
+          }
+          WriteString(workloads[wid].c2p[1], ss.str());
+          close(workloads[wid].c2p[1]);
+          std::cout.flush();
+          std::cerr.flush();
+          _exit(0);
+        }
+        workloads[wid].pid = pid;
+      }
+      for (unsigned wid = 0; wid < num_workers; ++wid) {
+        close(workloads[wid].p2c[0]);
+        close(workloads[wid].p2c[1]);
+        close(workloads[wid].c2p[1]);
+      }
+      for (unsigned wid = 0; wid < num_workers; ++wid) {
+        std::istringstream ss(ReadString(workloads[wid].c2p[0]));
+        close(workloads[wid].c2p[0]);
+        int status;
+        waitpid(workloads[wid].pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+          std::cerr << "Worker " << wid << " failed. Exiting ..." << std::endl;
+          abort();
+        }
+        boost::archive::binary_iarchive ia(ss);
+        for (unsigned i = wid * n / num_workers; i < (wid + 1) * n / num_workers; ++i)
+          ia >> results[i];
+      }
+      return results;
+    }
   }
 }
@@ -0,0 +1,31 @@
+#include "cnn/node-arena.h"
+
+#include <algorithm>
+#include <new>
+
+using namespace std;
+
+namespace cnn {
+
+// the size of the first block; every new block is twice as big as the last
+static const size_t kFirstBlockBytes = 1 << 16;
+
+NodeArena::~NodeArena() {
+  for (auto& b : blocks) ::operator delete(b.mem);
+}
+
+void* NodeArena::allocate_from_next_block(size_t n) {
+  // the blocks are used in order, so the rest of the current one is left
+  // unused until the next reset
+  if (block < blocks.size()) ++block;
+  while (block < blocks.size() && blocks[block].size < n) ++block;
+  if (block == blocks.size()) {
+    size_t size = blocks.empty() ? kFirstBlockBytes : 2 * blocks.back().size;
+    Block b = {static_cast<char*>(::operator new(max(size, n))), max(size, n)};
+    blocks.push_back(b);
+  }
+  used = n;
+  return blocks[block].mem;
+}
+
+} // namespace cnn
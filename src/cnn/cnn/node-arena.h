@@ -0,0 +1,53 @@
+#ifndef CNN_NODE_ARENA_H
+#define CNN_NODE_ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+namespace cnn {
+
+// bump allocator for the nodes of a ComputationGraph and their argument
+// lists. memory is handed out from large blocks that are never returned to
+// the system while the arena exists: reset() releases every allocation at
+// once and keeps the blocks for the next graph, so a graph that is rebuilt
+// for every example stops calling malloc once the blocks are big enough
+class NodeArena {
+ public:
+  // every allocation is aligned to this many bytes
+  static const size_t kAlign = alignof(std::max_align_t);
+
+  NodeArena() : block(0), used(0) {}
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+  ~NodeArena();
+
+  void* allocate(size_t n) {
+    n = (n + kAlign - 1) & ~(kAlign - 1);
+    if (block < blocks.size() && used + n <= blocks[block].size) {
+      void* res = blocks[block].mem + used;
+      used += n;
+      return res;
+    }
+    return allocate_from_next_block(n);
+  }
+  // releases everything allocated so far
+  void reset() {
+    block = 0;
+    used = 0;
+  }
+
+ private:
+  void* allocate_from_next_block(size_t n);
+
+  struct Block {
+    char* mem;
+    size_t size;
+  };
+  std::vector<Block> blocks;
+  unsigned block;  // the block allocations are currently taken from
+  size_t used;     // bytes of that block in use
+};
+
+} // namespace cnn
+
+#endif
@@ -540,6 +540,42 @@ Dim Concatenate::dim_forward(const vector<Dim>& xs) const {
   return dr;
 }
 
+string ConcatenateToBatch::as_string(const vector<string>& arg_names) const {
+  ostringstream os;
+  os << "concat_batch(" << arg_names[0];
+  for (unsigned i = 1; i < arg_names.size(); ++i) {
+    os << ',' << arg_names[i];
+  }
+  os << ')';
+  return os.str();
+}
+
+Dim ConcatenateToBatch::dim_forward(const vector<Dim>& xs) const {
+  assert(xs.size() > 0);
+  Dim d = xs[0].single_batch();
+  unsigned bd = 0;
+  for (auto& c : xs) {
+    if (d != c.single_batch()) {
+      ostringstream s; s << "Bad input dimensions in ConcatenateToBatch: " << xs;
+      throw std::invalid_argument(s.str());
+    }
+    bd += c.bd;
+  }
+  d.bd = bd;
+  return d;
+}
+
+string PickBatchElement::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "pick_batch_elem(" << arg_names[0] << ',' << *pval << ')';
+  return s.str();
+}
+
+Dim PickBatchElement::dim_forward(const vector<Dim>& xs) const {
+  assert(xs.size() == 1);
+  return xs[0].single_batch();
+}
+
 string ConcatenateColumns::as_string(const vector<string>& arg_names) const {
   ostringstream os;
   os << "concat_cols(" << arg_names[0];
@@ -699,6 +735,28 @@ Dim RestrictedLogSoftmax::dim_forward(const vector<Dim>& xs) const {
   return xs[0];
 }
 
+string RestrictedAffineLogSoftmax::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "r_log_softmax(" << arg_names[0] << " + " << arg_names[1] << " * " << arg_names[2] << ')';
+  return s.str();
+}
+
+Dim RestrictedAffineLogSoftmax::dim_forward(const vector<Dim>& xs) const {
+  if (xs.size() != 3 || !LooksLikeVector(xs[0]) || !LooksLikeVector(xs[2]) ||
+      xs[1].ndims() != 2 || xs[1].rows() != xs[0].rows() || xs[1].cols() != xs[2].rows() ||
+      xs[0].bd != 1 || xs[1].bd != 1 || xs[2].bd != 1) {
+    ostringstream s; s << "Bad input dimensions in RestrictedAffineLogSoftmax: " << xs;
+    throw std::invalid_argument(s.str());
+  }
+  for (auto i : denom) {
+    if (i >= xs[0].rows()) {
+      ostringstream s; s << "Bad restriction in RestrictedAffineLogSoftmax: " << i << " for " << xs;
+      throw std::invalid_argument(s.str());
+    }
+  }
+  return xs[0];
+}
+
 string PickElement::as_string(const vector<string>& arg_names) const {
   ostringstream s;
   s << "pick(" << arg_names[0] << ',' << *pval << ')';
@@ -946,4 +1004,73 @@ Dim BinaryLogLoss::dim_forward(const vector<Dim>& xs) const {
   return Dim({1}, max(xs[0].bd, xs[1].bd));
 }
 
+string LSTMCell::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "lstm_cell(" << arg_names[0];
+  for (unsigned i = 1; i < arg_names.size(); ++i) s << ", " << arg_names[i];
+  s << ')';
+  return s.str();
+}
+
+Dim LSTMCell::dim_forward(const vector<Dim>& xs) const {
+  bool ok = (xs.size() == 2 || xs.size() == 4) && LooksLikeVector(xs[0]) && xs[0].rows() % 3 == 0;
+  const unsigned hd = ok ? xs[0].rows() / 3 : 0;
+  unsigned bd = xs[0].bd;
+  if (ok && xs.size() == 4) {
+    ok = LooksLikeVector(xs[1]) && xs[1].rows() == hd &&
+         xs[2].single_batch() == Dim({hd, hd});
+    bd = max(bd, xs[1].bd);
+    ok = ok && (xs[1].bd == 1 || xs[1].bd == bd);
+  }
+  ok = ok && (xs[0].bd == 1 || xs[0].bd == bd) && xs.back().single_batch() == Dim({hd, hd});
+  if (!ok) {
+    ostringstream s; s << "Bad input dimensions in LSTMCell: " << xs;
+    throw std::invalid_argument(s.str());
+  }
+  return Dim({2 * hd}, bd);
+}
+
+string AffineActivation::as_string(const vector<string>& arg_names) const {
+  static const char* const names[] = { "rectify", "tanh", "logistic" };
+  ostringstream s;
+  s << names[activation] << '(' << AffineTransform::as_string(arg_names) << ')';
+  return s.str();
+}
+
+string CwiseMultiplyAdd::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << arg_names[0] << " \\cdot " << arg_names[1] << " + " << arg_names[2];
+  if (arg_names.size() == 4) s << " \\cdot " << arg_names[3];
+  return s.str();
+}
+
+Dim CwiseMultiplyAdd::dim_forward(const vector<Dim>& xs) const {
+  if (xs.size() != 3 && xs.size() != 4) {
+    ostringstream s; s << "Bad number of inputs in CwiseMultiplyAdd: " << xs;
+    throw std::invalid_argument(s.str());
+  }
+  for (unsigned i = 1; i < xs.size(); ++i) {
+    if (xs[i] != xs[0]) {
+      ostringstream s; s << "Mismatched input dimensions in CwiseMultiplyAdd: " << xs;
+      throw std::invalid_argument(s.str());
+    }
+  }
+  return xs[0];
+}
+
+string PickRestrictedLogSoftmax::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "pick(r_log_softmax(" << arg_names[0] << ")," << *pval << ')';
+  return s.str();
+}
+
+Dim PickRestrictedLogSoftmax::dim_forward(const vector<Dim>& xs) const {
+  assert(xs.size() == 1);
+  if (!LooksLikeVector(xs[0]) || xs[0].bd != 1) {
+    ostringstream s; s << "Bad input dimensions in PickRestrictedLogSoftmax: " << xs;
+    throw std::invalid_argument(s.str());
+  }
+  return Dim({1});
+}
+
 } // namespace cnn
@@ -505,8 +505,7 @@ void Reshape::backward_impl(const vector<const Tensor*>& xs,
 #ifdef HAVE_CUDA
   throw std::runtime_error("Reshape not yet implemented for CUDA");
 #else
-  const Tensor reshaped(dEdxi.d, dEdf.v);
-  *dEdxi += *reshaped;
+  dEdxi.vec() += dEdf.vec();
 #endif
 }
 
@@ -1156,6 +1155,36 @@ void Concatenate::backward_impl(const vector<const Tensor*>& xs,
 #endif
 }
 
+void ConcatenateToBatch::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+  src_batch_indices.resize(xs.size());
+  unsigned b = 0;
+  unsigned k = 0;
+  for (auto x : xs) {
+    src_batch_indices[k++] = b;
+    const unsigned sz = x->d.size();
+#if HAVE_CUDA
+    CUDA_CHECK(cudaMemcpyAsync(fx.batch_ptr(b), x->v, sizeof(float) * sz, cudaMemcpyDeviceToDevice));
+#else
+    memcpy(fx.batch_ptr(b), x->v, sizeof(float) * sz);
+#endif
+    b += x->d.bd;
+  }
+}
+
+void ConcatenateToBatch::backward_impl(const vector<const Tensor*>& xs,
+                             const Tensor& fx,
+                             const Tensor& dEdf,
+                             unsigned i,
+                             Tensor& dEdxi) const {
+  assert(i < src_batch_indices.size());
+  const unsigned sz = dEdxi.d.size();
+#if HAVE_CUDA
+  CUBLAS_CHECK(cublasSaxpy(cublas_handle, sz, kSCALAR_ONE, dEdf.batch_ptr(src_batch_indices[i]), 1, dEdxi.v, 1));
+#else
+  dEdxi.vec() += Eigen::Map<const Eigen::VectorXf>(dEdf.batch_ptr(src_batch_indices[i]), sz);
+#endif
+}
+
 #define MAX_CONCAT_COLS_ARGS 512
 size_t ConcatenateColumns::aux_storage_size() const {
   return MAX_CONCAT_COLS_ARGS * sizeof(unsigned);
@@ -1380,9 +1409,13 @@ void Softmax::backward_impl(const vector<const Tensor*>& xs,
 #endif
 }
 
+size_t PickNegLogSoftmax::aux_storage_size() const {
+  return sizeof(float) * dim.batch_elems();
+}
+
 void PickNegLogSoftmax::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
   if (xs[0]->d.cols() == 1) {
-    logz = (float*)fxs->allocate(sizeof(float)*fx.d.batch_elems());
+    logz = static_cast<float*>(aux_mem);
 #if HAVE_CUDA
     if(pval) {
       gpu::pnlsoftmax(xs[0]->d.size(), *pval, xs[0]->v, fx.v, logz);
@@ -1539,6 +1572,58 @@ void RestrictedLogSoftmax::backward_impl(const vector<const Tensor*>& xs,
 #endif
 }
 
+// y = log_softmax(b + W x) over the rows in denom (-inf elsewhere)
+void RestrictedAffineLogSoftmax::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+#ifdef HAVE_CUDA
+  throw std::runtime_error("RestrictedAffineLogSoftmax not yet implemented for CUDA");
+#else
+  assert(xs.size() == 3);
+  assert(denom.size() > 0);
+  auto b = **xs[0];
+  auto W = **xs[1];
+  auto x = xs[2]->vec();
+  auto y = *fx;
+  TensorTools::Constant(fx, -numeric_limits<real>::infinity());
+  for (auto i : denom)
+    y(i, 0) = b(i, 0) + W.row(i).dot(x);
+  const real logz = logsumexp(y, denom);
+  for (auto i : denom)
+    y(i, 0) -= logz;
+  if (denom.size() == 1) y(denom.front(), 0) = 0;
+#endif
+}
+
+void RestrictedAffineLogSoftmax::backward_impl(const vector<const Tensor*>& xs,
+                                               const Tensor& fx,
+                                               const Tensor& dEdf,
+                                               unsigned i,
+                                               Tensor& dEdxi) const {
+  assert(i < 3);
+#ifdef HAVE_CUDA
+  throw std::runtime_error("RestrictedAffineLogSoftmax not yet implemented for CUDA");
+#else
+  // as in RestrictedLogSoftmax, the gradient of row r of the affine transform
+  // is dEdf_r - exp(y_r) * z
+  float z = 0;
+  for (auto r : denom)
+    z += (*dEdf)(r, 0);
+  if (i == 0) {
+    for (auto r : denom)
+      (*dEdxi)(r, 0) += (*dEdf)(r, 0) - expf((*fx)(r, 0)) * z;
+  } else if (i == 1) {
+    auto x = xs[2]->vec();
+    auto dW = *dEdxi;
+    for (auto r : denom)
+      dW.row(r) += ((*dEdf)(r, 0) - expf((*fx)(r, 0)) * z) * x.transpose();
+  } else {
+    auto W = **xs[1];
+    auto dx = dEdxi.vec();
+    for (auto r : denom)
+      dx += ((*dEdf)(r, 0) - expf((*fx)(r, 0)) * z) * W.row(r).transpose();
+  }
+#endif
+}
+
 // x_1 is a vector
 // y = (x_1)_{*pval}
 void PickElement::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
@@ -1584,6 +1669,36 @@ void PickElement::backward_impl(const vector<const Tensor*>& xs,
 #endif
 }
 
+// x_1 is a mini-batch
+// y = (x_1)_{batch element *pval}
+void PickBatchElement::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+  assert(xs.size() == 1);
+  if (*pval >= xs[0]->d.bd) {
+    cerr << "PickBatchElement::forward_impl requested batch element " << *pval
+         << " from a batch of size " << xs[0]->d.bd << endl;
+    abort();
+  }
+#if HAVE_CUDA
+  CUDA_CHECK(cudaMemcpyAsync(fx.v, xs[0]->batch_ptr(*pval), sizeof(float) * fx.d.size(), cudaMemcpyDeviceToDevice));
+#else
+  memcpy(fx.v, xs[0]->batch_ptr(*pval), sizeof(float) * fx.d.size());
+#endif
+}
+
+// derivative is 0 in all batch elements except the selected one
+void PickBatchElement::backward_impl(const vector<const Tensor*>& xs,
+                    const Tensor& fx,
+                    const Tensor& dEdf,
+                    unsigned i,
+                    Tensor& dEdxi) const {
+  assert(i == 0);
+#if HAVE_CUDA
+  CUBLAS_CHECK(cublasSaxpy(cublas_handle, fx.d.size(), kSCALAR_ONE, dEdf.v, 1, dEdxi.batch_ptr(*pval), 1));
+#else
+  dEdxi.batch_matrix(*pval) += *dEdf;
+#endif
+}
+
 // x_1 is a vector
 // y = (x_1)[start:end]
 // slice of vector from index start (inclusive) to index end (exclusive)
@@ -1715,8 +1830,13 @@ void MatrixMultiply::backward_impl(const vector<const Tensor*>& xs,
   }
 #else
   if (i == 0) {
-    for(int b = 0; b < max_b; ++b)
-      dEdxi.batch_matrix(b).noalias() += dEdf.batch_matrix(b) * xs[1]->batch_matrix(b).transpose();
+    if(dEdxi.d.bd == 1 && xs[1]->d.bd == dEdf.d.bd) {
+      // a single multiply sums the gradients over the batch
+      (*dEdxi).noalias() += dEdf.colbatch_matrix() * xs[1]->colbatch_matrix().transpose();
+    } else {
+      for(int b = 0; b < max_b; ++b)
+        dEdxi.batch_matrix(b).noalias() += dEdf.batch_matrix(b) * xs[1]->batch_matrix(b).transpose();
+    }
   } else {
     if(xs[0]->d.bd == 1) {
       dEdxi.colbatch_matrix().noalias() += (**xs[0]).transpose() * dEdf.colbatch_matrix();
@@ -1864,8 +1984,13 @@ void AffineTransform::backward_impl(const vector<const Tensor*>& xs,
             xs[i+1]->batch_ptr(b), xs[i+1]->d.rows(),
             kSCALAR_ONE, dEdxi.batch_ptr(b), dEdxi.d.rows()));
 #else
-    for(int b = 0; b < max_b; ++b)
-      dEdxi.batch_matrix(b).noalias() += dEdf.batch_matrix(b) * xs[i+1]->batch_matrix(b).transpose();
+    if(dEdxi.d.bd == 1 && xs[i+1]->d.bd == dEdf.d.bd) {
+      // a single multiply sums the gradients over the batch
+      (*dEdxi).noalias() += dEdf.colbatch_matrix() * xs[i+1]->colbatch_matrix().transpose();
+    } else {
+      for(int b = 0; b < max_b; ++b)
+        dEdxi.batch_matrix(b).noalias() += dEdf.batch_matrix(b) * xs[i+1]->batch_matrix(b).transpose();
+    }
 #endif
   } else {  // right argument of matrix multiply
     int max_b = max(xs[i-1]->d.bd, dEdf.d.bd);
@@ -2175,4 +2300,255 @@ void Zeroes::backward_impl(const vector<const Tensor*>& xs,
   throw std::runtime_error("Called backward() on an arity 0 node");
 }
 
+size_t LSTMCell::aux_storage_size() const {
+  // the gates and tanh(c_t), which are needed by backward, the gradients of
+  // the pre-activations and of c_t, and room for a column of sums
+  return (4 * dim.size() + dim.rows() / 2) * sizeof(float);
+}
+
+void LSTMCell::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+#ifdef HAVE_CUDA
+  throw std::runtime_error("LSTMCell not yet implemented for CUDA");
+#else
+  const unsigned hd = fx.d.rows() / 2;
+  const unsigned bd = fx.d.bd;
+  const bool has_prev = (xs.size() == 4);
+  float* aux = static_cast<float*>(aux_mem);
+  Eigen::Map<Eigen::MatrixXf> it(aux, hd, bd), wt(aux + hd * bd, hd, bd),
+                              ot(aux + 2 * hd * bd, hd, bd), tct(aux + 3 * hd * bd, hd, bd);
+  const auto a = xs[0]->colbatch_matrix();
+  auto y = fx.colbatch_matrix();
+  auto ht = y.topRows(hd);
+  auto ct = y.bottomRows(hd);
+  if (a.cols() == bd) {
+    it = a.topRows(hd);
+    wt = a.middleRows(hd, hd);
+    ot = a.bottomRows(hd);
+  } else {
+    it.colwise() = a.col(0).head(hd);
+    wt.colwise() = a.col(0).segment(hd, hd);
+    ot.colwise() = a.col(0).tail(hd);
+  }
+  if (has_prev) {
+    const auto ctm1 = xs[1]->colbatch_matrix();
+    if (ctm1.cols() == bd) {
+      it.noalias() += **xs[2] * ctm1;
+    } else {
+      tct.col(0).noalias() = **xs[2] * ctm1;
+      it.colwise() += tct.col(0);
+    }
+  }
+  it = it.unaryExpr(scalar_logistic_sigmoid_op<float>());
+  wt = wt.array().tanh();
+  ct = it.cwiseProduct(wt);
+  if (has_prev) {
+    // the forget gate is 1 - i_t
+    const auto ctm1 = xs[1]->colbatch_matrix();
+    for (unsigned b = 0; b < bd; ++b)
+      ct.col(b).array() += (1.f - it.col(b).array()) * ctm1.col(ctm1.cols() == bd ? b : 0).array();
+  }
+  ot.noalias() += **xs.back() * ct;
+  ot = ot.unaryExpr(scalar_logistic_sigmoid_op<float>());
+  tct = ct.array().tanh();
+  ht = ot.cwiseProduct(tct);
+#endif
+}
+
+void LSTMCell::backward_prepare(const vector<const Tensor*>& xs,
+                                const Tensor& fx,
+                                const Tensor& dEdf) const {
+#ifdef HAVE_CUDA
+  throw std::runtime_error("LSTMCell not yet implemented for CUDA");
+#else
+  const unsigned hd = fx.d.rows() / 2;
+  const unsigned bd = fx.d.bd;
+  const bool has_prev = (xs.size() == 4);
+  float* aux = static_cast<float*>(aux_mem);
+  const Eigen::Map<Eigen::MatrixXf> it(aux, hd, bd), wt(aux + hd * bd, hd, bd),
+                                    ot(aux + 2 * hd * bd, hd, bd), tct(aux + 3 * hd * bd, hd, bd);
+  Eigen::Map<Eigen::MatrixXf> da(aux + 4 * hd * bd, 3 * hd, bd), dct(aux + 7 * hd * bd, hd, bd);
+  auto dai = da.topRows(hd);
+  auto daw = da.middleRows(hd, hd);
+  auto dao = da.bottomRows(hd);
+  const auto dht = dEdf.colbatch_matrix().topRows(hd);
+  dao = ot.binaryExpr(dht.cwiseProduct(tct), scalar_logistic_sigmoid_backward_op<float>());
+  dct = dEdf.colbatch_matrix().bottomRows(hd) +
+        tct.binaryExpr(dht.cwiseProduct(ot), scalar_tanh_backward_op<float>());
+  dct.noalias() += (**xs.back()).transpose() * dao;
+  daw = wt.binaryExpr(dct.cwiseProduct(it), scalar_tanh_backward_op<float>());
+  if (has_prev) {
+    // dc_t/di_t = w_t - c_{t-1}
+    const auto ctm1 = xs[1]->colbatch_matrix();
+    for (unsigned b = 0; b < bd; ++b)
+      dai.col(b) = dct.col(b).cwiseProduct(wt.col(b) - ctm1.col(ctm1.cols() == bd ? b : 0));
+    dai = it.binaryExpr(dai, scalar_logistic_sigmoid_backward_op<float>());
+  } else {
+    dai = it.binaryExpr(dct.cwiseProduct(wt), scalar_logistic_sigmoid_backward_op<float>());
+  }
+#endif
+}
+
+void LSTMCell::backward_impl(const vector<const Tensor*>& xs,
+                             const Tensor& fx,
+                             const Tensor& dEdf,
+                             unsigned i,
+                             Tensor& dEdxi) const {
+#ifdef HAVE_CUDA
+  throw std::runtime_error("LSTMCell not yet implemented for CUDA");
+#else
+  const unsigned hd = fx.d.rows() / 2;
+  const unsigned bd = fx.d.bd;
+  float* aux = static_cast<float*>(aux_mem);
+  const Eigen::Map<Eigen::MatrixXf> it(aux, hd, bd);
+  // the gradients of the pre-activations, in the layout of x_1, and of c_t,
+  // computed by backward_prepare
+  const Eigen::Map<Eigen::MatrixXf> da(aux + 4 * hd * bd, 3 * hd, bd), dct(aux + 7 * hd * bd, hd, bd);
+  const auto dai = da.topRows(hd);
+  const auto dao = da.bottomRows(hd);
+  const auto ct = fx.colbatch_matrix().bottomRows(hd);
+  if (i == 0) {
+    if (dEdxi.d.bd == bd)
+      dEdxi.colbatch_matrix() += da;
+    else
+      dEdxi.vec() += da.rowwise().sum();
+  } else if (i == xs.size() - 1) {
+    (*dEdxi).noalias() += dao * ct.transpose();
+  } else if (xs[1]->d.bd == bd) {
+    if (i == 1) {
+      dEdxi.colbatch_matrix().array() += dct.array() * (1.f - it.array());
+      dEdxi.colbatch_matrix().noalias() += (**xs[2]).transpose() * dai;
+    } else {
+      (*dEdxi).noalias() += dai * xs[1]->colbatch_matrix().transpose();
+    }
+  } else {
+    // c_{t-1} was broadcast over the batch, so its gradients are summed
+    if (i == 1) dEdxi.vec() += (dct.array() * (1.f - it.array())).matrix().rowwise().sum();
+    Eigen::Map<Eigen::VectorXf> sum_dai(aux + 8 * hd * bd, hd);
+    sum_dai = dai.rowwise().sum();
+    if (i == 1)
+      dEdxi.vec().noalias() += (**xs[2]).transpose() * sum_dai;
+    else
+      (*dEdxi).noalias() += sum_dai * xs[1]->vec().transpose();
+  }
+#endif
+}
+
+size_t AffineActivation::aux_storage_size() const {
+  // the gradient of the affine transform
+  return dim.size() * sizeof(float);
+}
+
+void AffineActivation::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+#if HAVE_CUDA
+  throw std::runtime_error("AffineActivation not yet implemented for CUDA");
+#else
+  AffineTransform::forward_impl(xs, fx);
+  auto y = fx.vec();
+  switch (activation) {
+    case RECTIFY: y = y.cwiseMax(0.f); break;
+    case TANH: y.array() = y.array().tanh(); break;
+    case LOGISTIC: y = y.unaryExpr(scalar_logistic_sigmoid_op<float>()); break;
+  }
+#endif
+}
+
+void AffineActivation::backward_prepare(const vector<const Tensor*>& xs,
+                                        const Tensor& fx,
+                                        const Tensor& dEdf) const {
+#if HAVE_CUDA
+  throw std::runtime_error("AffineActivation not yet implemented for CUDA");
+#else
+  Tensor dz(fx.d, static_cast<float*>(aux_mem));
+  switch (activation) {
+    case RECTIFY: dz.vec() = fx.vec().binaryExpr(dEdf.vec(), FRectifyBackward()); break;
+    case TANH: dz.vec() = fx.vec().binaryExpr(dEdf.vec(), scalar_tanh_backward_op<float>()); break;
+    case LOGISTIC: dz.vec() = fx.vec().binaryExpr(dEdf.vec(), scalar_logistic_sigmoid_backward_op<float>()); break;
+  }
+#endif
+}
+
+void AffineActivation::backward_impl(const vector<const Tensor*>& xs,
+                                     const Tensor& fx,
+                                     const Tensor& dEdf,
+                                     unsigned i,
+                                     Tensor& dEdxi) const {
+#if HAVE_CUDA
+  throw std::runtime_error("AffineActivation not yet implemented for CUDA");
+#else
+  // the gradient of the affine transform, computed by backward_prepare
+  const Tensor dz(fx.d, static_cast<float*>(aux_mem));
+  AffineTransform::backward_impl(xs, fx, dz, i, dEdxi);
+#endif
+}
+
+void CwiseMultiplyAdd::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+#if HAVE_CUDA
+  throw std::runtime_error("CwiseMultiplyAdd not yet implemented for CUDA");
+#else
+  if (xs.size() == 3)
+    fx.vec() = xs[0]->vec().cwiseProduct(xs[1]->vec()) + xs[2]->vec();
+  else
+    fx.vec() = xs[0]->vec().cwiseProduct(xs[1]->vec()) + xs[2]->vec().cwiseProduct(xs[3]->vec());
+#endif
+}
+
+void CwiseMultiplyAdd::backward_impl(const vector<const Tensor*>& xs,
+                                     const Tensor& fx,
+                                     const Tensor& dEdf,
+                                     unsigned i,
+                                     Tensor& dEdxi) const {
+#if HAVE_CUDA
+  throw std::runtime_error("CwiseMultiplyAdd not yet implemented for CUDA");
+#else
+  if (i == 2 && xs.size() == 3) {
+    dEdxi.vec() += dEdf.vec();
+  } else {
+    // the other factor of the same product
+    const unsigned j = i ^ 1;
+    dEdxi.vec() += dEdf.vec().cwiseProduct(xs[j]->vec());
+  }
+#endif
+}
+
+size_t PickRestrictedLogSoftmax::aux_storage_size() const {
+  // the log normalizer
+  return sizeof(float);
+}
+
+void PickRestrictedLogSoftmax::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+#ifdef HAVE_CUDA
+  throw std::runtime_error("PickRestrictedLogSoftmax not yet implemented for CUDA");
+#else
+  assert(xs.size() == 1);
+  assert(denom.size() > 0);
+  auto x = **xs[0];
+  real* logz = static_cast<real*>(aux_mem);
+  *logz = logsumexp(x, denom);
+  if (find(denom.begin(), denom.end(), *pval) == denom.end())
+    fx.v[0] = -numeric_limits<real>::infinity();
+  else if (denom.size() == 1)
+    fx.v[0] = 0;
+  else
+    fx.v[0] = x(*pval, 0) - *logz;
+#endif
+}
+
+void PickRestrictedLogSoftmax::backward_impl(const vector<const Tensor*>& xs,
+                                             const Tensor& fx,
+                                             const Tensor& dEdf,
+                                             unsigned i,
+                                             Tensor& dEdxi) const {
+  assert(i == 0);
+#ifdef HAVE_CUDA
+  throw std::runtime_error("PickRestrictedLogSoftmax not yet implemented for CUDA");
+#else
+  if (find(denom.begin(), denom.end(), *pval) == denom.end()) return;
+  auto x = **xs[0];
+  const real logz = *static_cast<const real*>(aux_mem);
+  const real g = dEdf.v[0];
+  for (auto ind : denom)
+    (*dEdxi)(ind, 0) += (ind == *pval ? g : 0) - expf(x(ind, 0) - logz) * g;
+#endif
+}
+
 } // namespace cnn
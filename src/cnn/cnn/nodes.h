@@ -207,6 +207,8 @@ struct Reshape : public Node {
   explicit Reshape(const std::initializer_list<VariableIndex>& a, const Dim& to) : Node(a), to(to) {}
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
+  // the batch elements may be reshaped too, e.g. into the columns of a matrix
+  virtual bool supports_multibatch() const override { return true; }
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
                   const Tensor& fx,
@@ -284,6 +286,7 @@ struct GaussianNoise : public Node {
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
   virtual bool supports_multibatch() const override { return true; }
+  bool uses_random_numbers() const override { return true; }
   size_t aux_storage_size() const override;
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
@@ -300,6 +303,7 @@ struct Dropout : public Node {
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
   size_t aux_storage_size() const override;
+  bool uses_random_numbers() const override { return true; }
   virtual bool supports_multibatch() const override { return true; }
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
@@ -316,6 +320,7 @@ struct BlockDropout : public Node {
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
   size_t aux_storage_size() const override;
+  bool uses_random_numbers() const override { return true; }
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
                 const Tensor& fx,
@@ -500,6 +505,42 @@ struct ConcatenateColumns : public Node {
                   Tensor& dEdxi) const override;
 };
 
+// concatenate along the batch dimension
+// x_i must all have the same (single-batch) shape; y.bd = \sum_i x_i.bd
+struct ConcatenateToBatch : public Node {
+  template <typename T> explicit ConcatenateToBatch(const T& a) : Node(a) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool supports_multibatch() const override { return true; }
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                  const Tensor& fx,
+                  const Tensor& dEdf,
+                  unsigned i,
+                  Tensor& dEdxi) const override;
+  // src_batch_indices[i] says which batch element of fx x_i starts at
+  mutable std::vector<unsigned> src_batch_indices;
+};
+
+// x_1 is a mini-batch
+// y = (x_1)_{batch element *pval}
+struct PickBatchElement : public Node {
+  explicit PickBatchElement(const std::initializer_list<VariableIndex>& a, unsigned v) : Node(a), val(v), pval(&val) {}
+  // use this constructor if you want to change the value after the graph is constructed
+  explicit PickBatchElement(const std::initializer_list<VariableIndex>& a, const unsigned* pv) : Node(a), val(), pval(pv) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool supports_multibatch() const override { return true; }
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                  const Tensor& fx,
+                  const Tensor& dEdf,
+                  unsigned i,
+                  Tensor& dEdxi) const override;
+  unsigned val;
+  const unsigned* pval;
+};
+
 // x_1 is a scalar (or row vector)
 // x_2 is a scalar (or row vector)
 // y = max(0, margin - x_1 + x_2)
@@ -900,6 +941,7 @@ struct PickNegLogSoftmax : public Node {
   std::string as_string(const std::vector<std::string>& arg_names) const override;
   Dim dim_forward(const std::vector<Dim>& xs) const override;
   virtual bool supports_multibatch() const override { return true; }
+  size_t aux_storage_size() const override;
   void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
   void backward_impl(const std::vector<const Tensor*>& xs,
                     const Tensor& fx,
@@ -928,6 +970,21 @@ struct RestrictedLogSoftmax : public Node {
   std::vector<unsigned> denom;
 };
 
+// y = r_log_softmax(x_1 + x_2 * x_3, denom), where x_3 is a vector, computing
+// only the rows of x_1 + x_2 * x_3 that are in denom
+struct RestrictedAffineLogSoftmax : public Node {
+  explicit RestrictedAffineLogSoftmax(const std::initializer_list<VariableIndex>& a, const std::vector<unsigned>& d) : Node(a), denom(d) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                    const Tensor& fx,
+                    const Tensor& dEdf,
+                    unsigned i,
+                    Tensor& dEdxi) const override;
+  std::vector<unsigned> denom;
+};
+
 // x_1 is a vector
 // y = (x_1)_{*pval}
 // this is used to implement cross-entropy training
@@ -970,6 +1027,88 @@ struct PickRange : public Node {
   unsigned end;
 };
 
+// the LSTM cell of LSTMBuilder, with coupled input and forget gates and
+// peephole connections, in a single node
+// x_1 = [a_i; a_c; a_o] are the pre-activations of the input gate, the
+// memory cell and the output gate without their peephole terms, and either
+//   y = lstm_cell(x_1, C2O)                  (no previous state)
+//   y = lstm_cell(x_1, c_{t-1}, C2I, C2O)
+// y = [h_t; c_t]
+struct LSTMCell : public Node {
+  explicit LSTMCell(const std::initializer_list<VariableIndex>& a) : Node(a) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  size_t aux_storage_size() const override;
+  virtual bool supports_multibatch() const override { return true; }
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                    const Tensor& fx,
+                    const Tensor& dEdf,
+                    unsigned i,
+                    Tensor& dEdxi) const override;
+  // computes the gradients of the pre-activations and of c_t (in aux_mem)
+  void backward_prepare(const std::vector<const Tensor*>& xs,
+                        const Tensor& fx,
+                        const Tensor& dEdf) const override;
+};
+
+// the nodes below are not created by Expressions but by GraphOptimize,
+// which replaces common patterns of simpler nodes with them
+
+// y = f(x_1 + x_2 * x_3 + ...) where f is an elementwise activation function
+// (an AffineTransform followed by a Rectify, Tanh or LogisticSigmoid)
+struct AffineActivation : public AffineTransform {
+  enum Activation { RECTIFY, TANH, LOGISTIC };
+  template <typename T> explicit AffineActivation(const T& a, Activation f) : AffineTransform(a), activation(f) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  size_t aux_storage_size() const override;
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                  const Tensor& fx,
+                  const Tensor& dEdf,
+                  unsigned i,
+                  Tensor& dEdxi) const override;
+  // computes the gradient of the affine transform (in aux_mem)
+  void backward_prepare(const std::vector<const Tensor*>& xs,
+                        const Tensor& fx,
+                        const Tensor& dEdf) const override;
+  Activation activation;
+};
+
+// y = x_1 \odot x_2 + x_3  or  y = x_1 \odot x_2 + x_3 \odot x_4
+// (a Sum of CwiseMultiplys and at most one other term, all of the same dimensions)
+struct CwiseMultiplyAdd : public Node {
+  template <typename T> explicit CwiseMultiplyAdd(const T& a) : Node(a) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  virtual bool supports_multibatch() const override { return true; }
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                  const Tensor& fx,
+                  const Tensor& dEdf,
+                  unsigned i,
+                  Tensor& dEdxi) const override;
+};
+
+// y = (r_log_softmax(x_1))_{*pval} without computing the other elements
+// (a PickElement of a RestrictedLogSoftmax)
+struct PickRestrictedLogSoftmax : public Node {
+  template <typename T> explicit PickRestrictedLogSoftmax(const T& a, const std::vector<unsigned>& d, unsigned v) : Node(a), denom(d), val(v), pval(&val) {}
+  template <typename T> explicit PickRestrictedLogSoftmax(const T& a, const std::vector<unsigned>& d, const unsigned* pv) : Node(a), denom(d), val(), pval(pv) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  size_t aux_storage_size() const override;
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                    const Tensor& fx,
+                    const Tensor& dEdf,
+                    unsigned i,
+                    Tensor& dEdxi) const override;
+  std::vector<unsigned> denom;
+  unsigned val;
+  const unsigned* pval;
+};
+
 // represents a simple vector of 0s
 struct Zeroes : public Node {
   explicit Zeroes(const Dim& d) : dim(d) {}
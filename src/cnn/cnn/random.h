@@ -5,7 +5,11 @@
 
 namespace cnn {
 
-extern std::mt19937* rndeng;
+// the random number generator of the calling thread: the main thread's is
+// seeded with --cnn-seed, and the generator of every other thread with the
+// next number from a generator that is also seeded with --cnn-seed, so that
+// results only depend on the order in which threads first use theirs
+extern thread_local std::mt19937* rndeng;
 
 } // namespace cnn
 
@@ -44,10 +44,8 @@ struct RNNBuilder {
   // add another timestep by reading in the variable x
   // return the hidden representation of the deepest layer
   Expression add_input(const Expression& x) {
-    sm.transition(RNNOp::add_input);
-    head.push_back(cur);
     int rcp = cur;
-    cur = head.size() - 1;
+    new_step(cur);
     return add_input_impl(rcp, x);
   }
 
@@ -55,9 +53,7 @@ struct RNNBuilder {
   // rather than to head[cur]
   // this can be used to construct trees, implement beam search, etc.
   Expression add_input(const RNNPointer& prev, const Expression& x) {
-    sm.transition(RNNOp::add_input);
-    head.push_back(prev);
-    cur = head.size() - 1;
+    new_step(prev);
     return add_input_impl(prev, x);
   }
 
@@ -85,6 +81,13 @@ struct RNNBuilder {
   virtual void new_graph_impl(ComputationGraph& cg) = 0;
   virtual void start_new_sequence_impl(const std::vector<Expression>& h_0) = 0;
   virtual Expression add_input_impl(int prev, const Expression& x) = 0;
+  // adds a timestep with a recurrent connection to prev, as add_input does;
+  // for builders that also accept their input in other forms
+  void new_step(const RNNPointer& prev) {
+    sm.transition(RNNOp::add_input);
+    head.push_back(prev);
+    cur = head.size() - 1;
+  }
   RNNPointer cur;
  private:
   // the state machine ensures that the caller is behaving
@@ -1,6 +1,9 @@
 #include <cnn/cnn.h>
 #define BOOST_TEST_MODULE CNNBasicTest
 #include <boost/test/unit_test.hpp>
+#include <cerrno>
+#include <sys/mman.h>
+#include <unistd.h>
 
 struct ConfigureCNNTest {
   ConfigureCNNTest() {
@@ -31,3 +34,57 @@ BOOST_AUTO_TEST_CASE( aligned_allocator ) {
   a.free(mem);
 }
 
+
+BOOST_AUTO_TEST_CASE( memory_pool_grows ) {
+  cnn::CPUAllocator a;
+  cnn::AlignedMemoryPool pool(1024, &a);
+  BOOST_CHECK_EQUAL(pool.reserved_bytes(), 1024);
+  char* p1 = static_cast<char*>(pool.allocate(800));
+  char* p2 = static_cast<char*>(pool.allocate(800));
+  char* p3 = static_cast<char*>(pool.allocate(3000));  // larger than a chunk
+  for (auto p : {p1, p2, p3}) {
+    BOOST_CHECK_EQUAL(((unsigned long)(p) & 0x1f), 0);
+    BOOST_CHECK_EQUAL(p[0], 0);  // newly reserved memory is zeroed
+  }
+  memset(p1, 1, 800);
+  memset(p2, 2, 800);
+  memset(p3, 3, 3000);
+  BOOST_CHECK_EQUAL(p1[799], 1);
+  BOOST_CHECK_EQUAL(p2[799], 2);
+  BOOST_CHECK_EQUAL(pool.used_bytes(), 4608);
+  BOOST_CHECK_EQUAL(pool.peak_bytes(), 4608);
+  const size_t reserved = pool.reserved_bytes();
+  BOOST_CHECK(reserved >= 4608);
+  pool.free();
+  BOOST_CHECK_EQUAL(pool.used_bytes(), 0);
+  BOOST_CHECK_EQUAL(pool.peak_bytes(), 4608);
+  // the same allocations reuse the chunks
+  pool.allocate(800);
+  pool.allocate(800);
+  pool.allocate(3000);
+  BOOST_CHECK_EQUAL(pool.reserved_bytes(), reserved);
+  pool.zero_allocated_memory();
+  BOOST_CHECK_EQUAL(p1[0], 0);
+  BOOST_CHECK_EQUAL(p3[2999], 0);
+}
+
+// the chunks of a shared pool are unmapped when it is destroyed
+BOOST_AUTO_TEST_CASE( shared_memory_pool_released ) {
+  cnn::SharedAllocator a;
+  const size_t page = sysconf(_SC_PAGESIZE);
+  void* chunks[2];
+  {
+    cnn::AlignedMemoryPool pool(page, &a);
+    chunks[0] = pool.allocate(page);
+    chunks[1] = pool.allocate(2 * page);  // in a second chunk
+    static_cast<char*>(chunks[1])[0] = 1;
+    unsigned char resident[2];
+    for (void* c : chunks) BOOST_CHECK_EQUAL(mincore(c, page, resident), 0);
+  }
+  // mincore fails with ENOMEM for pages that are not mapped
+  unsigned char resident[2];
+  for (void* c : chunks) {
+    BOOST_CHECK_EQUAL(mincore(c, page, resident), -1);
+    BOOST_CHECK_EQUAL(errno, ENOMEM);
+  }
+}
@@ -0,0 +1,266 @@
+#include <cnn/cnn.h>
+#include <cnn/expr.h>
+#include <cnn/exec.h>
+#include <cnn/nodes.h>
+#include <cnn/grad-check.h>
+#include <cnn/mp.h>
+#include <boost/test/unit_test.hpp>
+#include <cmath>
+#include <thread>
+#include <unistd.h>
+
+using namespace cnn;
+using namespace cnn::expr;
+using namespace std;
+
+struct ExecTest {
+  ExecTest() {
+    w = mod.add_parameters({4, 3});
+    u = mod.add_parameters({4, 4});
+    b = mod.add_parameters({4});
+    for (unsigned i = 0; i < 4; ++i)
+      xs_vals.push_back({0.3f * i - 0.5f, 0.2f - 0.1f * i, 0.4f});
+  }
+  ~ExecTest() {
+    autobatch = false;
+    graph_optimize = false;
+    num_threads = 1;
+    ParallelExecutionEngine::min_parallel_work = min_parallel_work;
+  }
+
+  // three independent recurrences over the same parameters, the first of
+  // which is shorter, so every level has affine transforms to batch
+  Expression build_graph(ComputationGraph& cg) {
+    Expression W = parameter(cg, w), U = parameter(cg, u), B = parameter(cg, b);
+    vector<Expression> last;
+    for (unsigned s = 0; s < 3; ++s) {
+      Expression h;
+      for (unsigned t = 0; t < 2 + (s > 0); ++t) {
+        Expression x = input(cg, {3}, xs_vals[(s + t) % 4]);
+        h = tanh(t == 0 ? affine_transform({B, W, x}) : affine_transform({B, W, x, U, h}));
+      }
+      last.push_back(squared_norm(h));
+    }
+    return sum(last);
+  }
+
+  // every pattern that GraphOptimize fuses, the first of them being
+  // h = rectify(a)
+  Expression build_fusable_graph(ComputationGraph& cg, Expression* a = nullptr, Expression* h = nullptr) {
+    Expression W = parameter(cg, w), U = parameter(cg, u), B = parameter(cg, b);
+    Expression x = input(cg, {3}, xs_vals[1]);
+    Expression ra = affine_transform({B, W, x});
+    Expression r = rectify(ra);
+    Expression g = logistic(affine_transform({B, U, r}));
+    Expression c = cwise_multiply(g, r) + tanh(affine_transform({B, W, x, U, r}));
+    Expression d = cwise_multiply(g, c) + cwise_multiply(r, c);
+    if (a) *a = ra;
+    if (h) *h = r;
+    return pick(log_softmax(d, {0, 2, 3}), 2) + pick(log_softmax(c, {1}), 1);
+  }
+
+  // value of the graph and the parameter gradients it produces
+  float run(vector<float>* grads, bool fusable = false) {
+    ComputationGraph cg;
+    if (fusable) build_fusable_graph(cg); else build_graph(cg);
+    float v = as_scalar(cg.forward());
+    mod.reset_gradient();
+    cg.backward();
+    grads->clear();
+    for (auto p : {w, u, b})
+      for (auto g : as_vector(p->g)) grads->push_back(g);
+    return v;
+  }
+
+  cnn::Model mod;
+  cnn::Parameters *w, *u, *b;
+  vector<vector<float>> xs_vals;
+  const size_t min_parallel_work = ParallelExecutionEngine::min_parallel_work;
+};
+
+BOOST_FIXTURE_TEST_SUITE(exec_test, ExecTest);
+
+// the batched engine computes the same values and gradients as the simple one
+BOOST_AUTO_TEST_CASE( batched_execution_matches_simple ) {
+  vector<float> simple_grads, batched_grads;
+  autobatch = false;
+  float simple = run(&simple_grads);
+  autobatch = true;
+  float batched = run(&batched_grads);
+  BOOST_CHECK_CLOSE(simple, batched, 1e-3);
+  BOOST_REQUIRE_EQUAL(simple_grads.size(), batched_grads.size());
+  for (unsigned i = 0; i < simple_grads.size(); ++i)
+    BOOST_CHECK_SMALL(simple_grads[i] - batched_grads[i], 1e-5f);
+}
+
+BOOST_AUTO_TEST_CASE( batched_execution_gradient ) {
+  autobatch = true;
+  ComputationGraph cg;
+  build_graph(cg);
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// the optimizing engine computes the same values and gradients as the
+// simple one, with the nodes fused
+BOOST_AUTO_TEST_CASE( optimized_execution_matches_simple ) {
+  for (bool fusable : {false, true}) {
+    vector<float> simple_grads, optimized_grads;
+    graph_optimize = false;
+    float simple = run(&simple_grads, fusable);
+    graph_optimize = true;
+    float optimized = run(&optimized_grads, fusable);
+    BOOST_CHECK_CLOSE(simple, optimized, 1e-3);
+    BOOST_REQUIRE_EQUAL(simple_grads.size(), optimized_grads.size());
+    for (unsigned i = 0; i < simple_grads.size(); ++i)
+      BOOST_CHECK_SMALL(simple_grads[i] - optimized_grads[i], 1e-5f);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( optimized_execution_gradient ) {
+  graph_optimize = true;
+  ComputationGraph cg;
+  build_fusable_graph(cg);
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// the arguments that were fused into other nodes are not computed, but
+// their values are still available
+BOOST_AUTO_TEST_CASE( optimized_graph_values ) {
+  graph_optimize = true;
+  ComputationGraph cg;
+  Expression a, h;
+  Expression y = build_fusable_graph(cg, &a, &h);
+  cg.forward();
+  BOOST_CHECK(dynamic_cast<const AffineActivation*>(cg.nodes[h.i]));
+  unsigned affine = 0, multiply_add = 0, pick_softmax = 0;
+  for (const Node* node : cg.nodes) {
+    affine += dynamic_cast<const AffineActivation*>(node) != nullptr;
+    multiply_add += dynamic_cast<const CwiseMultiplyAdd*>(node) != nullptr;
+    pick_softmax += dynamic_cast<const PickRestrictedLogSoftmax*>(node) != nullptr;
+  }
+  BOOST_CHECK_EQUAL(affine, 3u);
+  BOOST_CHECK_EQUAL(multiply_add, 2u);
+  BOOST_CHECK_EQUAL(pick_softmax, 2u);
+  BOOST_CHECK_CLOSE(as_scalar(y.value()), as_scalar(cg.forward()), 1e-4);
+  vector<float> av = as_vector(a.value()), hv = as_vector(h.value());
+  BOOST_REQUIRE_EQUAL(av.size(), hv.size());
+  for (unsigned i = 0; i < av.size(); ++i)
+    BOOST_CHECK_CLOSE(hv[i] + 1, max(av[i], 0.f) + 1, 1e-4);
+}
+
+// the parallel engine computes the same values and gradients as the simple
+// one, in every level of the graph
+BOOST_AUTO_TEST_CASE( parallel_execution_matches_simple ) {
+  ParallelExecutionEngine::min_parallel_work = 0;
+  for (bool fusable : {false, true}) {
+    vector<float> simple_grads, parallel_grads;
+    num_threads = 1;
+    float simple = run(&simple_grads, fusable);
+    num_threads = 4;
+    for (unsigned k = 0; k < 20; ++k) {
+      float parallel = run(&parallel_grads, fusable);
+      BOOST_CHECK_CLOSE(simple, parallel, 1e-3);
+      BOOST_REQUIRE_EQUAL(simple_grads.size(), parallel_grads.size());
+      for (unsigned i = 0; i < simple_grads.size(); ++i)
+        BOOST_CHECK_SMALL(simple_grads[i] - parallel_grads[i], 1e-5f);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( parallel_execution_gradient ) {
+  ParallelExecutionEngine::min_parallel_work = 0;
+  num_threads = 4;
+  ComputationGraph cg;
+  build_graph(cg);
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// graphs have their own memory, so several can exist at the same time, and
+// be evaluated in different threads over the same parameters
+BOOST_AUTO_TEST_CASE( concurrent_graphs ) {
+  vector<float> grads;
+  const float expected = run(&grads);
+  {
+    ComputationGraph cg1, cg2;
+    Expression e1 = build_graph(cg1), e2 = build_graph(cg2);
+    BOOST_CHECK_CLOSE(as_scalar(cg1.forward()), expected, 1e-4);
+    BOOST_CHECK_CLOSE(as_scalar(cg2.forward()), expected, 1e-4);
+    BOOST_CHECK_CLOSE(as_scalar(e1.value()), expected, 1e-4);
+    BOOST_CHECK_CLOSE(as_scalar(e2.value()), expected, 1e-4);
+    mod.reset_gradient();
+    cg1.backward();
+    vector<float> grads1;
+    for (auto p : {w, u, b})
+      for (auto g : as_vector(p->g)) grads1.push_back(g);
+    BOOST_REQUIRE_EQUAL(grads.size(), grads1.size());
+    for (unsigned i = 0; i < grads.size(); ++i)
+      BOOST_CHECK_SMALL(grads[i] - grads1[i], 1e-5f);
+  }
+  vector<float> values(4);
+  vector<std::thread> threads;
+  for (unsigned t = 0; t < values.size(); ++t) {
+    threads.push_back(std::thread([this, t, &values] {
+      for (unsigned k = 0; k < 20; ++k) {
+        ComputationGraph cg;
+        build_graph(cg);
+        values[t] += as_scalar(cg.forward());
+      }
+    }));
+  }
+  for (auto& t : threads) t.join();
+  for (float v : values)
+    BOOST_CHECK_CLOSE(v, 20 * expected, 1e-3);
+}
+
+// a process forked right after a parallel evaluation (as by mp::ParallelMap)
+// may have copied the pool's lock while a worker held it, so it must not use
+// the pool
+BOOST_AUTO_TEST_CASE( parallel_execution_in_forked_child ) {
+  ParallelExecutionEngine::min_parallel_work = 0;
+  num_threads = 4;
+  vector<float> grads;
+  const float expected = run(&grads);
+  for (unsigned k = 0; k < 20; ++k) {
+    run(&grads);
+    vector<float> values = mp::ParallelMap<float>(4, 2, [this](unsigned) {
+      alarm(10); // fail rather than hang if the worker deadlocks
+      ComputationGraph cg;
+      build_graph(cg);
+      return as_scalar(cg.forward());
+    });
+    for (float v : values)
+      BOOST_CHECK_CLOSE(v, expected, 1e-3);
+  }
+}
+
+// the nodes of a graph live in an arena that clear() resets, so a graph can
+// be rebuilt many times, with more nodes than fit in one arena block
+BOOST_AUTO_TEST_CASE( graph_reuse_after_clear ) {
+  vector<float> grads;
+  const float expected = run(&grads);
+  ComputationGraph cg;
+  for (unsigned k = 0; k < 3; ++k) {
+    cg.clear();
+    vector<Expression> terms;
+    for (unsigned i = 0; i < 2000; ++i)
+      terms.push_back(build_graph(cg) * (1.f / 2000));
+    sum(terms);
+    BOOST_CHECK_CLOSE(as_scalar(cg.forward()), expected, 1e-3);
+  }
+}
+
+// parameters, and the values and derivatives of a graph, may need more
+// memory than --cnn-mem (10MB in the tests): the pools grow
+BOOST_AUTO_TEST_CASE( graph_larger_than_pool_chunk ) {
+  const unsigned n = 3 << 20;  // 12MB of floats
+  Parameters* p = mod.add_parameters({n});
+  TensorTools::Constant(p->values, 0.5f);
+  ComputationGraph cg;
+  Expression x = parameter(cg, p);
+  squared_norm(x * 2.f + x);
+  BOOST_CHECK_CLOSE(as_scalar(cg.forward()), n * 2.25f, 1e-2);
+  cg.backward();
+  BOOST_CHECK_CLOSE(as_vector(p->g)[n - 1], 9.f, 1e-3);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
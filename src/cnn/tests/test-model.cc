@@ -0,0 +1,126 @@
+#include <cnn/cnn.h>
+#include <cnn/model.h>
+#include <boost/test/unit_test.hpp>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace cnn;
+using namespace std;
+
+struct ModelTest {
+  ModelTest() {
+    ostringstream os;
+    os << "/tmp/cnn-test-model." << getpid() << ".bin";
+    file = os.str();
+  }
+  ~ModelTest() { remove(file.c_str()); }
+
+  // adds parameters of the same shapes to m, in the same order
+  static void build(Model& m, Parameters** w, Parameters** b, LookupParameters** e) {
+    *w = m.add_parameters({5, 3});
+    *b = m.add_parameters({5});
+    *e = m.add_lookup_parameters(7, {3});
+  }
+
+  static void check_equal(Parameters* w1, Parameters* b1, LookupParameters* e1,
+                          Parameters* w2, Parameters* b2, LookupParameters* e2) {
+    BOOST_CHECK(as_vector(w1->values) == as_vector(w2->values));
+    BOOST_CHECK(as_vector(b1->values) == as_vector(b2->values));
+    for (unsigned i = 0; i < e1->values.size(); ++i)
+      BOOST_CHECK(as_vector(e1->values[i]) == as_vector(e2->values[i]));
+  }
+
+  string file;
+};
+
+BOOST_FIXTURE_TEST_SUITE(model_test, ModelTest);
+
+// saving and loading a binary model restores the values exactly, whether
+// they are copied or mapped
+BOOST_AUTO_TEST_CASE( binary_model_round_trip ) {
+  Model m1;
+  Parameters *w1, *b1;
+  LookupParameters *e1;
+  build(m1, &w1, &b1, &e1);
+  save_cnn_model_binary(file, m1);
+  BOOST_CHECK(is_binary_cnn_model(file));
+  for (bool map : {false, true}) {
+    Model m2;
+    Parameters *w2, *b2;
+    LookupParameters *e2;
+    build(m2, &w2, &b2, &e2);
+    load_cnn_model_binary(file, &m2, map);
+    check_equal(w1, b1, e1, w2, b2, e2);
+    if (map) BOOST_CHECK(reinterpret_cast<size_t>(e2->values[3].v) % 64 == 0);
+  }
+  Model m3;
+  Parameters *w3, *b3;
+  LookupParameters *e3;
+  build(m3, &w3, &b3, &e3);
+  load_cnn_model(file, &m3);
+  check_equal(w1, b1, e1, w3, b3, e3);
+}
+
+// the metadata is saved with the parameters and can be read on its own
+BOOST_AUTO_TEST_CASE( binary_model_metadata ) {
+  Model m1;
+  Parameters *w1, *b1;
+  LookupParameters *e1;
+  build(m1, &w1, &b1, &e1);
+  const string metadata("vocabulary\0and options", 22);
+  save_cnn_model_binary(file, m1, metadata);
+  BOOST_CHECK(read_cnn_model_metadata(file) == metadata);
+  Model m2;
+  Parameters *w2, *b2;
+  LookupParameters *e2;
+  build(m2, &w2, &b2, &e2);
+  load_cnn_model_binary(file, &m2, true);
+  check_equal(w1, b1, e1, w2, b2, e2);
+}
+
+// a mapped model can be saved over the file it was loaded from, and the
+// values it maps are not changed by saving another model there
+BOOST_AUTO_TEST_CASE( binary_model_save_over_mapped_file ) {
+  Model m1;
+  Parameters *w1, *b1;
+  LookupParameters *e1;
+  build(m1, &w1, &b1, &e1);
+  save_cnn_model_binary(file, m1);
+  Model m2;
+  Parameters *w2, *b2;
+  LookupParameters *e2;
+  build(m2, &w2, &b2, &e2);
+  load_cnn_model_binary(file, &m2, true);
+  save_cnn_model_binary(file, m2);
+  check_equal(w1, b1, e1, w2, b2, e2);
+  Model m3;
+  Parameters *w3, *b3;
+  LookupParameters *e3;
+  build(m3, &w3, &b3, &e3);
+  save_cnn_model_binary(file, m3);
+  check_equal(w1, b1, e1, w2, b2, e2);
+  Model m4;
+  Parameters *w4, *b4;
+  LookupParameters *e4;
+  build(m4, &w4, &b4, &e4);
+  load_cnn_model_binary(file, &m4);
+  check_equal(w3, b3, e3, w4, b4, e4);
+}
+
+// a model with different parameters is rejected
+BOOST_AUTO_TEST_CASE( binary_model_mismatch ) {
+  Model m1;
+  Parameters *w1, *b1;
+  LookupParameters *e1;
+  build(m1, &w1, &b1, &e1);
+  save_cnn_model_binary(file, m1);
+  Model m2;
+  m2.add_parameters({5, 4});
+  m2.add_parameters({5});
+  m2.add_lookup_parameters(7, {3});
+  BOOST_CHECK_THROW(load_cnn_model_binary(file, &m2), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
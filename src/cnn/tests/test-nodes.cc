@@ -366,6 +366,40 @@ BOOST_AUTO_TEST_CASE( restricted_log_softmax_gradient ) {
   BOOST_CHECK(CheckGrad(mod, cg, 0));
 }
 
+// Expression restricted_affine_log_softmax(const Expression& b, const Expression& W, const Expression& x, const std::vector<unsigned>& restriction);
+BOOST_AUTO_TEST_CASE( restricted_affine_log_softmax_gradient ) {
+  vector<unsigned> restriction = {0,2};
+  cnn::Parameters* paramW = mod.add_parameters({3,3});
+  TensorTools::SetElements(paramW->values, {0.5f,-1.f,0.2f,1.5f,0.3f,-0.7f,0.1f,0.4f,0.9f});
+  cnn::ComputationGraph cg;
+  Expression b = parameter(cg, param1);
+  Expression W = parameter(cg, paramW);
+  Expression x = parameter(cg, param2);
+  Expression y = exp( restricted_affine_log_softmax(b, W, x, restriction) );
+  input(cg, {1,3}, first_one_vals) * y;
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// restricted_affine_log_softmax(b, W, x, r) == log_softmax(affine_transform({b, W, x}), r)
+BOOST_AUTO_TEST_CASE( restricted_affine_log_softmax_value ) {
+  vector<unsigned> restriction = {0,2};
+  cnn::Parameters* paramW = mod.add_parameters({3,3});
+  TensorTools::SetElements(paramW->values, {0.5f,-1.f,0.2f,1.5f,0.3f,-0.7f,0.1f,0.4f,0.9f});
+  cnn::ComputationGraph cg;
+  Expression b = parameter(cg, param1);
+  Expression W = parameter(cg, paramW);
+  Expression x = parameter(cg, param2);
+  Expression full = log_softmax(affine_transform({b, W, x}), restriction);
+  Expression fused = restricted_affine_log_softmax(b, W, x, restriction);
+  cg.forward();
+  vector<float> expected = as_vector(full.value()), actual = as_vector(fused.value());
+  BOOST_REQUIRE_EQUAL(expected.size(), actual.size());
+  for (unsigned i = 0; i < expected.size(); ++i) {
+    if (i == 1) BOOST_CHECK(actual[i] < -1e30f);
+    else BOOST_CHECK_CLOSE(expected[i], actual[i], 1e-3);
+  }
+}
+
 // Expression softmax(const Expression& x);
 BOOST_AUTO_TEST_CASE( softmax_gradient ) {
   cnn::ComputationGraph cg;
@@ -446,6 +480,16 @@ BOOST_AUTO_TEST_CASE( reshape_gradient ) {
   BOOST_CHECK(CheckGrad(mod, cg, 0));
 }
 
+// Expression reshape(const Expression& x, const Dim& d);
+BOOST_AUTO_TEST_CASE( reshape_batch_gradient ) {
+  cnn::ComputationGraph cg;
+  Expression x1 = parameter(cg, param1);
+  Expression x2 = input(cg, Dim({3},2), batch_vals);
+  Expression y = reshape(x1 + x2, {3,2});
+  input(cg, {1,3}, ones3_vals) * y * input(cg, {2}, ones2_vals);
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
 // Expression transpose(const Expression& x);
 BOOST_AUTO_TEST_CASE( transpose_gradient ) {
   cnn::ComputationGraph cg;
@@ -597,4 +641,106 @@ BOOST_AUTO_TEST_CASE( pickneglogsoftmax_batch_gradient ) {
   BOOST_CHECK(CheckGrad(mod, cg, 0));
 }
 
+// Expression concatenate_to_batch(const std::initializer_list<Expression>& xs);
+BOOST_AUTO_TEST_CASE( concatenate_to_batch_gradient ) {
+  cnn::ComputationGraph cg;
+  Expression x1 = parameter(cg, param1);
+  Expression x2 = parameter(cg, param2);
+  Expression x3 = input(cg, Dim({3},2), batch_vals);
+  Expression y = concatenate_to_batch({x1, x3, x2});
+  Expression z = input(cg, {1,3}, first_one_vals) * cwise_multiply(y, y);
+  sum_batches(z);
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// Expression pick_batch_elem(const Expression& x, unsigned v);
+BOOST_AUTO_TEST_CASE( pick_batch_elem_gradient ) {
+  cnn::ComputationGraph cg;
+  Expression x1 = parameter(cg, param1);
+  Expression x2 = input(cg, Dim({3},2), batch_vals);
+  Expression y = pick_batch_elem(x1 + x2, 1);
+  input(cg, {1,3}, ones3_vals) * y;
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// parameters of a two-unit lstm_cell
+struct LSTMCellParams {
+  LSTMCellParams(cnn::Model& mod) {
+    a = mod.add_parameters({6});
+    TensorTools::SetElements(a->values, {0.5f, -1.2f, 0.3f, 0.8f, -0.4f, 1.1f});
+    c = mod.add_parameters({2});
+    TensorTools::SetElements(c->values, {-0.7f, 0.9f});
+    c2i = mod.add_parameters({2,2});
+    TensorTools::SetElements(c2i->values, {0.2f, -0.5f, 0.6f, 0.1f});
+    c2o = mod.add_parameters({2,2});
+    TensorTools::SetElements(c2o->values, {-0.3f, 0.4f, 0.7f, -0.2f});
+    w1 = {1.f, -2.f, 0.5f, 3.f};
+    w2 = {0.5f, 1.f, -1.f, 2.f};
+  }
+  cnn::Parameters *a, *c, *c2i, *c2o;
+  // weights of [h_t; c_t] in the loss
+  std::vector<float> w1, w2;
+};
+
+// Expression lstm_cell(const Expression& a, const Expression& c_tm1, const Expression& C2I, const Expression& C2O);
+BOOST_AUTO_TEST_CASE( lstm_cell_value ) {
+  LSTMCellParams p(mod);
+  cnn::ComputationGraph cg;
+  Expression a = parameter(cg, p.a), c = parameter(cg, p.c);
+  Expression C2I = parameter(cg, p.c2i), C2O = parameter(cg, p.c2o);
+  Expression y = lstm_cell(a, c, C2I, C2O);
+  Expression it = logistic(pickrange(a, 0, 2) + C2I * c);
+  Expression ct = cwise_multiply(1.f - it, c) + cwise_multiply(it, tanh(pickrange(a, 2, 4)));
+  Expression ht = cwise_multiply(logistic(pickrange(a, 4, 6) + C2O * ct), tanh(ct));
+  vector<float> fused = as_vector(y.value());
+  vector<float> expected = as_vector(concatenate({ht, ct}).value());
+  BOOST_REQUIRE_EQUAL(fused.size(), expected.size());
+  for (unsigned i = 0; i < fused.size(); ++i)
+    BOOST_CHECK_SMALL(fused[i] - expected[i], 1e-6f);
+}
+
+BOOST_AUTO_TEST_CASE( lstm_cell_gradient ) {
+  LSTMCellParams p(mod);
+  cnn::ComputationGraph cg;
+  Expression y = lstm_cell(parameter(cg, p.a), parameter(cg, p.c),
+                           parameter(cg, p.c2i), parameter(cg, p.c2o));
+  input(cg, {1,4}, p.w1) * y;
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// Expression lstm_cell(const Expression& a, const Expression& C2O);
+BOOST_AUTO_TEST_CASE( lstm_cell_initial_gradient ) {
+  LSTMCellParams p(mod);
+  cnn::ComputationGraph cg;
+  Expression y = lstm_cell(parameter(cg, p.a), parameter(cg, p.c2o));
+  input(cg, {1,4}, p.w1) * y;
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+BOOST_AUTO_TEST_CASE( lstm_cell_batch_gradient ) {
+  LSTMCellParams p(mod);
+  cnn::ComputationGraph cg;
+  Expression a = parameter(cg, p.a) + input(cg, Dim({6},2), {0.1f, 0.2f, -0.3f, 0.4f, 0.5f, -0.6f,
+                                                             -0.2f, 0.3f, 0.1f, -0.5f, 0.2f, 0.4f});
+  Expression c = parameter(cg, p.c) + input(cg, Dim({2},2), {0.3f, -0.1f, -0.4f, 0.2f});
+  Expression y = lstm_cell(a, c, parameter(cg, p.c2i), parameter(cg, p.c2o));
+  sum_batches(input(cg, {1,4}, p.w1) * y);
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
+// a or c_{t-1} may be shared by all the batch elements
+BOOST_AUTO_TEST_CASE( lstm_cell_broadcast_gradient ) {
+  LSTMCellParams p(mod);
+  cnn::ComputationGraph cg;
+  Expression a = parameter(cg, p.a), c = parameter(cg, p.c);
+  Expression C2I = parameter(cg, p.c2i), C2O = parameter(cg, p.c2o);
+  Expression ab = a + input(cg, Dim({6},2), {0.1f, 0.2f, -0.3f, 0.4f, 0.5f, -0.6f,
+                                              -0.2f, 0.3f, 0.1f, -0.5f, 0.2f, 0.4f});
+  Expression cb = c + input(cg, Dim({2},2), {0.3f, -0.1f, -0.4f, 0.2f});
+  Expression y1 = lstm_cell(ab, c, C2I, C2O);
+  Expression y2 = lstm_cell(a, cb, C2I, C2O);
+  sum_batches(input(cg, {1,4}, p.w1) * y1 + input(cg, {1,4}, p.w2) * y2);
+  BOOST_CHECK(CheckGrad(mod, cg, 0));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
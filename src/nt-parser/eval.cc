@@ -0,0 +1,189 @@
+#include "nt-parser/eval.h"
+
+#include <cassert>
+#include <iostream>
+#include <cstdlib>
+
+#include "cnn/dict.h"
+#include "nt-parser/compressed-fstream.h"
+
+using namespace std;
+
+namespace parser {
+
+  namespace {
+
+    // splits a bracketed tree into "(", ")" and symbols
+    void Tokenize(const string& line, vector<string>* tokens) {
+      tokens->clear();
+      unsigned cur = 0;
+      while (cur < line.size()) {
+        const char c = line[cur];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+          ++cur;
+        } else if (c == '(' || c == ')') {
+          tokens->push_back(string(1, c));
+          ++cur;
+        } else {
+          unsigned start = cur;
+          while (cur < line.size() && line[cur] != ' ' && line[cur] != '\t' &&
+                 line[cur] != '\r' && line[cur] != '\n' && line[cur] != '(' && line[cur] != ')')
+            ++cur;
+          tokens->push_back(line.substr(start, cur - start));
+        }
+      }
+    }
+
+    inline bool IsBracket(const string& token) { return token == "(" || token == ")"; }
+
+    // parses the constituent starting at tokens[*pos], which must be "("
+    bool ParseNode(const vector<string>& tokens, unsigned* pos, EvalTree* tree) {
+      if (*pos >= tokens.size() || tokens[*pos] != "(") return false;
+      ++*pos;
+      string label;
+      if (*pos < tokens.size() && !IsBracket(tokens[*pos])) label = tokens[(*pos)++];
+      if (*pos < tokens.size() && !IsBracket(tokens[*pos])) { // preterminal
+        tree->tags.push_back(label);
+        tree->words.push_back(tokens[(*pos)++]);
+      } else {
+        const unsigned start = tree->words.size();
+        unsigned nchildren = 0;
+        while (*pos < tokens.size() && tokens[*pos] == "(") {
+          if (!ParseNode(tokens, pos, tree)) return false;
+          ++nchildren;
+        }
+        if (nchildren == 0) return false;
+        tree->brackets.push_back(Bracket{label, start, (unsigned) tree->words.size()});
+      }
+      if (*pos >= tokens.size() || tokens[*pos] != ")") return false;
+      ++*pos;
+      return true;
+    }
+
+    // COLLINS.prm: DELETE_LABEL
+    bool IsDeletedLabel(const string& label) {
+      return label.empty() || label == "TOP" || label == "-NONE-" ||
+          label == "," || label == ":" || label == "``" || label == "''" || label == ".";
+    }
+
+    // strips function tags and applies COLLINS.prm's EQ_LABEL
+    string NormalizeLabel(const string& label) {
+      string l = label;
+      if (l.size() > 0 && l[0] != '-') {
+        size_t p = l.find_first_of("-=");
+        if (p != string::npos) l = l.substr(0, p);
+      }
+      if (l == "PRT") l = "ADVP";
+      return l;
+    }
+
+    // the brackets that are scored, with spans over the words that are kept
+    void ScoredBrackets(const vector<Bracket>& brackets, const vector<unsigned>& pos, vector<Bracket>* out) {
+      out->clear();
+      for (auto& b : brackets) {
+        if (IsDeletedLabel(b.label)) continue;
+        assert(b.start <= b.end && b.end < pos.size());
+        const unsigned start = pos[b.start], end = pos[b.end];
+        if (start == end) continue; // only deleted words
+        out->push_back(Bracket{NormalizeLabel(b.label), start, end});
+      }
+    }
+
+  } // namespace
+
+  bool ParseEvalTree(const string& line, EvalTree* tree) {
+    tree->words.clear();
+    tree->tags.clear();
+    tree->brackets.clear();
+    vector<string> tokens;
+    Tokenize(line, &tokens);
+    unsigned pos = 0;
+    if (!ParseNode(tokens, &pos, tree)) return false;
+    return pos == tokens.size();
+  }
+
+  void ReadEvalTrees(const string& file, unsigned nsents, vector<EvalTree>* trees) {
+    cerr << "Loading trees for evaluation from " << file << " ...\n";
+    cnn::compressed_ifstream in(file.c_str());
+    trees->clear();
+    string line;
+    unsigned lc = 0;
+    while (getline(in, line)) {
+      ++lc;
+      if (line.find_first_not_of(" \t\r") == string::npos) continue;
+      trees->push_back(EvalTree());
+      if (!ParseEvalTree(line, &trees->back())) {
+        cerr << "Malformed tree in line " << lc << " of " << file << endl;
+        abort();
+      }
+    }
+    cerr << "Loaded " << trees->size() << " trees\n";
+    if (trees->size() != nsents)
+      cerr << "Warning: number of trees in " << file << " (" << trees->size()
+           << ") does not match the number of sentences (" << nsents
+           << "), sentences without a tree are not evaluated\n";
+  }
+
+  void EvalbScorer::add(const EvalTree& gold_tree, const vector<Bracket>& test_brackets, unsigned test_length) {
+    const unsigned n = gold_tree.words.size();
+    if (test_length != n) {
+      ++errors;
+      return;
+    }
+    // pos[i] is the position of word i once the deleted words are removed
+    vector<unsigned> pos(n + 1, 0);
+    for (unsigned i = 0; i < n; ++i)
+      pos[i + 1] = pos[i] + (IsDeletedLabel(gold_tree.tags[i]) ? 0 : 1);
+    vector<Bracket> g, t;
+    ScoredBrackets(gold_tree.brackets, pos, &g);
+    ScoredBrackets(test_brackets, pos, &t);
+    vector<bool> used(t.size(), false);
+    for (auto& gb : g) {
+      for (unsigned j = 0; j < t.size(); ++j) {
+        if (!used[j] && t[j].start == gb.start && t[j].end == gb.end && t[j].label == gb.label) {
+          used[j] = true;
+          ++matched;
+          break;
+        }
+      }
+    }
+    gold += g.size();
+    test += t.size();
+    ++sentences;
+  }
+
+  double EvalbScorer::recall() const {
+    return gold > 0 ? 100.0 * matched / gold : 0.0;
+  }
+
+  double EvalbScorer::precision() const {
+    return test > 0 ? 100.0 * matched / test : 0.0;
+  }
+
+  double EvalbScorer::fmeasure() const {
+    const double r = recall(), p = precision();
+    return (r + p) > 0 ? 2 * p * r / (p + r) : 0.0;
+  }
+
+  void ActionsToBrackets(const vector<unsigned>& actions, const cnn::Dict& adict,
+                         bool implicit_reduce_after_shift, vector<Bracket>* brackets) {
+    brackets->clear();
+    vector<pair<string, unsigned>> open; // label, first word
+    unsigned ti = 0;
+    for (auto a : actions) {
+      const string& as = adict.Convert(a);
+      if (as[0] == 'N') {
+        const size_t start = as.find('(') + 1;
+        open.push_back(make_pair(as.substr(start, as.rfind(')') - start), ti));
+      } else if (as[0] == 'S') {
+        if (implicit_reduce_after_shift) open.pop_back(); // preterminal
+        ++ti;
+      } else {
+        assert(open.size() > 0);
+        brackets->push_back(Bracket{open.back().first, open.back().second, ti});
+        open.pop_back();
+      }
+    }
+  }
+
+} // namespace parser
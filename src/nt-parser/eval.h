@@ -0,0 +1,77 @@
+#ifndef PARSER_EVAL_H_
+#define PARSER_EVAL_H_
+
+#include <string>
+#include <vector>
+
+namespace cnn { class Dict; }
+
+namespace parser {
+
+  // a labeled constituent spanning the words [start, end)
+  struct Bracket {
+    std::string label;
+    unsigned start, end;
+  };
+
+  // a tree in bracketed (PTB) format, e.g. (S (NP (DT the) (NN cat)) (VP (VBD sat)))
+  // as its words, their preterminal tags and its other constituents
+  struct EvalTree {
+    std::vector<std::string> words;
+    std::vector<std::string> tags;
+    std::vector<Bracket> brackets;
+  };
+
+  // returns false if line is not a well-formed tree
+  bool ParseEvalTree(const std::string& line, EvalTree* tree);
+
+  // reads one tree per line, the gold trees of a corpus of nsents sentences
+  // (warns if their numbers differ)
+  void ReadEvalTrees(const std::string& file, unsigned nsents, std::vector<EvalTree>* trees);
+
+  // labeled bracket scorer equivalent to EVALB with the settings of COLLINS.prm:
+  //   - constituents labeled TOP or -NONE- are ignored, as are words tagged
+  //     with , : `` '' or . (spans are measured without these words)
+  //   - function tags are stripped from labels (NP-SBJ=2 becomes NP)
+  //   - ADVP and PRT are the same label
+  // the predicted words and preterminal tags are not compared: like
+  // remove_dev_unk.py, which puts the gold words and tags back into the
+  // output of the parser before running EVALB, the words (and hence the
+  // punctuation to delete) of the gold tree are used
+  class EvalbScorer {
+   public:
+    EvalbScorer() : matched(), gold(), test(), sentences(), errors() {}
+    // scores the constituents predicted for a sentence of test_length words;
+    // sentences whose length differs from that of gold are counted as errors
+    // and otherwise ignored, as in EVALB
+    void add(const EvalTree& gold_tree, const std::vector<Bracket>& test_brackets, unsigned test_length);
+    // percentages, as reported by EVALB for all sentences
+    double recall() const;
+    double precision() const;
+    double fmeasure() const;
+
+    unsigned matched, gold, test; // numbers of brackets
+    unsigned sentences, errors;
+  };
+
+  // the constituents built by a sequence of parser actions (ids in adict of
+  // NT(X), SHIFT and REDUCE), for EvalbScorer; if implicit_reduce_after_shift
+  // is true, the preterminals are nonterminals closed by SHIFT and are left out
+  void ActionsToBrackets(const std::vector<unsigned>& actions, const cnn::Dict& adict,
+                         bool implicit_reduce_after_shift, std::vector<Bracket>* brackets);
+
+  // what decoding a dev or test sentence in a worker process sends back
+  struct EvalResult {
+    EvalResult() : right(), nlp(), pred_nlp() {}
+    std::vector<unsigned> actions;
+    double right; // correctly predicted gold actions
+    double nlp;   // negative log probability of the gold parse
+    double pred_nlp; // negative log probability of actions
+    template<class Archive> void serialize(Archive& ar, const unsigned int) {
+      ar & actions & right & nlp & pred_nlp;
+    }
+  };
+
+} // namespace parser
+
+#endif
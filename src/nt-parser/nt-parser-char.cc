@@ -15,6 +15,7 @@
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/program_options.hpp>
+#include <boost/serialization/vector.hpp>
 
 #include "cnn/training.h"
 #include "cnn/cnn.h"
@@ -25,8 +26,10 @@
 #include "cnn/dict.h"
 #include "cnn/cfsm-builder.h"
 #include "cnn/model.h"
+#include "cnn/mp.h"
 
 #include "nt-parser/oracle.h"
+#include "nt-parser/eval.h"
 #include "nt-parser/compressed-fstream.h"
 #include "nt-parser/embeddings.h"
 
@@ -71,9 +74,11 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     ("explicit_terminal_reduce,x", "[recommended] If set, the parser must explicitly process a REDUCE operation to complete a preterminal constituent")
     ("dev_data,d", po::value<string>(), "Development corpus")
     ("bracketing_dev_data,C", po::value<string>(), "Development bracketed corpus")
+    ("bracketing_test_data", po::value<string>(), "Test bracketed corpus (by default the one given with -C)")
     ("test_data,p", po::value<string>(), "Test corpus")
     ("dropout,D", po::value<float>(), "Dropout rate")
     ("samples,s", po::value<unsigned>(), "Sample N trees for each test sentence instead of greedy max decoding")
+    ("eval_workers", po::value<unsigned>()->default_value(1), "Decode dev and test sentences in this many parallel processes")
     ("alpha,a", po::value<float>(), "Flatten (0 < alpha < 1) or sharpen (1 < alpha) sampling distribution")
     ("model,m", po::value<string>(), "Load saved model from this file")
     ("use_pos_tags,P", "make POS tags visible to parser")
@@ -84,8 +89,9 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     ("hidden_dim", po::value<unsigned>()->default_value(64), "hidden dimension")
     ("lstm_input_dim", po::value<unsigned>()->default_value(60), "LSTM input dimension")
     ("train,t", "Should training be run?")
-    ("python", po::value<string>()->default_value("python"), "path to python binary")
     ("model_dir", po::value<string>()->default_value("."), "Directory to save the model in")
+    ("binary_model", "Save the model in the binary format, which is smaller and loads much faster, instead of as a text archive")
+    ("write_binary_model", po::value<string>(), "Write the model loaded with -m to this file in the binary format and exit")
     ("start_epoch", po::value<float>(), "Starting epoch")
     ("report_every", po::value<unsigned>()->default_value(25), "Report on devset every X updates")
     ("patience", po::value<unsigned>()->default_value(10), "How many times to wait before training is stopped early")
@@ -273,7 +279,7 @@ struct ParserBuilder {
     // in the discriminative model, here we set up the buffer contents
     for (unsigned i = 0; i < sent.size(); ++i) {
       int wordid = sent.raw[i]; // this will be equal to unk at dev/test
-      if (build_training_graph && singletons.size() > (size_t) wordid && singletons[wordid] && rand01() > 0.5)
+      if (build_training_graph && !is_evaluation && singletons.size() > (size_t) wordid && singletons[wordid] && rand01() > 0.5)
         wordid = sent.unk[i];
       string word = termdict.Convert(wordid);
       Expression w;
@@ -520,6 +526,10 @@ int main(int argc, char** argv) {
     cerr << "You specified --train but did not specify --dev_data FILE\n";
     return 1;
   }
+  if (conf.count("train") && conf.count("bracketing_dev_data") == 0) {
+    cerr << "You specified --train but did not specify --bracketing_dev_data FILE\n";
+    return 1;
+  }
   if (conf.count("alpha")) {
     ALPHA = conf["alpha"].as<float>();
     if (ALPHA <= 0.f) { cerr << "--alpha must be between 0 and +infty\n"; abort(); }
@@ -528,6 +538,7 @@ int main(int argc, char** argv) {
     N_SAMPLES = conf["samples"].as<unsigned>();
     if (N_SAMPLES == 0) { cerr << "Please specify N>0 samples\n"; abort(); }
   }
+  const unsigned eval_workers = conf["eval_workers"].as<unsigned>();
 
   ostringstream os;
   os << conf["model_dir"].as<string>() << "/"
@@ -551,7 +562,8 @@ int main(int argc, char** argv) {
   parser::TopDownOracle dev_corpus(&termdict, &adict, &posdict, &ntermdict);
   parser::TopDownOracle test_corpus(&termdict, &adict, &posdict, &ntermdict);
   corpus.load_oracle(conf["training_data"].as<string>(), true);
-  corpus.load_bdata(conf["bracketing_dev_data"].as<string>());
+  if (conf.count("bracketing_dev_data"))
+    corpus.load_bdata(conf["bracketing_dev_data"].as<string>());
 
   // freeze dictionaries so we don't accidentaly load OOVs
   termdict.Freeze();
@@ -597,6 +609,21 @@ int main(int argc, char** argv) {
     cerr << "Loading test set\n";
     test_corpus.load_oracle(conf["test_data"].as<string>(), false);
   }
+  // gold trees of the dev and test sets, for computing F1 (which is skipped
+  // for a set without them): -C holds those of the dev set, and unless they
+  // are given with --bracketing_test_data, also those of the test set
+  vector<parser::EvalTree> dev_trees, test_trees;
+  if (dev_corpus.size() > 0 && conf.count("bracketing_dev_data"))
+    parser::ReadEvalTrees(conf["bracketing_dev_data"].as<string>(), dev_corpus.size(), &dev_trees);
+  if (test_corpus.size() > 0) {
+    if (conf.count("bracketing_test_data"))
+      parser::ReadEvalTrees(conf["bracketing_test_data"].as<string>(), test_corpus.size(), &test_trees);
+    else if (conf.count("bracketing_dev_data")) {
+      if (dev_corpus.size() > 0)
+        cerr << "Warning: no --bracketing_test_data given, scoring the test set against -C\n";
+      parser::ReadEvalTrees(conf["bracketing_dev_data"].as<string>(), test_corpus.size(), &test_trees);
+    }
+  }
 
   for (unsigned i = 0; i < adict.size(); ++i) {
     const string& a = adict.Convert(i);
@@ -631,10 +658,26 @@ int main(int argc, char** argv) {
     parser.unk_embs_model = new wrd::SimpleLookupModel(model, unkdict, INPUT_DIM);
   }
   if (conf.count("model")) {
-    ifstream in(conf["model"].as<string>().c_str());
-    boost::archive::text_iarchive ia(in);
-    ia >> model;
+    // when only decoding, the values of a binary model are read from the
+    // mapped file as needed
+    cnn::load_cnn_model(conf["model"].as<string>(), &model, conf.count("train") == 0);
   }
+  if (conf.count("write_binary_model")) {
+    cnn::save_cnn_model(conf["write_binary_model"].as<string>(), &model, true);
+    cerr << "Wrote " << conf["write_binary_model"].as<string>() << endl;
+    return 0;
+  }
+  // scores the gold actions of a dev or test sentence and decodes it
+  auto evaluate = [&](const parser::Sentence& sentence, const vector<int>& actions) {
+    parser::EvalResult r;
+    {  ComputationGraph hg;
+      parser.log_prob_parser(&hg,sentence,actions,&r.right,true);
+      r.nlp = as_scalar(hg.incremental_forward());
+    }
+    ComputationGraph hg;
+    r.actions = parser.log_prob_parser(&hg,sentence,vector<int>(),&r.right,true);
+    return r;
+  };
 
   //TRAINING
   if (conf.count("train")) {
@@ -711,18 +754,21 @@ int main(int argc, char** argv) {
         os << "/tmp/parser_dev_eval." << getpid() << ".txt";
         const string pfx = os.str();
         ofstream out(pfx.c_str());
+        parser::EvalbScorer evalb;
+        vector<parser::Bracket> brackets;
         auto t_start = chrono::high_resolution_clock::now();
+        vector<parser::EvalResult> results = cnn::mp::ParallelMap<parser::EvalResult>(dev_size, eval_workers, [&](unsigned sii) {
+          return evaluate(dev_corpus.sents[sii], dev_corpus.actions[sii]);
+        });
         for (unsigned sii = 0; sii < dev_size; ++sii) {
           const auto& sentence=dev_corpus.sents[sii];
           const vector<int>& actions=dev_corpus.actions[sii];
           dwords += sentence.size();
-          {  ComputationGraph hg;
-            parser.log_prob_parser(&hg,sentence,actions,&right,true);
-            double lp = as_scalar(hg.incremental_forward());
-            llh += lp;
-          }
-          ComputationGraph hg;
-          vector<unsigned> pred = parser.log_prob_parser(&hg,sentence,vector<int>(),&right,true);
+          right += results[sii].right;
+          llh += results[sii].nlp;
+          const vector<unsigned>& pred = results[sii].actions;
+          parser::ActionsToBrackets(pred, adict, IMPLICIT_REDUCE_AFTER_SHIFT, &brackets);
+          if (sii < dev_trees.size()) evalb.add(dev_trees[sii], brackets, sentence.size());
           int ti = 0;
           for (auto a : pred) {
             if (adict.Convert(a)[0] == 'N') {
@@ -747,32 +793,7 @@ int main(int argc, char** argv) {
         out.close();
         double err = (trs - right) / trs;
         cerr << "Dev output in " << pfx << endl;
-        std::string pid = std::to_string(getpid());
-        std::string evaluable_fname = "evaluable-" + pid + ".txt";
-        std::string evalbout_fname = "evalbout-" + pid + ".txt";
-        std::string python = conf["python"].as<string>();
-        std::string command=python + " remove_dev_unk.py " +  corpus.devdata  + " " + pfx + " > " + evaluable_fname;
-        const char* cmd=command.c_str();
-        system(cmd);
-
-        std::string command2="EVALB/evalb -p EVALB/COLLINS.prm " + corpus.devdata + " " + evaluable_fname + ">" + evalbout_fname;
-        const char* cmd2=command2.c_str();
-
-        system(cmd2);
-
-        std::ifstream evalfile(evalbout_fname);
-        std::string lineS;
-        std::string brackstr="Bracketing FMeasure";
-        double newfmeasure=0.0;
-        std::string strfmeasure="";
-        while (getline(evalfile, lineS) && !newfmeasure){
-          if (lineS.compare(0, brackstr.length(), brackstr) == 0) {
-            strfmeasure=lineS.substr(lineS.size()-5, lineS.size());
-            std::string::size_type sz;     // alias of size_t
-
-            newfmeasure = std::stod (strfmeasure,&sz);
-          }
-        }
+        double newfmeasure = evalb.fmeasure();
 
         cerr << "  **dev (iter=" << iter << " epoch=" << (tot_seen / corpus.size()) << ")\tllh=" << llh << " ppl: " << exp(llh / dwords) << " f1: " << newfmeasure << " err: " << err << "\t[" << dev_size << " sents in " << chrono::duration<double, milli>(t_end-t_start).count() << " ms]" << endl;
         if (newfmeasure > bestf1) {
@@ -780,9 +801,7 @@ int main(int argc, char** argv) {
           cerr << "  new best...writing model to " << fname << " ...\n";
           best_dev_err = err;
           bestf1=newfmeasure;
-          ofstream out(fname);
-          boost::archive::text_oarchive oa(out);
-          oa << model;
+          cnn::save_cnn_model(fname, &model, conf.count("binary_model"));
           system((string("cp ") + pfx + string(" ") + pfx + string(".best")).c_str());
           // Create a soft link to the most recent model in order to make it
           // easier to refer to it in a shell script.
@@ -842,18 +861,21 @@ int main(int argc, char** argv) {
     os << "/tmp/parser_test_eval." << getpid() << ".txt";
     const string pfx = os.str();
     ofstream out(pfx.c_str());
+    parser::EvalbScorer evalb;
+    vector<parser::Bracket> brackets;
     t_start = chrono::high_resolution_clock::now();
+    vector<parser::EvalResult> results = cnn::mp::ParallelMap<parser::EvalResult>(test_size, eval_workers, [&](unsigned sii) {
+      return evaluate(test_corpus.sents[sii], test_corpus.actions[sii]);
+    });
     for (unsigned sii = 0; sii < test_size; ++sii) {
       const auto& sentence=test_corpus.sents[sii];
       const vector<int>& actions=test_corpus.actions[sii];
       dwords += sentence.size();
-      {  ComputationGraph hg;
-        parser.log_prob_parser(&hg,sentence,actions,&right,true);
-        double lp = as_scalar(hg.incremental_forward());
-        llh += lp;
-      }
-      ComputationGraph hg;
-      vector<unsigned> pred = parser.log_prob_parser(&hg,sentence,vector<int>(),&right,true);
+      right += results[sii].right;
+      llh += results[sii].nlp;
+      const vector<unsigned>& pred = results[sii].actions;
+      parser::ActionsToBrackets(pred, adict, IMPLICIT_REDUCE_AFTER_SHIFT, &brackets);
+      if (sii < test_trees.size()) evalb.add(test_trees[sii], brackets, sentence.size());
       int ti = 0;
       for (auto a : pred) {
         if (adict.Convert(a)[0] == 'N') {
@@ -876,33 +898,12 @@ int main(int argc, char** argv) {
     }
     out.close();
     cerr << "Test output in " << pfx << endl;
-    std::string pid = std::to_string(getpid());
-    std::string evaluable_fname = "evaluable-" + pid + ".txt";
-    std::string evalbout_fname = "evalbout-" + pid + ".txt";
-    std::string python = conf["python"].as<string>();
-    std::string command=python + " remove_dev_unk.py " +  corpus.devdata  + " " + pfx + " > " + evaluable_fname;
-    const char* cmd=command.c_str();
-    system(cmd);
-
-    std::string command2="EVALB/evalb -p EVALB/COLLINS.prm " + corpus.devdata + " " + evaluable_fname + ">" + evalbout_fname;
-    const char* cmd2=command2.c_str();
-
-    system(cmd2);
-
-    std::ifstream evalfile(evalbout_fname);
-    std::string lineS;
-    std::string brackstr="Bracketing FMeasure";
-    double newfmeasure=0.0;
-    std::string strfmeasure="";
-    while (getline(evalfile, lineS) && !newfmeasure){
-      if (lineS.compare(0, brackstr.length(), brackstr) == 0) {
-        strfmeasure=lineS.substr(lineS.size()-5, lineS.size());
-        std::string::size_type sz;
-        newfmeasure = std::stod (strfmeasure,&sz);
-      }
+    if (test_trees.size() > 0) {
+      if (evalb.errors > 0)
+        cerr << "  " << evalb.errors << " sentences could not be evaluated (length mismatch)\n";
+      cerr << "Bracketing recall: " << evalb.recall() << " precision: " << evalb.precision() << endl;
+      cerr<<"F1score: "<<evalb.fmeasure()<<"\n";
     }
 
-    cerr<<"F1score: "<<newfmeasure<<"\n";
-
   }
 }
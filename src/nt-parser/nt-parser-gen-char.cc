@@ -79,6 +79,8 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     ("lstm_input_dim", po::value<unsigned>()->default_value(60), "LSTM input dimension")
     ("train,t", "Should training be run?")
     ("model_dir", po::value<string>()->default_value("."), "Directory to save the model in")
+    ("binary_model", "Save the model in the binary format, which is smaller and loads much faster, instead of as a text archive")
+    ("write_binary_model", po::value<string>(), "Write the model loaded with -m to this file in the binary format and exit")
     ("start_epoch", po::value<float>(), "Starting epoch")
     ("report_every", po::value<unsigned>()->default_value(25), "Report on devset every X updates")
     ("generate_every", po::value<unsigned>()->default_value(100), "Generate a sample every X updates")
@@ -562,9 +564,14 @@ int main(int argc, char** argv) {
     parser.unk_embs_model = new wrd::SimpleLookupModel(model, unkdict, INPUT_DIM);
   }
   if (conf.count("model")) {
-    ifstream in(conf["model"].as<string>().c_str());
-    boost::archive::text_iarchive ia(in);
-    ia >> model;
+    // when only decoding, the values of a binary model are read from the
+    // mapped file as needed
+    cnn::load_cnn_model(conf["model"].as<string>(), &model, conf.count("train") == 0);
+  }
+  if (conf.count("write_binary_model")) {
+    cnn::save_cnn_model(conf["write_binary_model"].as<string>(), &model, true);
+    cerr << "Wrote " << conf["write_binary_model"].as<string>() << endl;
+    return 0;
   }
 
   //TRAINING
@@ -673,9 +680,7 @@ int main(int argc, char** argv) {
           counter = 0;
           cerr << "  new best...writing model to " << fname << " ...\n";
           best_dev_llh = llh;
-          ofstream out(fname);
-          boost::archive::text_oarchive oa(out);
-          oa << model;
+          cnn::save_cnn_model(fname, &model, conf.count("binary_model"));
           // Create a soft link to the most recent model in order to make it
           // easier to refer to it in a shell script.
           if (!softlinkCreated) {
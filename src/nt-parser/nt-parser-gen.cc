@@ -1,6 +1,7 @@
 #include <cstdlib>
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include <fstream>
 #include <cmath>
 #include <chrono>
@@ -16,6 +17,7 @@
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/program_options.hpp>
+#include <boost/serialization/vector.hpp>
 
 #include "cnn/training.h"
 #include "cnn/cnn.h"
@@ -25,6 +27,7 @@
 #include "cnn/rnn.h"
 #include "cnn/dict.h"
 #include "cnn/cfsm-builder.h"
+#include "cnn/mp.h"
 
 #include "nt-parser/oracle.h"
 #include "nt-parser/pretrained.h"
@@ -79,6 +82,8 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     ("train,t", "Should training be run?")
     ("words,w", po::value<string>(), "Pretrained word embeddings")
     ("model_dir", po::value<string>()->default_value("."), "Directory to save the model in")
+    ("binary_model", "Save the model in the binary format, which is smaller and loads much faster, instead of as a text archive")
+    ("write_binary_model", po::value<string>(), "Write the model loaded with -m to this file in the binary format and exit")
     ("start_epoch", po::value<float>(), "Starting epoch")
     #ifdef ENABLE_PRETRAINED
     ("tr2l_norm", "Compute pretrained to LSTM input weight matrix norm?")
@@ -87,6 +92,11 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     ("report_every", po::value<unsigned>()->default_value(25), "Report on devset every X updates")
     ("generate_every", po::value<unsigned>()->default_value(100), "Generate a sample every X updates")
     ("patience", po::value<unsigned>()->default_value(10), "How many times to wait before training is stopped early")
+    ("beam_size,b", po::value<unsigned>(), "Parse the test sentences with word-synchronous beam search, keeping this many hypotheses per action step")
+    ("word_beam_size", po::value<unsigned>(), "Number of hypotheses kept after each word in beam search (default: beam_size / 10)")
+    ("eval_workers", po::value<unsigned>()->default_value(1), "Score and parse dev and test sentences in this many parallel processes")
+    ("trie_actions", po::value<unsigned>()->default_value(2000), "When scoring test trees, score the trees of a sentence together in groups with at most this many distinct action prefixes (larger groups share more computation but need more memory)")
+    ("proposals", po::value<string>(), "Samples of the test trees drawn from the discriminative model (lines [sentence id] ||| [log q(y | x)] ||| [tree], as written by nt-parser -s): estimate the marginal likelihood of each sentence by importance sampling")
     ("help,h", "Help");
   po::options_description dcmdline_options;
   dcmdline_options.add(opts);
@@ -236,10 +246,8 @@ struct ParserBuilder {
     stack_lstm.start_new_sequence();
     action_lstm.start_new_sequence();
     // variables in the computation graph representing the parameters
-    Expression pbias = parameter(*hg, p_pbias);
-    Expression S = parameter(*hg, p_S);
-    Expression A = parameter(*hg, p_A);
-    Expression T = parameter(*hg, p_T);
+    SentenceGraph g; // only its parameters are used
+    add_parameters(hg, &g);
     //Expression pbias2 = parameter(*hg, p_pbias2);
     //Expression S2 = parameter(*hg, p_S2);
     //Expression A2 = parameter(*hg, p_A2);
@@ -251,13 +259,8 @@ struct ParserBuilder {
     if (p_tr2l)
       tr2l = parameter(*hg, p_tr2l);
     #endif
-    Expression cbias = parameter(*hg, p_cbias);
-    Expression p2a = parameter(*hg, p_p2a);
-    Expression abias = parameter(*hg, p_abias);
-    Expression action_start = parameter(*hg, p_action_start);
-    Expression cW = parameter(*hg, p_cW);
 
-    action_lstm.add_input(action_start);
+    action_lstm.add_input(g.action_start);
 
     vector<Expression> terms(1, lookup(*hg, p_w, kSOS));
     term_lstm.add_input(terms.back());
@@ -296,14 +299,12 @@ struct ParserBuilder {
         action_summary = dropout(action_summary, DROPOUT);
         term_summary = dropout(term_summary, DROPOUT);
       }
-      Expression p_t = affine_transform({pbias, S, stack_summary, A, action_summary, T, term_summary});
-      Expression nlp_t = rectify(p_t);
+      Expression nlp_t;
       //tworep*
       //Expression p_t = affine_transform({pbias, S, stack_lstm.back(), A, action_lstm.back()});
       //Expression nlp_t = rectify(p_t);
       //if (build_training_graph) nlp_t = dropout(nlp_t, 0.4);
-      // r_t = abias + p2a * nlp
-      Expression r_t = affine_transform({abias, p2a, nlp_t});
+      Expression r_t = action_scores(g, stack_summary, action_summary, term_summary, &nlp_t);
 
       // adist = log_softmax(r_t, current_valid_actions)
       Expression adiste = log_softmax(r_t, current_valid_actions);
@@ -459,7 +460,7 @@ struct ParserBuilder {
           crev = dropout(crev, DROPOUT);
         }
         Expression c = concatenate({cfwd, crev});
-        Expression composed = rectify(affine_transform({cbias, cW, c}));
+        Expression composed = rectify(affine_transform({g.cbias, g.cW, c}));
         stack_lstm.add_input(composed);
         stack.push_back(composed);
         stack_content.push_back(curr_word);
@@ -479,6 +480,412 @@ struct ParserBuilder {
     if (sample) cerr << "\n";
     return results;
   }
+
+  // expressions that are shared by every parser state built for one
+  // (known) sentence: the parameters, the word embeddings and the term LSTM
+  struct SentenceGraph {
+    Expression pbias, S, A, T;
+    Expression cbias, p2a, abias, action_start, cW;
+    vector<Expression> words;  // embedding of each word of the sentence
+    vector<unsigned> wordids;
+  };
+
+  // a (partial) parse; the LSTM states are held as RNNPointers so that
+  // states can be branched, e.g. during beam search
+  struct ParserState {
+    vector<Expression> stack;  // variables representing subtree embeddings
+    vector<RNNPointer> stack_ptr; // stack_lstm state after pushing stack[i]
+    vector<int> is_open_paren; // -1 if no nonterminal has a parenthesis open, otherwise index of NT
+    RNNPointer action_ptr;
+    unsigned termc; // number of words generated so far (term_lstm state RNNPointer(termc))
+    int nopen_parens;
+    char prev_a;
+    double score; // log p(results, words[0..termc))
+    vector<unsigned> results;
+    bool is_final() const { return stack.size() <= 2 && termc > 0; }
+  };
+
+  // adds the parameters that score actions and compose subtrees to hg
+  void add_parameters(ComputationGraph* hg, SentenceGraph* g) {
+    g->pbias = parameter(*hg, p_pbias);
+    g->S = parameter(*hg, p_S);
+    g->A = parameter(*hg, p_A);
+    g->T = parameter(*hg, p_T);
+    g->cbias = parameter(*hg, p_cbias);
+    g->p2a = parameter(*hg, p_p2a);
+    g->abias = parameter(*hg, p_abias);
+    g->action_start = parameter(*hg, p_action_start);
+    g->cW = parameter(*hg, p_cW);
+  }
+
+  // the unnormalized scores of the next action of a state (or of a batch of
+  // states) with the given summaries; *nlp_t is set to the hidden layer, from
+  // which the next word is predicted as well
+  Expression action_scores(const SentenceGraph& g, const Expression& stack_summary,
+                           const Expression& action_summary, const Expression& term_summary,
+                           Expression* nlp_t) {
+    Expression p_t = affine_transform({g.pbias, g.S, stack_summary, g.A, action_summary, g.T, term_summary});
+    *nlp_t = rectify(p_t);
+    // r_t = abias + p2a * nlp
+    return affine_transform({g.abias, g.p2a, *nlp_t});
+  }
+
+  // resets the builders, adds the parameters and runs the term LSTM over sent
+  void new_sentence_graph(ComputationGraph* hg, const parser::Sentence& sent, SentenceGraph* g) {
+    stack_lstm.disable_dropout();
+    term_lstm.disable_dropout();
+    action_lstm.disable_dropout();
+    const_lstm_fwd.disable_dropout();
+    const_lstm_rev.disable_dropout();
+    term_lstm.new_graph(*hg);
+    stack_lstm.new_graph(*hg);
+    action_lstm.new_graph(*hg);
+    const_lstm_fwd.new_graph(*hg);
+    const_lstm_rev.new_graph(*hg);
+    cfsm->new_graph(*hg);
+    term_lstm.start_new_sequence();
+    stack_lstm.start_new_sequence();
+    action_lstm.start_new_sequence();
+    add_parameters(hg, g);
+    #ifdef ENABLE_PRETRAINED
+    Expression ib = parameter(*hg, p_ib);
+    Expression w2l = parameter(*hg, p_w2l);
+    Expression tr2l;
+    if (p_tr2l)
+      tr2l = parameter(*hg, p_tr2l);
+    #endif
+
+    // the term LSTM only depends on the words, so all states share it:
+    // after generating i words its state is RNNPointer(i)
+    term_lstm.add_input(lookup(*hg, p_w, kSOS));
+    g->words.resize(sent.size());
+    g->wordids.resize(sent.size());
+    for (unsigned i = 0; i < sent.size(); ++i) {
+      g->wordids[i] = sent.raw[i];
+      Expression w = lookup(*hg, p_w, sent.raw[i]);
+      #ifdef ENABLE_PRETRAINED
+      if (p_tr && pretrained.count(sent.lc[i])) {
+        Expression tr = const_lookup(*hg, p_tr, sent.lc[i]);
+        w = rectify(affine_transform({ib, w2l, w, tr2l, tr}));
+      }
+      #endif
+      g->words[i] = w;
+      term_lstm.add_input(w);
+    }
+  }
+
+  // the parser state before any action has been taken
+  ParserState initial_state(ComputationGraph* hg, const SentenceGraph& g) {
+    ParserState st;
+    action_lstm.add_input(action_lstm.state(), g.action_start);
+    st.action_ptr = action_lstm.state();
+    st.stack.push_back(parameter(*hg, p_stack_guard));
+    // drive dummy symbol on stack through LSTM
+    stack_lstm.add_input(stack_lstm.state(), st.stack.back());
+    st.stack_ptr.push_back(stack_lstm.state());
+    st.is_open_paren.push_back(-1); // corresponds to dummy symbol
+    st.termc = 0;
+    st.nopen_parens = 0;
+    st.prev_a = '0';
+    st.score = 0;
+    return st;
+  }
+
+  // get list of possible actions for the current parser state
+  void valid_actions(const ParserState& st, vector<unsigned>* current_valid_actions) const {
+    current_valid_actions->clear();
+    for (auto a: possible_actions) {
+      if (IsActionForbidden_Generative(adict.Convert(a), st.prev_a, st.termc + 1, st.stack.size(), st.nopen_parens))
+        continue;
+      current_valid_actions->push_back(a);
+    }
+  }
+
+  // the log probabilities of the valid next actions of st; *nlp_t is set to
+  // the hidden layer, as by action_scores
+  Expression action_log_probs(const SentenceGraph& g, const ParserState& st,
+                              const vector<unsigned>& valid, Expression* nlp_t) {
+    Expression r_t = action_scores(g, stack_lstm.get_h(st.stack_ptr.back()).back(),
+                                   action_lstm.get_h(st.action_ptr).back(),
+                                   term_lstm.get_h(RNNPointer(st.termc)).back(), nlp_t);
+    return log_softmax(r_t, valid);
+  }
+
+  // can action still lead to a parse of a sentence with n words?
+  static bool CanGenerateLength(const ParserState& st, unsigned action, unsigned n) {
+    const char ac = adict.Convert(action)[0];
+    if (st.termc == n) return ac == 'R'; // only closing brackets are left
+    if (ac == 'R' && st.nopen_parens == 1) return false; // can't close the root yet
+    return true;
+  }
+
+  // advance st by executing action (which must be valid)
+  void apply_action(ComputationGraph* hg, const SentenceGraph& g, ParserState& st, unsigned action) {
+    st.results.push_back(action);
+
+    // add current action to action LSTM
+    Expression actione = lookup(*hg, p_a, action);
+    action_lstm.add_input(st.action_ptr, actione);
+    st.action_ptr = action_lstm.state();
+
+    const string& actionString=adict.Convert(action);
+    const char ac = actionString[0];
+    const char ac2 = actionString[1];
+    st.prev_a = ac;
+
+    if (ac =='S' && ac2=='H') {  // SHIFT
+      assert(st.termc < g.words.size());
+      const Expression& w = g.words[st.termc];
+      st.stack.push_back(w);
+      stack_lstm.add_input(st.stack_ptr.back(), w);
+      st.stack_ptr.push_back(stack_lstm.state());
+      st.is_open_paren.push_back(-1);
+      ++st.termc;
+    } else if (ac == 'N') { // NT
+      ++st.nopen_parens;
+      auto it = action2NTindex.find(action);
+      assert(it != action2NTindex.end());
+      int nt_index = it->second;
+      Expression nt_embedding = lookup(*hg, p_nt, nt_index);
+      st.stack.push_back(nt_embedding);
+      stack_lstm.add_input(st.stack_ptr.back(), nt_embedding);
+      st.stack_ptr.push_back(stack_lstm.state());
+      st.is_open_paren.push_back(nt_index);
+    } else { // REDUCE
+      --st.nopen_parens;
+      assert(st.stack.size() > 2); // dummy symbol means > 2 (not >= 2)
+      // find what paren we are closing
+      int i = st.is_open_paren.size() - 1;
+      while(st.is_open_paren[i] < 0) { --i; assert(i >= 0); }
+      Expression nonterminal = lookup(*hg, p_ntup, st.is_open_paren[i]);
+      int nchildren = st.is_open_paren.size() - i - 1;
+      assert(nchildren > 0);
+      vector<Expression> children(nchildren);
+      const_lstm_fwd.start_new_sequence();
+      const_lstm_rev.start_new_sequence();
+
+      // REMOVE EVERYTHING FROM THE STACK THAT IS GOING
+      // TO BE COMPOSED INTO A TREE EMBEDDING
+      for (i = 0; i < nchildren; ++i) {
+        children[i] = st.stack.back();
+        st.stack.pop_back();
+        st.stack_ptr.pop_back();
+        st.is_open_paren.pop_back();
+      }
+      st.is_open_paren.pop_back(); // nt symbol
+      st.stack.pop_back(); // nonterminal dummy
+      st.stack_ptr.pop_back(); // nt symbol
+
+      // BUILD TREE EMBEDDING USING BIDIR LSTM
+      const_lstm_fwd.add_input(nonterminal);
+      const_lstm_rev.add_input(nonterminal);
+      for (i = 0; i < nchildren; ++i) {
+        const_lstm_fwd.add_input(children[i]);
+        const_lstm_rev.add_input(children[nchildren - i - 1]);
+      }
+      Expression c = concatenate({const_lstm_fwd.back(), const_lstm_rev.back()});
+      Expression composed = rectify(affine_transform({g.cbias, g.cW, c}));
+      stack_lstm.add_input(st.stack_ptr.back(), composed);
+      st.stack_ptr.push_back(stack_lstm.state());
+      st.stack.push_back(composed);
+      st.is_open_paren.push_back(-1); // we just closed a paren at this position
+    }
+  }
+
+  // word-synchronous beam search (Stern et al., 2017): hypotheses are
+  // expanded action by action (keeping at most action_beam_size of them)
+  // until they SHIFT the next word; the word_beam_size best hypotheses that
+  // generated word i are then advanced together to word i+1.
+  // sets *nlp to -log p(x, y) of the returned parse y
+  vector<unsigned> beam_search_parser(ComputationGraph* hg,
+                                      const parser::Sentence& sent,
+                                      unsigned action_beam_size,
+                                      unsigned word_beam_size,
+                                      double *nlp) {
+    SentenceGraph g;
+    new_sentence_graph(hg, sent, &g);
+    const unsigned n = sent.size();
+    struct Candidate {
+      unsigned hyp;
+      unsigned action;
+      double score;
+    };
+    vector<ParserState> current(1, initial_state(hg, g));
+    vector<Candidate> candidates;
+    vector<unsigned> current_valid_actions;
+    for (unsigned i = 0; i <= n; ++i) {
+      // hypotheses that generated word i (or, once i == n, completed parses),
+      // best first
+      vector<ParserState> next;
+      vector<ParserState> open;
+      open.swap(current);
+      while (open.size() > 0) {
+        vector<Expression> stack_summaries(open.size());
+        vector<Expression> action_summaries(open.size());
+        vector<Expression> term_summaries(open.size());
+        for (unsigned k = 0; k < open.size(); ++k) {
+          stack_summaries[k] = stack_lstm.get_h(open[k].stack_ptr.back()).back();
+          action_summaries[k] = action_lstm.get_h(open[k].action_ptr).back();
+          term_summaries[k] = term_lstm.get_h(RNNPointer(open[k].termc)).back();
+        }
+        Expression nlp_t;
+        Expression r_t = action_scores(g, concatenate_to_batch(stack_summaries),
+                                       concatenate_to_batch(action_summaries),
+                                       concatenate_to_batch(term_summaries), &nlp_t);
+        Expression word_nlp;
+        if (i < n) word_nlp = cfsm->neg_log_softmax(nlp_t, g.wordids[i]);
+        hg->incremental_forward();
+        // scores of hypothesis k are in [k * ACTION_SIZE, (k + 1) * ACTION_SIZE)
+        vector<float> r = as_vector(r_t.value());
+        vector<float> wnlp;
+        if (i < n) wnlp = as_vector(word_nlp.value());
+
+        candidates.clear();
+        for (unsigned k = 0; k < open.size(); ++k) {
+          // normalize as the model does, but only follow actions that can
+          // still generate the observed sentence
+          valid_actions(open[k], &current_valid_actions);
+          const float* rk = &r[k * ACTION_SIZE];
+          float m = rk[current_valid_actions[0]];
+          for (auto a : current_valid_actions) m = max(m, rk[a]);
+          double z = 0;
+          for (auto a : current_valid_actions) z += exp(rk[a] - m);
+          const double logz = m + log(z);
+          for (auto a : current_valid_actions) {
+            if (!CanGenerateLength(open[k], a, n)) continue;
+            double score = open[k].score + rk[a] - logz;
+            if (adict.Convert(a)[0] == 'S') score -= wnlp[k];
+            candidates.push_back(Candidate{k, a, score});
+          }
+        }
+        sort(candidates.begin(), candidates.end(),
+             [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+
+        vector<ParserState> next_open;
+        for (auto& cand : candidates) {
+          // scores only decrease, so nothing worse than the word beam can recover
+          if (next.size() >= word_beam_size && cand.score <= next.back().score) break;
+          const bool is_shift = adict.Convert(cand.action)[0] == 'S';
+          const bool completes = (i == n && open[cand.hyp].nopen_parens == 1);
+          if (!is_shift && !completes && next_open.size() >= action_beam_size) continue;
+          ParserState st = open[cand.hyp];
+          apply_action(hg, g, st, cand.action);
+          st.score = cand.score;
+          if (is_shift || completes) {
+            assert(!completes || st.is_final());
+            auto it = next.begin();
+            while (it != next.end() && it->score >= st.score) ++it;
+            next.insert(it, st);
+            if (next.size() > word_beam_size) next.pop_back();
+          } else {
+            next_open.push_back(st);
+          }
+        }
+        open.swap(next_open);
+      }
+      current.swap(next);
+      assert(current.size() > 0);
+    }
+    const ParserState& best = current[0];
+    assert(best.is_final());
+    *nlp = -best.score;
+    return best.results;
+  }
+
+  // the action sequences of several trees of one sentence, merged on their
+  // common prefixes
+  struct ActionTrie {
+    struct Node {
+      vector<pair<unsigned, unsigned>> children; // (action, child node)
+      vector<unsigned> trees; // the trees whose actions end here
+    };
+    vector<Node> nodes;
+    ActionTrie() : nodes(1) {}
+    void add(const vector<int>& actions, unsigned tree) {
+      unsigned n = 0;
+      for (auto a : actions) {
+        unsigned i = 0;
+        while (i < nodes[n].children.size() && nodes[n].children[i].first != (unsigned) a) ++i;
+        if (i == nodes[n].children.size()) {
+          nodes[n].children.push_back(make_pair((unsigned) a, (unsigned) nodes.size()));
+          nodes.push_back(Node());
+        }
+        n = nodes[n].children[i].second;
+      }
+      nodes[n].trees.push_back(tree);
+    }
+  };
+
+  // returns -log p(x, y) of each of the trees (action sequences) of sentence
+  // x. the trees are scored together: every action prefix that several of
+  // them share is only computed once, and the parser state is forked where
+  // they diverge. gives the same scores as log_prob_parser
+  vector<double> log_prob_trees(ComputationGraph* hg,
+                                const parser::Sentence& sent,
+                                const vector<const vector<int>*>& trees) {
+    ActionTrie trie;
+    for (unsigned i = 0; i < trees.size(); ++i) trie.add(*trees[i], i);
+    SentenceGraph g;
+    new_sentence_graph(hg, sent, &g);
+    vector<Expression> log_probs;
+    vector<Expression> tree_nlp(trees.size());
+    score_trie(hg, g, trie, 0, initial_state(hg, g), &log_probs, &tree_nlp);
+    hg->incremental_forward();
+    vector<double> nlp(trees.size());
+    for (unsigned i = 0; i < trees.size(); ++i) nlp[i] = as_scalar(tree_nlp[i].value());
+    return nlp;
+  }
+
+  // adds the scores of the trees below trie node n, which is reached in state
+  // st with the actions (and words) scored by log_probs
+  void score_trie(ComputationGraph* hg, const SentenceGraph& g, const ActionTrie& trie,
+                  unsigned n, ParserState st, vector<Expression>* log_probs,
+                  vector<Expression>* tree_nlp) {
+    const ActionTrie::Node& node = trie.nodes[n];
+    if (node.trees.size() > 0) {
+      if (!st.is_final()) {
+        cerr << "Correct action list exhausted, but not in final parser state.\n";
+        abort();
+      }
+      for (auto t : node.trees) (*tree_nlp)[t] = -sum(*log_probs);
+    }
+    if (node.children.empty()) return;
+    if (st.is_final()) {
+      cerr << "Unexecuted actions remain but final state reached!\n";
+      abort();
+    }
+    vector<unsigned> current_valid_actions;
+    valid_actions(st, &current_valid_actions);
+    Expression nlp_t;
+    Expression adiste = action_log_probs(g, st, current_valid_actions, &nlp_t);
+    for (unsigned i = 0; i < node.children.size(); ++i) {
+      const unsigned action = node.children[i].first;
+      const unsigned size = log_probs->size();
+      log_probs->push_back(pick(adiste, action));
+      const string& actionString = adict.Convert(action);
+      if (actionString[0] == 'S' && actionString[1] == 'H') {
+        assert(st.termc < g.wordids.size());
+        log_probs->push_back(-cfsm->neg_log_softmax(nlp_t, g.wordids[st.termc]));
+      }
+      // the last child can take over the state
+      ParserState child;
+      if (i + 1 < node.children.size()) child = st; else child = std::move(st);
+      apply_action(hg, g, child, action);
+      score_trie(hg, g, trie, node.children[i].second, std::move(child), log_probs, tree_nlp);
+      log_probs->resize(size);
+    }
+  }
+};
+
+// what scoring or parsing a dev or test sentence in a worker process sends back
+struct EvalResult {
+  EvalResult() : right(), nlp() {}
+  vector<unsigned> actions;
+  double right; // correctly predicted gold actions
+  double nlp;   // negative log probability
+  template<class Archive> void serialize(Archive& ar, const unsigned int) {
+    ar & actions & right & nlp;
+  }
 };
 
 void signal_callback_handler(int /* signum */) {
@@ -512,6 +919,7 @@ int main(int argc, char** argv) {
   HIDDEN_DIM = conf["hidden_dim"].as<unsigned>();
   ACTION_DIM = conf["action_dim"].as<unsigned>();
   LSTM_INPUT_DIM = conf["lstm_input_dim"].as<unsigned>();
+  const unsigned eval_workers = conf["eval_workers"].as<unsigned>();
   if (conf.count("train") && conf.count("dev_data") == 0) {
     cerr << "You specified --train but did not specify --dev_data FILE\n";
     return 1;
@@ -576,9 +984,14 @@ int main(int argc, char** argv) {
 
   ParserBuilder parser(&model, pretrained);
   if (conf.count("model")) {
-    ifstream in(conf["model"].as<string>().c_str());
-    boost::archive::text_iarchive ia(in);
-    ia >> model;
+    // when only decoding, the values of a binary model are read from the
+    // mapped file as needed
+    cnn::load_cnn_model(conf["model"].as<string>(), &model, conf.count("train") == 0);
+  }
+  if (conf.count("write_binary_model")) {
+    cnn::save_cnn_model(conf["write_binary_model"].as<string>(), &model, true);
+    cerr << "Wrote " << conf["write_binary_model"].as<string>() << endl;
+    return 0;
   }
 
   #ifdef ENABLE_PRETRAINED
@@ -699,16 +1112,19 @@ int main(int argc, char** argv) {
         double right = 0;
         double dwords = 0;
         auto t_start = chrono::high_resolution_clock::now();
+        vector<EvalResult> results = cnn::mp::ParallelMap<EvalResult>(dev_size, eval_workers, [&](unsigned sii) {
+          ComputationGraph hg;
+          EvalResult r;
+          parser.log_prob_parser(&hg,dev_corpus.sents[sii],dev_corpus.actions[sii],&r.right,true);
+          r.nlp = as_scalar(hg.incremental_forward());
+          return r;
+        });
         for (unsigned sii = 0; sii < dev_size; ++sii) {
           const auto& sentence=dev_corpus.sents[sii];
           const vector<int>& actions=dev_corpus.actions[sii];
           dwords += sentence.size();
-          {  ComputationGraph hg;
-            parser.log_prob_parser(&hg,sentence,actions,&right,true);
-            double lp = as_scalar(hg.incremental_forward());
-            llh += lp;
-          }
-          double lp = 0;
+          right += results[sii].right;
+          llh += results[sii].nlp;
           trs += actions.size();
         }
         auto t_end = chrono::high_resolution_clock::now();
@@ -718,9 +1134,7 @@ int main(int argc, char** argv) {
           counter = 0;
           cerr << "  new best...writing model to " << fname << " ...\n";
           best_dev_llh = llh;
-          ofstream out(fname);
-          boost::archive::text_oarchive oa(out);
-          oa << model;
+          cnn::save_cnn_model(fname, &model, conf.count("binary_model"));
           // Create a soft link to the most recent model in order to make it
           // easier to refer to it in a shell script.
           if (!softlinkCreated) {
@@ -738,27 +1152,191 @@ int main(int argc, char** argv) {
       }
     }
   } // should do training?
-  if (test_corpus.size() > 0) {
-    // if rescoring, we may have many repeats, cache them
-    unordered_map<vector<int>, unordered_map<vector<int>,double,boost::hash<vector<int>>>, boost::hash<vector<int>>> s2a2p;
+  if (test_corpus.size() > 0 && conf.count("beam_size")) {
+    // parse the test sentences directly, ignoring the trees they come with
+    const unsigned beam_size = conf["beam_size"].as<unsigned>();
+    const unsigned word_beam_size = conf.count("word_beam_size") ?
+        conf["word_beam_size"].as<unsigned>() : max(1u, beam_size / 10);
+    if (beam_size == 0 || word_beam_size == 0) {
+      cerr << "Beam sizes must be at least 1\n";
+      abort();
+    }
+    cerr << "Beam search with action beam " << beam_size << " and word beam " << word_beam_size << endl;
     unsigned test_size = test_corpus.size();
     double llh = 0;
-    double right = 0;
     double dwords = 0;
+    auto t_start = chrono::high_resolution_clock::now();
+    vector<EvalResult> results = cnn::mp::ParallelMap<EvalResult>(test_size, eval_workers, [&](unsigned sii) {
+      ComputationGraph hg;
+      EvalResult r;
+      r.actions = parser.beam_search_parser(&hg, test_corpus.sents[sii], beam_size, word_beam_size, &r.nlp);
+      return r;
+    });
     for (unsigned sii = 0; sii < test_size; ++sii) {
       const auto& sentence=test_corpus.sents[sii];
-      const vector<int>& actions=test_corpus.actions[sii];
       dwords += sentence.size();
-      double& lp = s2a2p[sentence.raw][actions];
-      if (!lp) {
-        ComputationGraph hg;
-        parser.log_prob_parser(&hg,sentence,actions,&right,true);
-        lp = as_scalar(hg.incremental_forward());
+      const vector<unsigned>& pred = results[sii].actions;
+      double lp = results[sii].nlp;
+      llh += lp;
+      cout << sii << " ||| " << -lp << " |||";
+      int ti = 0;
+      for (auto a : pred) {
+        if (adict.Convert(a)[0] == 'N') {
+          cout << " (" << ntermdict.Convert(action2NTindex.find(a)->second);
+        } else if (adict.Convert(a)[0] == 'S') {
+          cout << ' ' << termdict.Convert(sentence.raw[ti++]);
+        } else cout << ')';
+      }
+      cout << endl;
+    }
+    auto t_end = chrono::high_resolution_clock::now();
+    cerr << "test     total -llh of best parses=" << llh << endl;
+    cerr << "parsed " << test_size << " sentences in " << chrono::duration<double, milli>(t_end-t_start).count() << " ms" << endl;
+  } else if (test_corpus.size() > 0) {
+    // if rescoring, we may have many repeats, so each distinct tree is only
+    // scored once: s2a2i maps it to its position in unique
+    unordered_map<vector<int>, unordered_map<vector<int>,unsigned,boost::hash<vector<int>>>, boost::hash<vector<int>>> s2a2i;
+    unsigned test_size = test_corpus.size();
+    vector<unsigned> unique; // the first occurrence of each distinct tree
+    vector<unsigned> tree_index(test_size);
+    for (unsigned sii = 0; sii < test_size; ++sii) {
+      auto& a2i = s2a2i[test_corpus.sents[sii].raw];
+      auto it = a2i.find(test_corpus.actions[sii]);
+      if (it == a2i.end()) {
+        it = a2i.insert(make_pair(test_corpus.actions[sii], (unsigned) unique.size())).first;
+        unique.push_back(sii);
+      }
+      tree_index[sii] = it->second;
+    }
+    const unsigned trie_actions = conf["trie_actions"].as<unsigned>();
+    // the distinct trees of each sentence are scored together, sharing
+    // their common action prefixes. to bound the size of the computation
+    // graphs, they are taken in lexicographic order and split into groups
+    // of at most trie_actions distinct prefixes
+    vector<vector<unsigned>> groups; // positions in unique
+    vector<unsigned> group_of(unique.size()), group_pos(unique.size());
+    {
+      vector<vector<unsigned>> by_sentence;
+      unordered_map<vector<int>, unsigned, boost::hash<vector<int>>> s2s;
+      for (unsigned i = 0; i < unique.size(); ++i) {
+        auto it = s2s.insert(make_pair(test_corpus.sents[unique[i]].raw, (unsigned) by_sentence.size())).first;
+        if (it->second == by_sentence.size()) by_sentence.push_back(vector<unsigned>());
+        by_sentence[it->second].push_back(i);
       }
+      for (auto& trees : by_sentence) {
+        sort(trees.begin(), trees.end(), [&](unsigned a, unsigned b) {
+          return test_corpus.actions[unique[a]] < test_corpus.actions[unique[b]];
+        });
+        unsigned trie_size = 0;
+        for (unsigned k = 0; k < trees.size(); ++k) {
+          const vector<int>& actions = test_corpus.actions[unique[trees[k]]];
+          // in lexicographic order, the longest prefix a tree shares with any
+          // of the previous ones is the one it shares with its predecessor
+          unsigned shared = 0;
+          if (k > 0) {
+            const vector<int>& prev = test_corpus.actions[unique[trees[k - 1]]];
+            while (shared < actions.size() && shared < prev.size() && actions[shared] == prev[shared]) ++shared;
+          }
+          if (k == 0 || trie_size + actions.size() - shared > trie_actions) {
+            groups.push_back(vector<unsigned>());
+            trie_size = shared = 0;
+          }
+          trie_size += actions.size() - shared;
+          group_of[trees[k]] = groups.size() - 1;
+          group_pos[trees[k]] = groups.back().size();
+          groups.back().push_back(trees[k]);
+        }
+      }
+    }
+    auto t_start = chrono::high_resolution_clock::now();
+    vector<vector<double>> group_nlp = cnn::mp::ParallelMap<vector<double>>(groups.size(), eval_workers, [&](unsigned gi) {
+      ComputationGraph hg;
+      vector<const vector<int>*> trees;
+      for (auto i : groups[gi]) trees.push_back(&test_corpus.actions[unique[i]]);
+      return parser.log_prob_trees(&hg, test_corpus.sents[unique[groups[gi][0]]], trees);
+    });
+    auto t_end = chrono::high_resolution_clock::now();
+    vector<double> nlp(test_size);
+    double llh = 0;
+    double dwords = 0;
+    for (unsigned sii = 0; sii < test_size; ++sii) {
+      const auto& sentence=test_corpus.sents[sii];
+      dwords += sentence.size();
+      const unsigned i = tree_index[sii];
+      double lp = nlp[sii] = group_nlp[group_of[i]][group_pos[i]];
       cout << sentence.size() << '\t' << lp << endl;
       llh += lp;
     }
+    cerr << "scored " << unique.size() << " distinct trees in " << groups.size() << " groups in "
+         << chrono::duration<double, milli>(t_end-t_start).count() << " ms" << endl;
     cerr << "test     total -llh=" << llh << endl;
     cerr << "test ppl (per word)=" << exp(llh / dwords) << endl;
+    if (conf.count("proposals")) {
+      // importance sampling with the proposal distribution q(y | x):
+      //   p(x) ~= 1/N sum_i p(x, y_i) / q(y_i | x)
+      // over the N samples y_i of sentence x, which is only unbiased if they
+      // are drawn independently (with replacement). a line may end with
+      // ||| [count] (nt-parser --unique_samples) if its tree was sampled
+      // count times, which gives the same estimate as the count copies.
+      // trees drawn with nt-parser --without_replacement are marked
+      // ||| without_replacement, and are rejected
+      const string& fname = conf["proposals"].as<string>();
+      cnn::compressed_ifstream in(fname.c_str());
+      vector<int> ids; // sentence ids, in order of appearance
+      unordered_map<int, vector<unsigned>> samples; // trees of each sentence
+      string line;
+      vector<double> log_q;
+      vector<unsigned> count;
+      while (getline(in, line)) {
+        size_t p1 = line.find("|||");
+        size_t p2 = p1 == string::npos ? p1 : line.find("|||", p1 + 3);
+        if (p2 == string::npos) {
+          cerr << "Malformed line " << (log_q.size() + 1) << " in " << fname << endl;
+          abort();
+        }
+        const int id = atoi(line.substr(0, p1).c_str());
+        log_q.push_back(atof(line.substr(p1 + 3, p2 - p1 - 3).c_str()));
+        size_t p3 = line.find("|||", p2 + 3);
+        if (p3 != string::npos && line.find("without_replacement", p3) != string::npos) {
+          cerr << fname << " has trees sampled without replacement (nt-parser --without_replacement), "
+               << "for which the importance sampling estimate is biased\n";
+          abort();
+        }
+        count.push_back(p3 == string::npos ? 1 : atoi(line.substr(p3 + 3).c_str()));
+        if (log_q.size() > test_size) break;
+        auto& s = samples[id];
+        if (s.empty()) ids.push_back(id);
+        s.push_back(log_q.size() - 1);
+      }
+      if (log_q.size() != test_size) {
+        cerr << fname << " must have one line for each of the " << test_size << " test trees\n";
+        abort();
+      }
+      double marginal_llh = 0;
+      double mwords = 0;
+      for (auto id : ids) {
+        const vector<unsigned>& s = samples[id];
+        const unsigned n = test_corpus.sents[s[0]].size();
+        vector<double> log_w(s.size()); // log p(x, y_i) - log q(y_i | x), times its count
+        unsigned nsamples = 0;
+        for (unsigned i = 0; i < s.size(); ++i) {
+          if (test_corpus.sents[s[i]].size() != n) {
+            cerr << "The samples of sentence " << id << " in " << fname << " have different lengths\n";
+            abort();
+          }
+          log_w[i] = -nlp[s[i]] - log_q[s[i]] + log(count[s[i]]);
+          nsamples += count[s[i]];
+        }
+        const double m = *max_element(log_w.begin(), log_w.end());
+        double z = 0;
+        for (auto w : log_w) z += exp(w - m);
+        const double log_px = m + log(z) - log(nsamples);
+        cerr << "sentence " << id << " ||| log p(x)=" << log_px << " ||| words=" << n << endl;
+        marginal_llh -= log_px;
+        mwords += n;
+      }
+      cerr << "test     marginal -llh=" << marginal_llh << " (" << ids.size() << " sentences)" << endl;
+      cerr << "test marginal ppl (per word)=" << exp(marginal_llh / mwords) << endl;
+    }
   }
 }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <vector>
@@ -7,14 +8,18 @@
 #include <ctime>
 #include <unordered_set>
 #include <unordered_map>
+#include <memory>
+#include <limits>
 
 #include <execinfo.h>
 #include <unistd.h>
 #include <signal.h>
 
+#include <boost/functional/hash.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/program_options.hpp>
+#include <boost/serialization/vector.hpp>
 
 #include "cnn/training.h"
 #include "cnn/cnn.h"
@@ -24,9 +29,12 @@
 #include "cnn/rnn.h"
 #include "cnn/dict.h"
 #include "cnn/cfsm-builder.h"
+#include "cnn/mp.h"
 
 #include "nt-parser/oracle.h"
+#include "nt-parser/eval.h"
 #include "nt-parser/pretrained.h"
+#include "nt-parser/serve.h"
 #include "nt-parser/compressed-fstream.h"
 
 // dictionaries
@@ -59,6 +67,7 @@ namespace po = boost::program_options;
 
 
 vector<unsigned> possible_actions;
+vector<char> action_type; // first letter of each action: S(HIFT), R(EDUCE) or N(T)
 unordered_map<unsigned, vector<float>> pretrained;
 vector<bool> singletons; // used during training
 
@@ -69,11 +78,14 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     ("explicit_terminal_reduce,x", "[recommended] If set, the parser must explicitly process a REDUCE operation to complete a preterminal constituent")
     ("dev_data,d", po::value<string>(), "Development corpus")
     ("bracketing_dev_data,C", po::value<string>(), "Development bracketed corpus")
+    ("bracketing_test_data", po::value<string>(), "Test bracketed corpus (by default the one given with -C)")
 
     ("test_data,p", po::value<string>(), "Test corpus")
     ("dropout,D", po::value<float>(), "Dropout rate")
     ("samples,s", po::value<unsigned>(), "Sample N trees for each test sentence instead of greedy max decoding")
     ("alpha,a", po::value<float>(), "Flatten (0 < alpha < 1) or sharpen (1 < alpha) sampling distribution")
+    ("unique_samples", "Print each distinct sampled tree only once, followed by ||| [number of times it was sampled]")
+    ("without_replacement", "Sample N distinct trees without replacement (Gumbel-top-k), e.g. as candidates for reranking")
     ("model,m", po::value<string>(), "Load saved model from this file")
     ("use_pos_tags,P", "make POS tags visible to parser")
     ("layers", po::value<unsigned>()->default_value(2), "number of LSTM layers")
@@ -85,9 +97,18 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     ("lstm_input_dim", po::value<unsigned>()->default_value(60), "LSTM input dimension")
     ("train,t", "Should training be run?")
     ("words,w", po::value<string>(), "Pretrained word embeddings")
-    ("beam_size,b", po::value<unsigned>()->default_value(1), "beam size")
-    ("python", po::value<string>()->default_value("python"), "path to python binary")
+    ("beam_size,b", po::value<unsigned>()->default_value(1), "Decode with beam search using this beam size (1 = greedy)")
+    ("batch_size", po::value<unsigned>()->default_value(1), "Train on mini-batches of this many sentences, one update per mini-batch (with the gradient of the mean loss over the sentences, so the learning rate does not depend on N)")
+    ("no_train_accuracy", "Do not count the correctly predicted actions of the training sentences (err in the training status lines)")
+    ("eval_workers", po::value<unsigned>()->default_value(1), "Decode dev and test sentences in this many parallel processes")
+    ("serve", "Read sentences of word/TAG tokens (with -P or --tagged_input, otherwise words), one per line, from stdin (or --socket) and write their parse trees")
+    ("socket", po::value<string>(), "With --serve, answer the clients of this Unix domain socket instead of stdin")
+    ("tagged_input", "With --serve or --stream but without -P, the tokens are still word/TAG, and the tags are the preterminals of the output trees")
+    ("serve_batch", po::value<unsigned>()->default_value(32), "With --serve or --stream, decode at most this many sentences together")
+    ("stream", po::value<string>(), "Parse the sentences (as for --serve) in this file (- for stdin, may be gzipped), one per line, writing each tree as soon as it is parsed")
     ("model_dir", po::value<string>()->default_value("."), "Directory to save the model in")
+    ("binary_model", "Save the model in the binary format, which is smaller and loads much faster, instead of as a text archive")
+    ("write_binary_model", po::value<string>(), "Write the model loaded with -m to this file in the binary format and exit")
     ("start_epoch", po::value<float>(), "Starting epoch")
     ("t2l_norm", "Compute pretrained to LSTM input weight matrix norm?")
     ("w2l_norm", "Compute word to LSTM input weight matrix norm?")
@@ -101,8 +122,8 @@ void InitCommandLine(int argc, char** argv, po::variables_map* conf) {
     cerr << dcmdline_options << endl;
     exit(1);
   }
-  if (conf->count("training_data") == 0) {
-    cerr << "Please specify --traing_data (-T): this is required to determine the vocabulary mapping, even if the parser is used in prediction mode.\n";
+  if (conf->count("training_data") == 0 && conf->count("model") == 0) {
+    cerr << "Please specify --training_data (-T), or a model saved with --binary_model (-m): one of them is required to determine the vocabulary mapping, even if the parser is used in prediction mode.\n";
     exit(1);
   }
 }
@@ -138,6 +159,13 @@ struct ParserBuilder {
 
   Parameters* p_cW;
 
+  // per-symbol parts of the network, precomputed by build_inference_cache
+  // when the parameters are no longer updated (empty otherwise)
+  vector<vector<float>> action_proj; // action_lstm input projection of each action embedding
+  vector<vector<float>> nt_proj; // stack_lstm input projection of each nonterminal embedding
+  vector<vector<float>> word_proj; // ib + w2l * embedding of each word
+  vector<vector<float>> pos_proj; // p2w * embedding of each POS tag
+
   explicit ParserBuilder(Model* model, const unordered_map<unsigned, vector<float>>& pretrained) :
     stack_lstm(LAYERS, LSTM_INPUT_DIM, HIDDEN_DIM, model),
     action_lstm(LAYERS, ACTION_DIM, HIDDEN_DIM, model),
@@ -175,7 +203,8 @@ struct ParserBuilder {
     if (pretrained.size() > 0) {
       p_t = model->add_lookup_parameters(VOCAB_SIZE, {PRETRAINED_DIM});
       for (auto it : pretrained)
-        p_t->Initialize(it.first, it.second);
+        if (it.second.size() > 0) // empty if the values come from a model bundle
+          p_t->Initialize(it.first, it.second);
       p_t2l = model->add_parameters({LSTM_INPUT_DIM, PRETRAINED_DIM});
     } else {
       p_t = nullptr;
@@ -183,11 +212,62 @@ struct ParserBuilder {
     }
   }
 
-  // checks to see if a proposed action is valid in discriminative models
-  static bool IsActionForbidden_Discriminative(const string& a, char prev_a, unsigned bsize, unsigned ssize, unsigned nopen_parens) {
-    bool is_shift = (a[0] == 'S' && a[1]=='H');
-    bool is_reduce = (a[0] == 'R' && a[1]=='E');
-    bool is_nt = (a[0] == 'N');
+  // the values of the batch elements of e, in order
+  static void split_batch(const Expression& e, vector<vector<float>>* out) {
+    const Tensor& t = e.value();
+    const unsigned d = t.d.batch_size();
+    vector<float> v = as_vector(t);
+    for (unsigned b = 0; b < t.d.batch_elems(); ++b)
+      out->push_back(vector<float>(v.begin() + b * d, v.begin() + (b + 1) * d));
+  }
+
+  // fills in action_proj, nt_proj, word_proj and pos_proj from the current
+  // parameters. afterwards, parser states built without dropout use them
+  // instead of multiplying the same embeddings by the same matrices at every
+  // step, so this must not be called if the parameters will change.
+  // the contributions of the pretrained vectors are not cached, since their
+  // table can be much larger than the vocabulary of the parser
+  void build_inference_cache() {
+    action_proj.clear();
+    nt_proj.clear();
+    word_proj.clear();
+    pos_proj.clear();
+    // the words are projected in chunks, so that the graph stays small
+    static const unsigned CHUNK = 4096;
+    vector<unsigned> ids;
+    auto range = [&](unsigned begin, unsigned end) -> const vector<unsigned>& {
+      ids.resize(end - begin);
+      for (unsigned i = begin; i < end; ++i) ids[i - begin] = i;
+      return ids;
+    };
+    {
+      ComputationGraph hg;
+      SentenceGraph g;
+      new_graph(&hg, false, &g);
+      Expression pa = action_lstm.project_inputs(lookup(hg, p_a, range(0, ACTION_SIZE)));
+      Expression pnt = stack_lstm.project_inputs(lookup(hg, p_nt, range(0, NT_SIZE)));
+      Expression ppos;
+      if (USE_POS) ppos = g.p2w * lookup(hg, p_pos, range(0, POS_SIZE));
+      hg.forward();
+      split_batch(pa, &action_proj);
+      split_batch(pnt, &nt_proj);
+      if (USE_POS) split_batch(ppos, &pos_proj);
+    }
+    for (unsigned begin = 0; begin < VOCAB_SIZE; begin += CHUNK) {
+      ComputationGraph hg;
+      Expression ib = parameter(hg, p_ib), w2l = parameter(hg, p_w2l);
+      const unsigned end = min(begin + CHUNK, VOCAB_SIZE);
+      Expression x = affine_transform({ib, w2l, lookup(hg, p_w, range(begin, end))});
+      hg.forward();
+      split_batch(x, &word_proj);
+    }
+  }
+
+  // checks to see if a proposed action (given by its action_type) is valid in discriminative models
+  static bool IsActionForbidden_Discriminative(char a, char prev_a, unsigned bsize, unsigned ssize, unsigned nopen_parens) {
+    bool is_shift = (a == 'S');
+    bool is_reduce = (a == 'R');
+    bool is_nt = (a == 'N');
     assert(is_shift || is_reduce || is_nt);
     static const unsigned MAX_OPEN_NTS = 100;
     if (is_nt && nopen_parens > MAX_OPEN_NTS) return true;
@@ -220,20 +300,40 @@ struct ParserBuilder {
   }
 
 
-  // *** if correct_actions is empty, this runs greedy decoding ***
-  // returns parse actions for input sentence (in training just returns the reference)
-  // this lets us use pretrained embeddings, when available, for words that were OOV in the
-  // parser training data
-  // set sample=true to sample rather than max
-  vector<unsigned> log_prob_parser(ComputationGraph* hg,
-                                   const parser::Sentence& sent,
-                                   const vector<int>& correct_actions,
-                                   double *right,
-                                   bool is_evaluation,
-                                   bool sample = false) {
+  // expressions that are shared by every parser state built for one sentence:
+  // the parameters and the (precomputed, read-only) buffer
+  struct SentenceGraph {
+    Expression pbias, S, B, A;
+    Expression ptbias, ptW;
+    Expression p2w;
+    Expression ib, cbias, w2l, t2l;
+    Expression p2a, abias, action_start, cW;
+    vector<Expression> buffer;  // variables representing word embeddings
+    Expression buffer_words; // buffer[1..] as the batch elements of one expression
+    vector<int> bufferi;  // position of the words in the sentence
+    RNNPointer buffer_start; // buffer[i] is read at buffer_lstm state buffer_start + i
+    bool apply_dropout;
+  };
+
+  // a (partial) parse; the LSTM states are held as RNNPointers so that
+  // states can be branched, e.g. during beam search
+  struct ParserState {
+    vector<Expression> stack;  // variables representing subtree embeddings
+    vector<int> stacki; // position of words in the sentence of head of subtree
+    vector<RNNPointer> stack_ptr; // stack_lstm state after pushing stack[i]
+    vector<int> is_open_paren; // -1 if no nonterminal has a parenthesis open, otherwise index of NT
+    RNNPointer action_ptr;
+    unsigned bsize; // number of symbols left in the buffer (including guard)
+    int nopen_parens;
+    char prev_a;
+    double score; // log probability of results
     vector<unsigned> results;
-    const bool build_training_graph = correct_actions.size() > 0;
-    bool apply_dropout = (DROPOUT && !is_evaluation);
+    bool is_final() const { return stack.size() <= 2 && bsize <= 1; }
+  };
+
+  // resets the builders and adds the parameters to hg
+  void new_graph(ComputationGraph* hg, bool apply_dropout, SentenceGraph* g) {
+    g->apply_dropout = apply_dropout;
     stack_lstm.new_graph(*hg);
     action_lstm.new_graph(*hg);
     const_lstm_fwd.new_graph(*hg);
@@ -256,253 +356,1167 @@ struct ParserBuilder {
       const_lstm_rev.disable_dropout();
     }
     // variables in the computation graph representing the parameters
-    Expression pbias = parameter(*hg, p_pbias);
-    Expression S = parameter(*hg, p_S);
-    Expression B = parameter(*hg, p_B);
-    Expression A = parameter(*hg, p_A);
-    Expression ptbias, ptW;
+    g->pbias = parameter(*hg, p_pbias);
+    g->S = parameter(*hg, p_S);
+    g->B = parameter(*hg, p_B);
+    g->A = parameter(*hg, p_A);
     if (IMPLICIT_REDUCE_AFTER_SHIFT) {
-      ptbias = parameter(*hg, p_ptbias);
-      ptW = parameter(*hg, p_ptW);
+      g->ptbias = parameter(*hg, p_ptbias);
+      g->ptW = parameter(*hg, p_ptW);
     }
-    Expression p2w;
     if (USE_POS) {
-      p2w = parameter(*hg, p_p2w);
+      g->p2w = parameter(*hg, p_p2w);
     }
 
-    Expression ib = parameter(*hg, p_ib);
-    Expression cbias = parameter(*hg, p_cbias);
-    Expression w2l = parameter(*hg, p_w2l);
-    Expression t2l;
+    g->ib = parameter(*hg, p_ib);
+    g->cbias = parameter(*hg, p_cbias);
+    g->w2l = parameter(*hg, p_w2l);
     if (p_t2l)
-      t2l = parameter(*hg, p_t2l);
-    Expression p2a = parameter(*hg, p_p2a);
-    Expression abias = parameter(*hg, p_abias);
-    Expression action_start = parameter(*hg, p_action_start);
-    Expression cW = parameter(*hg, p_cW);
-
-    action_lstm.add_input(action_start);
-
-    vector<Expression> buffer(sent.size() + 1);  // variables representing word embeddings
-    vector<int> bufferi(sent.size() + 1);  // position of the words in the sentence
-    // precompute buffer representation from left to right
-
-    // in the discriminative model, here we set up the buffer contents
-    for (unsigned i = 0; i < sent.size(); ++i) {
-      int wordid = sent.raw[i]; // this will be equal to unk at dev/test
-      if (build_training_graph && singletons.size() > (size_t) wordid && singletons[wordid] && rand01() > 0.5)
-        wordid = sent.unk[i];
-      Expression w = lookup(*hg, p_w, wordid);
-
-      vector<Expression> args = {ib, w2l, w}; // learn embeddings
-      if (p_t && pretrained.count(sent.lc[i])) {  // include fixed pretrained vectors?
-        Expression t = const_lookup(*hg, p_t, sent.lc[i]);
-        args.push_back(t2l);
-        args.push_back(t);
-      }
-      if (USE_POS) {
-        args.push_back(p2w);
-        args.push_back(lookup(*hg, p_pos, sent.pos[i]));
-      }
-      buffer[sent.size() - i] = rectify(affine_transform(args));
-      bufferi[sent.size() - i] = i;
+      g->t2l = parameter(*hg, p_t2l);
+    g->p2a = parameter(*hg, p_p2a);
+    g->abias = parameter(*hg, p_abias);
+    g->action_start = parameter(*hg, p_action_start);
+    g->cW = parameter(*hg, p_cW);
+  }
+
+  // fills in the buffer of g with the embeddings of the words of sent
+  void embed_sentence(ComputationGraph* hg,
+                      const parser::Sentence& sent,
+                      bool build_training_graph,
+                      SentenceGraph* g) {
+    vector<Expression>& buffer = g->buffer;
+    vector<int>& bufferi = g->bufferi;
+    const unsigned n = sent.size();
+    buffer.resize(n + 1);
+    bufferi.resize(n + 1);
+    // in the discriminative model, here we set up the buffer contents.
+    // the embeddings of all words are looked up together and transformed
+    // with one matrix product per input type: batch element j is buffer
+    // element j + 1, i.e. word n - 1 - j
+    if (n > 0) {
+      vector<unsigned> wordids(n);
+      for (unsigned i = 0; i < n; ++i) {
+        int wordid = sent.raw[i]; // this will be equal to unk at dev/test
+        if (build_training_graph && singletons.size() > (size_t) wordid && singletons[wordid] && rand01() > 0.5)
+          wordid = sent.unk[i];
+        wordids[n - 1 - i] = wordid;
+      }
+      const bool cached = word_proj.size() > 0 && !build_training_graph;
+      vector<Expression> args;
+      if (cached) {
+        // the cached contributions of the words (and tags) to the input
+        vector<float> x(n * LSTM_INPUT_DIM);
+        for (unsigned j = 0; j < n; ++j) {
+          const vector<float>& w = word_proj[wordids[j]];
+          copy(w.begin(), w.end(), x.begin() + j * LSTM_INPUT_DIM);
+          if (USE_POS) {
+            const vector<float>& t = pos_proj[sent.pos[n - 1 - j]];
+            for (unsigned k = 0; k < LSTM_INPUT_DIM; ++k) x[j * LSTM_INPUT_DIM + k] += t[k];
+          }
+        }
+        args.push_back(input(*hg, Dim({LSTM_INPUT_DIM}, n), x));
+      } else {
+        args = {g->ib, g->w2l, lookup(*hg, p_w, wordids)}; // learn embeddings
+      }
+      if (p_t) { // include fixed pretrained vectors?
+        vector<unsigned> lcids, cols(n);
+        for (unsigned j = 0; j < n; ++j) {
+          const unsigned lc = sent.lc[n - 1 - j];
+          cols[j] = pretrained.count(lc) ? lcids.size() : n;
+          if (cols[j] < n) lcids.push_back(lc);
+        }
+        Expression t;
+        if (lcids.size() == n) {
+          t = const_lookup(*hg, p_t, lcids);
+        } else if (lcids.size() > 0) {
+          // words without pretrained vectors get a zero column
+          const unsigned k = lcids.size();
+          for (auto& c : cols) c = min(c, k);
+          Expression tk = reshape(const_lookup(*hg, p_t, lcids), {PRETRAINED_DIM, k});
+          t = concatenate_cols({tk, zeroes(*hg, {PRETRAINED_DIM, 1})});
+          t = reshape(select_cols(t, cols), Dim({PRETRAINED_DIM}, n));
+        }
+        if (t.pg) {
+          args.push_back(g->t2l);
+          args.push_back(t);
+        }
+      }
+      if (USE_POS && !cached) {
+        vector<unsigned> posids(n);
+        for (unsigned i = 0; i < n; ++i) posids[n - 1 - i] = sent.pos[i];
+        args.push_back(g->p2w);
+        args.push_back(lookup(*hg, p_pos, posids));
+      }
+      g->buffer_words = rectify(args.size() == 1 ? args[0] : affine_transform(args));
+      for (unsigned j = 0; j < n; ++j) {
+        buffer[j + 1] = pick_batch_elem(g->buffer_words, j);
+        bufferi[j + 1] = n - 1 - j;
+      }
     }
     // dummy symbol to represent the empty buffer
     buffer[0] = parameter(*hg, p_buffer_guard);
     bufferi[0] = -999;
-    for (auto& b : buffer)
-      buffer_lstm->add_input(b);
+  }
 
-    vector<Expression> stack;  // variables representing subtree embeddings
-    vector<int> stacki; // position of words in the sentence of head of subtree
-    stack.push_back(parameter(*hg, p_stack_guard));
-    stacki.push_back(-999); // not used for anything
+  // resets the builders, adds the parameters and runs the buffer LSTM for sent
+  void new_sentence_graph(ComputationGraph* hg,
+                          const parser::Sentence& sent,
+                          bool build_training_graph,
+                          bool apply_dropout,
+                          SentenceGraph* g) {
+    new_graph(hg, apply_dropout, g);
+    embed_sentence(hg, sent, build_training_graph, g);
+    add_buffer(*g);
+  }
+
+  // runs the buffer LSTM over g.buffer as a new sequence; the inputs of
+  // the first layer of all words are computed together
+  void add_buffer(SentenceGraph& g) {
+    buffer_lstm->add_input(RNNPointer(-1), g.buffer[0]);
+    g.buffer_start = buffer_lstm->state();
+    if (g.buffer.size() == 1) return;
+    Expression px = buffer_lstm->project_inputs(g.buffer_words);
+    for (unsigned j = 1; j < g.buffer.size(); ++j)
+      buffer_lstm->add_projected_input(pick_batch_elem(px, j - 1));
+  }
+
+  // the parser state before any action has been taken
+  ParserState initial_state(ComputationGraph* hg, const SentenceGraph& g) {
+    ParserState st;
+    // start from the beginning of the sequences, even if other parser states
+    // have already been built from g
+    action_lstm.add_input(RNNPointer(-1), g.action_start);
+    st.action_ptr = action_lstm.state();
+    st.bsize = g.buffer.size();
+    st.stack.push_back(parameter(*hg, p_stack_guard));
+    st.stacki.push_back(-999); // not used for anything
     // drive dummy symbol on stack through LSTM
-    stack_lstm.add_input(stack.back());
-    vector<int> is_open_paren; // -1 if no nonterminal has a parenthesis open, otherwise index of NT
-    is_open_paren.push_back(-1); // corresponds to dummy symbol
+    stack_lstm.add_input(RNNPointer(-1), st.stack.back());
+    st.stack_ptr.push_back(stack_lstm.state());
+    st.is_open_paren.push_back(-1); // corresponds to dummy symbol
+    st.nopen_parens = 0;
+    st.prev_a = '0';
+    st.score = 0;
+    return st;
+  }
+
+  // get list of possible actions for the current parser state
+  void valid_actions(const ParserState& st, vector<unsigned>* current_valid_actions) const {
+    current_valid_actions->clear();
+    for (auto a: possible_actions) {
+      if (IsActionForbidden_Discriminative(action_type[a], st.prev_a, st.bsize, st.stack.size(), st.nopen_parens))
+        continue;
+      current_valid_actions->push_back(a);
+    }
+  }
+
+  void state_summaries(const SentenceGraph& g, const ParserState& st,
+                       Expression* stack_summary, Expression* buffer_summary, Expression* action_summary) const {
+    *stack_summary = stack_lstm.get_h(st.stack_ptr.back()).back();
+    *action_summary = action_lstm.get_h(st.action_ptr).back();
+    *buffer_summary = buffer_lstm->get_h(RNNPointer(g.buffer_start + st.bsize - 1)).back();
+    if (g.apply_dropout) {
+      *stack_summary = dropout(*stack_summary, DROPOUT);
+      *action_summary = dropout(*action_summary, DROPOUT);
+      *buffer_summary = dropout(*buffer_summary, DROPOUT);
+    }
+  }
+
+  // the hidden layer of the action classifier
+  Expression parser_state(const SentenceGraph& g, const Expression& stack_summary,
+                          const Expression& buffer_summary, const Expression& action_summary) const {
+    // p_t = pbias + S * slstm + B * blstm + A * almst
+    Expression p_t = affine_transform({g.pbias, g.S, stack_summary, g.B, buffer_summary, g.A, action_summary});
+    return rectify(p_t);
+  }
+
+  // unnormalized action scores; the summaries may be mini-batches
+  // holding one parser state per batch element
+  Expression action_scores(const SentenceGraph& g, const Expression& stack_summary,
+                           const Expression& buffer_summary, const Expression& action_summary) const {
+    Expression nlp_t = parser_state(g, stack_summary, buffer_summary, action_summary);
+    // r_t = abias + p2a * nlp
+    return affine_transform({g.abias, g.p2a, nlp_t});
+  }
+
+  // log probabilities of the valid actions of a single parser state (-inf for
+  // the others); only the rows of p2a of the valid actions are used
+  Expression action_log_probs(const SentenceGraph& g, const Expression& stack_summary,
+                              const Expression& buffer_summary, const Expression& action_summary,
+                              const vector<unsigned>& valid) const {
+    Expression nlp_t = parser_state(g, stack_summary, buffer_summary, action_summary);
+    return restricted_affine_log_softmax(g.abias, g.p2a, nlp_t, valid);
+  }
+
+  // advance st by executing action (which must be valid)
+  void apply_action(ComputationGraph* hg, const SentenceGraph& g, ParserState& st, unsigned action) {
+    st.results.push_back(action);
+
+    // add current action to action LSTM
+    const bool cached = action_proj.size() > 0 && !g.apply_dropout;
+    if (cached) {
+      action_lstm.add_projected_input(st.action_ptr, input(*hg, {3 * HIDDEN_DIM}, &action_proj[action]));
+    } else {
+      Expression actione = lookup(*hg, p_a, action);
+      action_lstm.add_input(st.action_ptr, actione);
+    }
+    st.action_ptr = action_lstm.state();
+
+    // do action
+    const string& actionString=adict.Convert(action);
+    const char ac = actionString[0];
+    const char ac2 = actionString[1];
+    st.prev_a = ac;
+
+    if (ac =='S' && ac2=='H') {  // SHIFT
+      assert(st.bsize > 1); // dummy symbol means > 1 (not >= 1)
+      const Expression& terminal = g.buffer[st.bsize - 1];
+      if (IMPLICIT_REDUCE_AFTER_SHIFT) {
+        --st.nopen_parens;
+        int i = st.is_open_paren.size() - 1;
+        assert(st.is_open_paren[i] >= 0);
+        Expression nonterminal = lookup(*hg, p_ntup, st.is_open_paren[i]);
+        Expression c = concatenate({nonterminal, terminal});
+        Expression pt = rectify(affine_transform({g.ptbias, g.ptW, c}));
+        st.stack.pop_back();
+        st.stacki.pop_back();
+        st.stack_ptr.pop_back();
+        st.is_open_paren.pop_back();
+        stack_lstm.add_input(st.stack_ptr.back(), pt);
+        st.stack_ptr.push_back(stack_lstm.state());
+        st.stack.push_back(pt);
+        st.stacki.push_back(999);
+        st.is_open_paren.push_back(-1);
+      } else {
+        st.stack.push_back(terminal);
+        stack_lstm.add_input(st.stack_ptr.back(), terminal);
+        st.stack_ptr.push_back(stack_lstm.state());
+        st.stacki.push_back(g.bufferi[st.bsize - 1]);
+        st.is_open_paren.push_back(-1);
+      }
+      --st.bsize;
+    } else if (ac == 'N') { // NT
+      ++st.nopen_parens;
+      assert(st.bsize > 1);
+      auto it = action2NTindex.find(action);
+      assert(it != action2NTindex.end());
+      int nt_index = it->second;
+      Expression nt_embedding = lookup(*hg, p_nt, nt_index);
+      st.stack.push_back(nt_embedding);
+      if (cached)
+        stack_lstm.add_projected_input(st.stack_ptr.back(), input(*hg, {3 * HIDDEN_DIM}, &nt_proj[nt_index]));
+      else
+        stack_lstm.add_input(st.stack_ptr.back(), nt_embedding);
+      st.stack_ptr.push_back(stack_lstm.state());
+      st.stacki.push_back(-1);
+      st.is_open_paren.push_back(nt_index);
+    } else { // REDUCE
+      --st.nopen_parens;
+      assert(st.stack.size() > 2); // dummy symbol means > 2 (not >= 2)
+      // find what paren we are closing
+      int i = st.is_open_paren.size() - 1;
+      while(st.is_open_paren[i] < 0) { --i; assert(i >= 0); }
+      Expression nonterminal = lookup(*hg, p_ntup, st.is_open_paren[i]);
+      int nchildren = st.is_open_paren.size() - i - 1;
+      assert(nchildren > 0);
+      vector<Expression> children(nchildren);
+      const_lstm_fwd.start_new_sequence();
+      const_lstm_rev.start_new_sequence();
+
+      // REMOVE EVERYTHING FROM THE STACK THAT IS GOING
+      // TO BE COMPOSED INTO A TREE EMBEDDING
+      for (i = 0; i < nchildren; ++i) {
+        children[i] = st.stack.back();
+        assert (st.stacki.back() != -1);
+        st.stacki.pop_back();
+        st.stack.pop_back();
+        st.stack_ptr.pop_back();
+        st.is_open_paren.pop_back();
+      }
+      st.is_open_paren.pop_back(); // nt symbol
+      assert (st.stacki.back() == -1);
+      st.stacki.pop_back(); // nonterminal dummy
+      st.stack.pop_back(); // nonterminal dummy
+      st.stack_ptr.pop_back(); // nt symbol
+
+      // BUILD TREE EMBEDDING USING BIDIR LSTM
+      const_lstm_fwd.add_input(nonterminal);
+      const_lstm_rev.add_input(nonterminal);
+      for (i = 0; i < nchildren; ++i) {
+        const_lstm_fwd.add_input(children[i]);
+        const_lstm_rev.add_input(children[nchildren - i - 1]);
+      }
+      Expression cfwd = const_lstm_fwd.back();
+      Expression crev = const_lstm_rev.back();
+      if (g.apply_dropout) {
+        cfwd = dropout(cfwd, DROPOUT);
+        crev = dropout(crev, DROPOUT);
+      }
+      Expression c = concatenate({cfwd, crev});
+      Expression composed = rectify(affine_transform({g.cbias, g.cW, c}));
+      stack_lstm.add_input(st.stack_ptr.back(), composed);
+      st.stack_ptr.push_back(stack_lstm.state());
+      st.stack.push_back(composed);
+      st.stacki.push_back(999); // who knows, should get rid of this
+      st.is_open_paren.push_back(-1); // we just closed a paren at this position
+    }
+  }
+
+  // *** if correct_actions is empty, this runs greedy decoding ***
+  // returns parse actions for input sentence (in training just returns the reference)
+  // this lets us use pretrained embeddings, when available, for words that were OOV in the
+  // parser training data
+  // set sample=true to sample rather than max
+  vector<unsigned> log_prob_parser(ComputationGraph* hg,
+                                   const parser::Sentence& sent,
+                                   const vector<int>& correct_actions,
+                                   double *right,
+                                   bool is_evaluation,
+                                   bool sample = false) {
+    const bool build_training_graph = correct_actions.size() > 0;
+    bool apply_dropout = (DROPOUT && !is_evaluation);
+    SentenceGraph g;
+    new_sentence_graph(hg, sent, build_training_graph, apply_dropout, &g);
+    return run_parser(hg, g, initial_state(hg, g), correct_actions, right, sample);
+  }
+
+  // the scores (or log probabilities) of the actions at one step of one or
+  // more parses, to be checked after the forward pass: batch element elem of
+  // step_scores[step]
+  struct Prediction {
+    unsigned step;
+    unsigned elem;
+    vector<unsigned> valid;
+    unsigned action;
+  };
+
+  // adds to *right the number of predictions whose best valid action is the
+  // gold one; the scores must have been computed
+  void count_right(const vector<Prediction>& predictions,
+                   const vector<Expression>& step_scores,
+                   double *right) const {
+    vector<float> scores;
+    unsigned scores_step = 0;
+    for (auto& p : predictions) {
+      if (scores.empty() || p.step != scores_step) {
+        scores = as_vector(step_scores[p.step].value());
+        scores_step = p.step;
+      }
+      const float* r = &scores[p.elem * ACTION_SIZE];
+      unsigned model_action = p.valid[0];
+      for (unsigned i = 1; i < p.valid.size(); ++i)
+        if (r[p.valid[i]] > r[model_action]) model_action = p.valid[i];
+      if (model_action == p.action) (*right)++;
+    }
+  }
+
+  // log_prob_parser for a sentence that has already been encoded in g,
+  // continuing from parser state st.
+  // when following the reference actions (without sampling), nothing has
+  // to be computed while the graph is built: the whole graph is evaluated
+  // at the end, and only if right is not null (to count the correct
+  // predictions), so the last node of hg is left for the caller to evaluate
+  vector<unsigned> run_parser(ComputationGraph* hg,
+                              const SentenceGraph& g,
+                              ParserState st,
+                              const vector<int>& correct_actions,
+                              double *right,
+                              bool sample) {
+    const bool build_training_graph = correct_actions.size() > 0;
+    const bool deferred = build_training_graph && !sample;
     vector<Expression> log_probs;
-    string rootword;
+    vector<Prediction> predictions;
+    vector<Expression> step_scores;
     unsigned action_count = 0;  // incremented at each prediction
-    unsigned nt_count = 0; // number of times an NT has been introduced
     vector<unsigned> current_valid_actions;
-    int nopen_parens = 0;
-    char prev_a = '0';
-    while(stack.size() > 2 || buffer.size() > 1) {
-      // get list of possible actions for the current parser state
-      current_valid_actions.clear();
-      for (auto a: possible_actions) {
-        if (IsActionForbidden_Discriminative(adict.Convert(a), prev_a, buffer.size(), stack.size(), nopen_parens))
-          continue;
-        current_valid_actions.push_back(a);
-      }
-
-      // p_t = pbias + S * slstm + B * blstm + A * almst
-      Expression stack_summary = stack_lstm.back();
-      Expression action_summary = action_lstm.back();
-      Expression buffer_summary = buffer_lstm->back();
-      if (apply_dropout) {
-        stack_summary = dropout(stack_summary, DROPOUT);
-        action_summary = dropout(action_summary, DROPOUT);
-        buffer_summary = dropout(buffer_summary, DROPOUT);
+    while(!st.is_final()) {
+      valid_actions(st, &current_valid_actions);
+
+      Expression stack_summary, buffer_summary, action_summary;
+      state_summaries(g, st, &stack_summary, &buffer_summary, &action_summary);
+      Expression adiste;
+      if (sample && ALPHA != 1.0f) {
+        Expression r_t = action_scores(g, stack_summary, buffer_summary, action_summary);
+        adiste = log_softmax(r_t * ALPHA, current_valid_actions);
+      } else {
+        adiste = action_log_probs(g, stack_summary, buffer_summary, action_summary, current_valid_actions);
       }
-      Expression p_t = affine_transform({pbias, S, stack_summary, B, buffer_summary, A, action_summary});
-      Expression nlp_t = rectify(p_t);
-      // r_t = abias + p2a * nlp
-      Expression r_t = affine_transform({abias, p2a, nlp_t});
-      if (sample && ALPHA != 1.0f) r_t = r_t * ALPHA;
-      Expression adiste = log_softmax(r_t, current_valid_actions);
-      vector<float> adist = as_vector(hg->incremental_forward());
-      double best_score = adist[current_valid_actions[0]];
-      unsigned model_action = current_valid_actions[0];
-      if (sample) {
-        double p = rand01();
-        assert(current_valid_actions.size() > 0);
-        unsigned w = 0;
-        for (; w < current_valid_actions.size(); ++w) {
-          p -= exp(adist[current_valid_actions[w]]);
-          if (p < 0.0) { break; }
+      if (build_training_graph && action_count >= correct_actions.size()) {
+        cerr << "Correct action list exhausted, but not in final parser state.\n";
+        abort();
+      }
+      unsigned action;
+      if (deferred) {
+        action = correct_actions[action_count];
+        if (right) {
+          step_scores.push_back(adiste);
+          predictions.push_back(Prediction{(unsigned) step_scores.size() - 1, 0, current_valid_actions, action});
         }
-        if (w == current_valid_actions.size()) w--;
-        model_action = current_valid_actions[w];
-      } else { // max
-        for (unsigned i = 1; i < current_valid_actions.size(); ++i) {
-          if (adist[current_valid_actions[i]] > best_score) {
-            best_score = adist[current_valid_actions[i]];
-            model_action = current_valid_actions[i];
+      } else {
+        vector<float> adist = as_vector(hg->incremental_forward());
+        double best_score = adist[current_valid_actions[0]];
+        unsigned model_action = current_valid_actions[0];
+        if (sample) {
+          double p = rand01();
+          assert(current_valid_actions.size() > 0);
+          unsigned w = 0;
+          for (; w < current_valid_actions.size(); ++w) {
+            p -= exp(adist[current_valid_actions[w]]);
+            if (p < 0.0) { break; }
           }
+          if (w == current_valid_actions.size()) w--;
+          model_action = current_valid_actions[w];
+        } else { // max
+          for (unsigned i = 1; i < current_valid_actions.size(); ++i) {
+            if (adist[current_valid_actions[i]] > best_score) {
+              best_score = adist[current_valid_actions[i]];
+              model_action = current_valid_actions[i];
+            }
+          }
+        }
+        action = model_action;
+        if (build_training_graph) {  // if we have reference actions (for training) use the reference action
+          action = correct_actions[action_count];
+          if (right && model_action == action) { (*right)++; }
         }
       }
-      unsigned action = model_action;
-      if (build_training_graph) {  // if we have reference actions (for training) use the reference action
-        if (action_count >= correct_actions.size()) {
+      ++action_count;
+      log_probs.push_back(pick(adiste, action));
+      apply_action(hg, g, st, action);
+    }
+    if (build_training_graph && action_count != correct_actions.size()) {
+      cerr << "Unexecuted actions remain but final state reached!\n";
+      abort();
+    }
+    assert(st.stack.size() == 2); // guard symbol, root
+    assert(st.stacki.size() == 2);
+    assert(st.bsize == 1); // guard symbol
+    Expression tot_neglogprob = -sum(log_probs);
+    assert(tot_neglogprob.pg != nullptr);
+    if (deferred && right) {
+      hg->incremental_forward();
+      count_right(predictions, step_scores, right);
+    }
+    return st.results;
+  }
+
+  // one step of lstm for a mini-batch of independent sequences: sequence b
+  // continues from state *prev[b] (in get_s layout, or empty to start a new
+  // sequence) with input batch element b of x. the new state of sequence b
+  // is written to (*next)[b]. the builder is restarted, so any states held
+  // as RNNPointers into it become invalid
+  static void batched_lstm_step(LSTMBuilder& lstm,
+                                const vector<const vector<Expression>*>& prev,
+                                const Expression& x,
+                                vector<vector<Expression>>* next) {
+    const unsigned bsz = prev.size();
+    const unsigned ncomp = lstm.num_h0_components();
+    if (prev[0]->empty()) {
+      lstm.start_new_sequence();
+    } else {
+      vector<Expression> init(ncomp);
+      vector<Expression> parts(bsz);
+      for (unsigned l = 0; l < ncomp; ++l) {
+        for (unsigned b = 0; b < bsz; ++b) {
+          assert(prev[b]->size() == ncomp);
+          parts[b] = (*prev[b])[l];
+        }
+        init[l] = (bsz == 1 ? parts[0] : concatenate_to_batch(parts));
+      }
+      lstm.start_new_sequence(init);
+    }
+    lstm.add_input(x);
+    const vector<Expression> s = lstm.final_s();
+    next->resize(bsz);
+    for (unsigned b = 0; b < bsz; ++b) {
+      (*next)[b].resize(ncomp);
+      for (unsigned l = 0; l < ncomp; ++l)
+        (*next)[b][l] = (bsz == 1 ? s[l] : pick_batch_elem(s[l], b));
+    }
+  }
+
+  // parser state used by log_prob_parser_batch; since the builders are
+  // restarted at every batched step, the LSTM states are held explicitly
+  // (stack_ptr and action_ptr are not used)
+  struct LockstepState : public ParserState {
+    vector<vector<Expression>> stack_s; // stack_lstm state after pushing stack[i]
+    vector<Expression> action_s;
+    unsigned action_count;
+  };
+
+  // runs the oracle action sequences of several sentences in lock-step: at
+  // every step the stack, action and composition LSTM updates and the action
+  // scores of all unfinished sentences are computed as one mini-batch, as is
+  // the buffer LSTM over all sentences.
+  // the last node of hg is the negative log probability of the oracle parses
+  // averaged over the sentences, so that the size of an update does not grow
+  // with the mini-batch; the forward pass is run to count correct
+  // predictions in *right, unless right is null
+  void log_prob_parser_batch(ComputationGraph* hg,
+                             const vector<const parser::Sentence*>& sents,
+                             const vector<const vector<int>*>& correct_actions,
+                             double *right) {
+    const unsigned nsents = sents.size();
+    assert(nsents > 0 && correct_actions.size() == nsents);
+    SentenceGraph params;
+    new_graph(hg, DROPOUT > 0, &params);
+    vector<SentenceGraph> gs(nsents, params);
+    for (unsigned b = 0; b < nsents; ++b)
+      embed_sentence(hg, *sents[b], true, &gs[b]);
+
+    // buffer LSTM over all sentences; shorter buffers are padded at the end,
+    // after the last state that is read
+    unsigned max_len = 0;
+    for (auto& g : gs) max_len = max(max_len, (unsigned) g.buffer.size());
+    vector<Expression> buffer_h(max_len); // batch element b is sentence b
+    vector<Expression> xs(nsents);
+    for (unsigned b = 0; b < nsents; ++b)
+      xs[b] = gs[b].buffer[0];
+    buffer_lstm->add_input(concatenate_to_batch(xs));
+    buffer_h[0] = buffer_lstm->back();
+    if (max_len > 1) {
+      // the inputs of the first layer of all words of all sentences are
+      // computed together; words[b] is the first of sentence b among them
+      vector<Expression> all_words;
+      vector<unsigned> words(nsents);
+      unsigned nwords = 0;
+      for (unsigned b = 0; b < nsents; ++b) {
+        words[b] = nwords;
+        if (gs[b].buffer.size() == 1) continue;
+        all_words.push_back(gs[b].buffer_words);
+        nwords += gs[b].buffer.size() - 1;
+      }
+      Expression px = buffer_lstm->project_inputs(concatenate_to_batch(all_words));
+      for (unsigned t = 1; t < max_len; ++t) {
+        for (unsigned b = 0; b < nsents; ++b) {
+          // (an empty sentence's padding, which is never read, is any word)
+          const unsigned j = gs[b].buffer.size() == 1 ? 0 : words[b] + min(t, (unsigned) gs[b].buffer.size() - 1) - 1;
+          xs[b] = pick_batch_elem(px, j);
+        }
+        buffer_lstm->add_projected_input(concatenate_to_batch(xs));
+        buffer_h[t] = buffer_lstm->back();
+      }
+    }
+
+    // the initial states are the same for every sentence
+    action_lstm.add_input(params.action_start);
+    const vector<Expression> action_s0 = action_lstm.final_s();
+    Expression stack_guard = parameter(*hg, p_stack_guard);
+    stack_lstm.add_input(stack_guard);
+    const vector<Expression> stack_s0 = stack_lstm.final_s();
+    vector<LockstepState> st(nsents);
+    for (unsigned b = 0; b < nsents; ++b) {
+      st[b].action_s = action_s0;
+      st[b].bsize = gs[b].buffer.size();
+      st[b].stack.push_back(stack_guard);
+      st[b].stacki.push_back(-999); // not used for anything
+      st[b].stack_s.push_back(stack_s0);
+      st[b].is_open_paren.push_back(-1); // corresponds to dummy symbol
+      st[b].nopen_parens = 0;
+      st[b].prev_a = '0';
+      st[b].action_count = 0;
+    }
+
+    vector<Prediction> predictions;
+    vector<Expression> step_scores;
+    vector<Expression> log_probs;
+    vector<unsigned> active;
+    for (unsigned b = 0; b < nsents; ++b)
+      if (!st[b].is_final()) active.push_back(b);
+    while (active.size() > 0) {
+      const unsigned n = active.size();
+      vector<Expression> stack_summaries(n), buffer_summaries(n), action_summaries(n);
+      for (unsigned j = 0; j < n; ++j) {
+        const LockstepState& s = st[active[j]];
+        stack_summaries[j] = s.stack_s.back().back();
+        action_summaries[j] = s.action_s.back();
+        buffer_summaries[j] = pick_batch_elem(buffer_h[s.bsize - 1], active[j]);
+      }
+      Expression stack_summary = concatenate_to_batch(stack_summaries);
+      Expression buffer_summary = concatenate_to_batch(buffer_summaries);
+      Expression action_summary = concatenate_to_batch(action_summaries);
+      if (params.apply_dropout) {
+        stack_summary = dropout(stack_summary, DROPOUT);
+        buffer_summary = dropout(buffer_summary, DROPOUT);
+        action_summary = dropout(action_summary, DROPOUT);
+      }
+      Expression r_t = action_scores(params, stack_summary, buffer_summary, action_summary);
+      step_scores.push_back(r_t);
+
+      vector<unsigned> actions(n);
+      for (unsigned j = 0; j < n; ++j) {
+        LockstepState& s = st[active[j]];
+        const vector<int>& oracle = *correct_actions[active[j]];
+        if (s.action_count >= oracle.size()) {
           cerr << "Correct action list exhausted, but not in final parser state.\n";
           abort();
         }
-        action = correct_actions[action_count];
-        if (model_action == action) { (*right)++; }
+        actions[j] = oracle[s.action_count++];
+        predictions.push_back(Prediction{(unsigned) step_scores.size() - 1, j, vector<unsigned>(), actions[j]});
+        valid_actions(s, &predictions.back().valid);
+        Expression adiste = log_softmax(pick_batch_elem(r_t, j), predictions.back().valid);
+        log_probs.push_back(pick(adiste, actions[j]));
+        s.results.push_back(actions[j]);
       }
-      ++action_count;
-      log_probs.push_back(pick(adiste, action));
-      results.push_back(action);
 
-      // add current action to action LSTM
-      Expression actione = lookup(*hg, p_a, action);
-      action_lstm.add_input(actione);
-
-      // do action
-      const string& actionString=adict.Convert(action);
-      const char ac = actionString[0];
-      const char ac2 = actionString[1];
-      prev_a = ac;
-
-      if (ac =='S' && ac2=='H') {  // SHIFT
-        assert(buffer.size() > 1); // dummy symbol means > 1 (not >= 1)
-        if (IMPLICIT_REDUCE_AFTER_SHIFT) {
-          --nopen_parens;
-          int i = is_open_paren.size() - 1;
-          assert(is_open_paren[i] >= 0);
-          Expression nonterminal = lookup(*hg, p_ntup, is_open_paren[i]);
-          Expression terminal = buffer.back();
-          Expression c = concatenate({nonterminal, terminal});
-          Expression pt = rectify(affine_transform({ptbias, ptW, c}));
-          stack.pop_back();
-          stacki.pop_back();
-          stack_lstm.rewind_one_step();
-          buffer.pop_back();
-          bufferi.pop_back();
-          buffer_lstm->rewind_one_step();
-          is_open_paren.pop_back();
-          stack_lstm.add_input(pt);
-          stack.push_back(pt);
-          stacki.push_back(999);
-          is_open_paren.push_back(-1);
-        } else {
-          stack.push_back(buffer.back());
-          stack_lstm.add_input(buffer.back());
-          stacki.push_back(bufferi.back());
-          buffer.pop_back();
-          buffer_lstm->rewind_one_step();
-          bufferi.pop_back();
-          is_open_paren.push_back(-1);
+      // add the actions to the action LSTM
+      vector<const vector<Expression>*> prev(n);
+      vector<vector<Expression>> next;
+      for (unsigned j = 0; j < n; ++j) prev[j] = &st[active[j]].action_s;
+      batched_lstm_step(action_lstm, prev, lookup(*hg, p_a, actions), &next);
+      for (unsigned j = 0; j < n; ++j) st[active[j]].action_s = next[j];
+
+      // pop what the actions consume from the stacks, collecting the
+      // constituents closed by REDUCE actions
+      vector<Expression> pushed(n);
+      vector<unsigned> reducing; // indices into active
+      vector<vector<Expression>> fwd_inputs, rev_inputs;
+      for (unsigned j = 0; j < n; ++j) {
+        LockstepState& s = st[active[j]];
+        const SentenceGraph& g = gs[active[j]];
+        const string& actionString = adict.Convert(actions[j]);
+        const char ac = actionString[0];
+        const char ac2 = actionString[1];
+        s.prev_a = ac;
+        if (ac =='S' && ac2=='H') {  // SHIFT
+          assert(s.bsize > 1); // dummy symbol means > 1 (not >= 1)
+          const Expression& terminal = g.buffer[s.bsize - 1];
+          if (IMPLICIT_REDUCE_AFTER_SHIFT) {
+            --s.nopen_parens;
+            int i = s.is_open_paren.size() - 1;
+            assert(s.is_open_paren[i] >= 0);
+            Expression nonterminal = lookup(*hg, p_ntup, s.is_open_paren[i]);
+            Expression c = concatenate({nonterminal, terminal});
+            pushed[j] = rectify(affine_transform({g.ptbias, g.ptW, c}));
+            s.stack.pop_back();
+            s.stacki.pop_back();
+            s.stack_s.pop_back();
+            s.is_open_paren.pop_back();
+            s.stacki.push_back(999);
+          } else {
+            pushed[j] = terminal;
+            s.stacki.push_back(g.bufferi[s.bsize - 1]);
+          }
+          s.is_open_paren.push_back(-1);
+          --s.bsize;
+        } else if (ac == 'N') { // NT
+          ++s.nopen_parens;
+          assert(s.bsize > 1);
+          auto it = action2NTindex.find(actions[j]);
+          assert(it != action2NTindex.end());
+          int nt_index = it->second;
+          pushed[j] = lookup(*hg, p_nt, nt_index);
+          s.stacki.push_back(-1);
+          s.is_open_paren.push_back(nt_index);
+        } else { // REDUCE
+          --s.nopen_parens;
+          assert(s.stack.size() > 2); // dummy symbol means > 2 (not >= 2)
+          // find what paren we are closing
+          int i = s.is_open_paren.size() - 1;
+          while(s.is_open_paren[i] < 0) { --i; assert(i >= 0); }
+          Expression nonterminal = lookup(*hg, p_ntup, s.is_open_paren[i]);
+          int nchildren = s.is_open_paren.size() - i - 1;
+          assert(nchildren > 0);
+          fwd_inputs.push_back(vector<Expression>(nchildren + 1));
+          rev_inputs.push_back(vector<Expression>(nchildren + 1));
+          fwd_inputs.back()[0] = rev_inputs.back()[0] = nonterminal;
+          for (i = 0; i < nchildren; ++i) {
+            fwd_inputs.back()[i + 1] = rev_inputs.back()[nchildren - i] = s.stack.back();
+            assert (s.stacki.back() != -1);
+            s.stacki.pop_back();
+            s.stack.pop_back();
+            s.stack_s.pop_back();
+            s.is_open_paren.pop_back();
+          }
+          s.is_open_paren.pop_back(); // nt symbol
+          assert (s.stacki.back() == -1);
+          s.stacki.pop_back(); // nonterminal dummy
+          s.stack.pop_back(); // nonterminal dummy
+          s.stack_s.pop_back(); // nt symbol
+          s.stacki.push_back(999); // who knows, should get rid of this
+          s.is_open_paren.push_back(-1); // we just closed a paren at this position
+          reducing.push_back(j);
         }
-      } else if (ac == 'N') { // NT
-        ++nopen_parens;
-        assert(buffer.size() > 1);
-        auto it = action2NTindex.find(action);
-        assert(it != action2NTindex.end());
-        int nt_index = it->second;
-        nt_count++;
-        Expression nt_embedding = lookup(*hg, p_nt, nt_index);
-        stack.push_back(nt_embedding);
-        stack_lstm.add_input(nt_embedding);
-        stacki.push_back(-1);
-        is_open_paren.push_back(nt_index);
-      } else { // REDUCE
-        --nopen_parens;
-        assert(stack.size() > 2); // dummy symbol means > 2 (not >= 2)
-        // find what paren we are closing
-        int i = is_open_paren.size() - 1;
-        while(is_open_paren[i] < 0) { --i; assert(i >= 0); }
-        Expression nonterminal = lookup(*hg, p_ntup, is_open_paren[i]);
-        int nchildren = is_open_paren.size() - i - 1;
-        assert(nchildren > 0);
-        vector<Expression> children(nchildren);
+      }
+
+      // build the tree embeddings of all closed constituents with the bidir
+      // LSTM; shorter sequences are padded at the end
+      if (reducing.size() > 0) {
+        const unsigned nr = reducing.size();
+        unsigned max_children = 0;
+        for (auto& in : fwd_inputs) max_children = max(max_children, (unsigned) in.size());
+        vector<Expression> fwd_h(max_children), rev_h(max_children);
+        vector<Expression> fx(nr), rx(nr);
         const_lstm_fwd.start_new_sequence();
         const_lstm_rev.start_new_sequence();
+        for (unsigned t = 0; t < max_children; ++t) {
+          for (unsigned k = 0; k < nr; ++k) {
+            const unsigned tk = min(t, (unsigned) fwd_inputs[k].size() - 1);
+            fx[k] = fwd_inputs[k][tk];
+            rx[k] = rev_inputs[k][tk];
+          }
+          const_lstm_fwd.add_input(nr == 1 ? fx[0] : concatenate_to_batch(fx));
+          const_lstm_rev.add_input(nr == 1 ? rx[0] : concatenate_to_batch(rx));
+          fwd_h[t] = const_lstm_fwd.back();
+          rev_h[t] = const_lstm_rev.back();
+        }
+        for (unsigned k = 0; k < nr; ++k) {
+          const unsigned last = fwd_inputs[k].size() - 1;
+          Expression cfwd = (nr == 1 ? fwd_h[last] : pick_batch_elem(fwd_h[last], k));
+          Expression crev = (nr == 1 ? rev_h[last] : pick_batch_elem(rev_h[last], k));
+          if (params.apply_dropout) {
+            cfwd = dropout(cfwd, DROPOUT);
+            crev = dropout(crev, DROPOUT);
+          }
+          Expression c = concatenate({cfwd, crev});
+          pushed[reducing[k]] = rectify(affine_transform({params.cbias, params.cW, c}));
+        }
+      }
+
+      // every action pushes exactly one symbol onto the stack
+      for (unsigned j = 0; j < n; ++j) prev[j] = &st[active[j]].stack_s.back();
+      batched_lstm_step(stack_lstm, prev, concatenate_to_batch(pushed), &next);
+      vector<unsigned> still_active;
+      for (unsigned j = 0; j < n; ++j) {
+        LockstepState& s = st[active[j]];
+        s.stack.push_back(pushed[j]);
+        s.stack_s.push_back(next[j]);
+        if (!s.is_final()) still_active.push_back(active[j]);
+      }
+      active.swap(still_active);
+    }
+    for (unsigned b = 0; b < nsents; ++b) {
+      if (st[b].action_count != correct_actions[b]->size()) {
+        cerr << "Unexecuted actions remain but final state reached!\n";
+        abort();
+      }
+      assert(st[b].stack.size() == 2); // guard symbol, root
+      assert(st[b].bsize == 1); // guard symbol
+    }
+    // the loss, the mean over the sentences, is the last node of the graph,
+    // which the caller evaluates and backpropagates from
+    -sum(log_probs) / nsents;
 
-        // REMOVE EVERYTHING FROM THE STACK THAT IS GOING
-        // TO BE COMPOSED INTO A TREE EMBEDDING
-        for (i = 0; i < nchildren; ++i) {
-          children[i] = stack.back();
-          assert (stacki.back() != -1);
-          stacki.pop_back();
-          stack.pop_back();
-          stack_lstm.rewind_one_step();
-          is_open_paren.pop_back();
+    if (right) {
+      hg->incremental_forward();
+      count_right(predictions, step_scores, right);
+    }
+  }
+
+  // greedy decoding of several sentences in one graph: at every step the
+  // action scores of all unfinished sentences are computed as one mini-batch
+  vector<vector<unsigned>> decode_batch(ComputationGraph* hg,
+                                        const vector<const parser::Sentence*>& sents) {
+    const unsigned nsents = sents.size();
+    SentenceGraph params;
+    new_graph(hg, false, &params);
+    vector<SentenceGraph> gs(nsents, params);
+    vector<ParserState> st(nsents);
+    vector<unsigned> active;
+    for (unsigned b = 0; b < nsents; ++b) {
+      embed_sentence(hg, *sents[b], false, &gs[b]);
+      // every buffer is a separate sequence of the buffer LSTM
+      add_buffer(gs[b]);
+      st[b] = initial_state(hg, gs[b]);
+      if (!st[b].is_final()) active.push_back(b);
+    }
+    vector<unsigned> current_valid_actions;
+    while (active.size() > 0) {
+      const unsigned n = active.size();
+      vector<Expression> stack_summaries(n), buffer_summaries(n), action_summaries(n);
+      for (unsigned j = 0; j < n; ++j)
+        state_summaries(gs[active[j]], st[active[j]], &stack_summaries[j], &buffer_summaries[j], &action_summaries[j]);
+      action_scores(params, concatenate_to_batch(stack_summaries), concatenate_to_batch(buffer_summaries),
+                    concatenate_to_batch(action_summaries));
+      const vector<float> scores = as_vector(hg->incremental_forward());
+      vector<unsigned> still_active;
+      for (unsigned j = 0; j < n; ++j) {
+        ParserState& s = st[active[j]];
+        valid_actions(s, &current_valid_actions);
+        const float* r = &scores[j * ACTION_SIZE];
+        unsigned model_action = current_valid_actions[0];
+        for (unsigned i = 1; i < current_valid_actions.size(); ++i)
+          if (r[current_valid_actions[i]] > r[model_action]) model_action = current_valid_actions[i];
+        apply_action(hg, gs[active[j]], s, model_action);
+        if (!s.is_final()) still_active.push_back(active[j]);
+      }
+      active.swap(still_active);
+    }
+    vector<vector<unsigned>> results(nsents);
+    for (unsigned b = 0; b < nsents; ++b) results[b] = st[b].results;
+    return results;
+  }
+
+  // draws n parses of sent, with the action distributions flattened or
+  // sharpened by ALPHA. the sentence is encoded once, and the unfinished
+  // samples are scored together as one mini-batch at every step.
+  // the log probability of every sample is returned in *log_probs
+  vector<vector<unsigned>> sample_parser(ComputationGraph* hg,
+                                         const parser::Sentence& sent,
+                                         unsigned n,
+                                         vector<double>* log_probs) {
+    SentenceGraph g;
+    new_sentence_graph(hg, sent, false, false, &g);
+    vector<ParserState> st(n, initial_state(hg, g));
+    log_probs->assign(n, 0.0);
+    vector<unsigned> active;
+    for (unsigned i = 0; i < n; ++i)
+      if (!st[i].is_final()) active.push_back(i);
+    vector<unsigned> current_valid_actions;
+    while (active.size() > 0) {
+      const unsigned m = active.size();
+      vector<Expression> stack_summaries(m), buffer_summaries(m), action_summaries(m);
+      for (unsigned j = 0; j < m; ++j)
+        state_summaries(g, st[active[j]], &stack_summaries[j], &buffer_summaries[j], &action_summaries[j]);
+      Expression r_t = action_scores(g, concatenate_to_batch(stack_summaries), concatenate_to_batch(buffer_summaries),
+                                     concatenate_to_batch(action_summaries));
+      if (ALPHA != 1.0f) r_t = r_t * ALPHA;
+      const vector<float> scores = as_vector(hg->incremental_forward());
+      vector<unsigned> still_active;
+      for (unsigned j = 0; j < m; ++j) {
+        ParserState& s = st[active[j]];
+        valid_actions(s, &current_valid_actions);
+        const float* r = &scores[j * ACTION_SIZE];
+        // normalize over the valid actions
+        float max_r = r[current_valid_actions[0]];
+        for (auto a : current_valid_actions) max_r = max(max_r, r[a]);
+        double z = 0;
+        for (auto a : current_valid_actions) z += exp(r[a] - max_r);
+        const double log_z = max_r + log(z);
+        double p = rand01();
+        unsigned w = 0;
+        for (; w < current_valid_actions.size(); ++w) {
+          p -= exp(r[current_valid_actions[w]] - log_z);
+          if (p < 0.0) { break; }
         }
-        is_open_paren.pop_back(); // nt symbol
-        assert (stacki.back() == -1);
-        stacki.pop_back(); // nonterminal dummy
-        stack.pop_back(); // nonterminal dummy
-        stack_lstm.rewind_one_step(); // nt symbol
-
-        // BUILD TREE EMBEDDING USING BIDIR LSTM
-        const_lstm_fwd.add_input(nonterminal);
-        const_lstm_rev.add_input(nonterminal);
-        for (i = 0; i < nchildren; ++i) {
-          const_lstm_fwd.add_input(children[i]);
-          const_lstm_rev.add_input(children[nchildren - i - 1]);
+        if (w == current_valid_actions.size()) w--;
+        const unsigned action = current_valid_actions[w];
+        (*log_probs)[active[j]] += r[action] - log_z;
+        apply_action(hg, g, s, action);
+        if (!s.is_final()) still_active.push_back(active[j]);
+      }
+      active.swap(still_active);
+    }
+    vector<vector<unsigned>> results(n);
+    for (unsigned i = 0; i < n; ++i) results[i] = st[i].results;
+    return results;
+  }
+
+  // draws n distinct parses of sent without replacement, from the same
+  // distribution as sample_parser, with Gumbel-top-k sampling done as a
+  // stochastic beam search (Kool et al., 2019): every hypothesis has a
+  // Gumbel-perturbed log probability, the perturbations of its extensions
+  // are conditioned on their maximum being its own, and the n extensions
+  // (or completed parses) with the largest perturbed log probabilities are
+  // kept. returns fewer parses if sent has fewer than n, best perturbed
+  // score first, with their log probabilities in *log_probs
+  vector<vector<unsigned>> sample_parser_without_replacement(ComputationGraph* hg,
+                                                             const parser::Sentence& sent,
+                                                             unsigned n,
+                                                             vector<double>* log_probs) {
+    SentenceGraph g;
+    new_sentence_graph(hg, sent, false, false, &g);
+    vector<ParserState> beam(1, initial_state(hg, g));
+    vector<double> perturbed(1, 0.0);
+    struct Candidate {
+      unsigned hyp;
+      int action; // -1 keeps the completed parse hyp
+      double score;
+      double perturbed;
+    };
+    vector<Candidate> candidates;
+    vector<unsigned> current_valid_actions;
+    vector<double> lp, gumbel;
+    while (true) {
+      vector<unsigned> active;
+      for (unsigned k = 0; k < beam.size(); ++k)
+        if (!beam[k].is_final()) active.push_back(k);
+      if (active.empty()) break;
+      const unsigned m = active.size();
+      vector<Expression> stack_summaries(m), buffer_summaries(m), action_summaries(m);
+      for (unsigned j = 0; j < m; ++j)
+        state_summaries(g, beam[active[j]], &stack_summaries[j], &buffer_summaries[j], &action_summaries[j]);
+      Expression r_t = action_scores(g, concatenate_to_batch(stack_summaries), concatenate_to_batch(buffer_summaries),
+                                     concatenate_to_batch(action_summaries));
+      if (ALPHA != 1.0f) r_t = r_t * ALPHA;
+      const vector<float> scores = as_vector(hg->incremental_forward());
+      candidates.clear();
+      for (unsigned k = 0; k < beam.size(); ++k)
+        if (beam[k].is_final()) candidates.push_back(Candidate{k, -1, beam[k].score, perturbed[k]});
+      for (unsigned j = 0; j < m; ++j) {
+        const unsigned k = active[j];
+        valid_actions(beam[k], &current_valid_actions);
+        const float* r = &scores[j * ACTION_SIZE];
+        float max_r = r[current_valid_actions[0]];
+        for (auto a : current_valid_actions) max_r = max(max_r, r[a]);
+        double z = 0;
+        for (auto a : current_valid_actions) z += exp(r[a] - max_r);
+        const double log_z = max_r + log(z);
+        const unsigned na = current_valid_actions.size();
+        lp.resize(na);
+        gumbel.resize(na);
+        double max_gumbel = -numeric_limits<double>::infinity();
+        for (unsigned i = 0; i < na; ++i) {
+          lp[i] = beam[k].score + r[current_valid_actions[i]] - log_z;
+          double u;
+          do { u = rand01(); } while (u <= 0.0);
+          gumbel[i] = lp[i] - log(-log(u));
+          max_gumbel = max(max_gumbel, gumbel[i]);
         }
-        Expression cfwd = const_lstm_fwd.back();
-        Expression crev = const_lstm_rev.back();
-        if (apply_dropout) {
-          cfwd = dropout(cfwd, DROPOUT);
-          crev = dropout(crev, DROPOUT);
+        for (unsigned i = 0; i < na; ++i) {
+          // -log(exp(-perturbed[k]) - exp(-max_gumbel) + exp(-gumbel[i])),
+          // computed stably
+          const double d = gumbel[i] - max_gumbel;
+          const double log1mexp = d == 0 ? -numeric_limits<double>::infinity() :
+              (d > -0.693 ? log(-expm1(d)) : log1p(-exp(d)));
+          const double v = perturbed[k] - gumbel[i] + log1mexp;
+          const double pk = perturbed[k] - max(0.0, v) - log1p(exp(-fabs(v)));
+          candidates.push_back(Candidate{k, (int) current_valid_actions[i], lp[i], pk});
         }
-        Expression c = concatenate({cfwd, crev});
-        Expression composed = rectify(affine_transform({cbias, cW, c}));
-        stack_lstm.add_input(composed);
-        stack.push_back(composed);
-        stacki.push_back(999); // who knows, should get rid of this
-        is_open_paren.push_back(-1); // we just closed a paren at this position
       }
+      const unsigned keep = min((size_t) n, candidates.size());
+      partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(),
+                   [](const Candidate& a, const Candidate& b) { return a.perturbed > b.perturbed; });
+      vector<ParserState> next(keep);
+      vector<double> next_perturbed(keep);
+      for (unsigned j = 0; j < keep; ++j) {
+        const Candidate& cand = candidates[j];
+        next[j] = beam[cand.hyp];
+        if (cand.action >= 0) apply_action(hg, g, next[j], cand.action);
+        next[j].score = cand.score;
+        next_perturbed[j] = cand.perturbed;
+      }
+      beam.swap(next);
+      perturbed.swap(next_perturbed);
     }
-    if (build_training_graph && action_count != correct_actions.size()) {
+    vector<vector<unsigned>> results(beam.size());
+    log_probs->resize(beam.size());
+    for (unsigned k = 0; k < beam.size(); ++k) {
+      results[k] = beam[k].results;
+      (*log_probs)[k] = beam[k].score;
+    }
+    return results;
+  }
+
+  // action-synchronous beam search; all hypotheses share the encoded buffer
+  // and are scored together as one mini-batch at each step.
+  // sets *nlp to the negative log probability of the returned parse
+  vector<unsigned> beam_search_parser(ComputationGraph* hg,
+                                      const parser::Sentence& sent,
+                                      unsigned beam_size,
+                                      double *nlp) {
+    SentenceGraph g;
+    new_sentence_graph(hg, sent, false, false, &g);
+    return run_beam_search(hg, g, beam_size, nlp);
+  }
+
+  // beam_search_parser for a sentence that has already been encoded in g
+  vector<unsigned> run_beam_search(ComputationGraph* hg,
+                                   const SentenceGraph& g,
+                                   unsigned beam_size,
+                                   double *nlp) {
+    vector<ParserState> beam(1, initial_state(hg, g));
+    vector<ParserState> completed;
+    struct Candidate {
+      unsigned hyp;
+      unsigned action;
+      double score;
+    };
+    vector<Candidate> candidates;
+    vector<unsigned> current_valid_actions;
+    while (beam.size() > 0 && completed.size() < beam_size) {
+      vector<Expression> stack_summaries(beam.size());
+      vector<Expression> buffer_summaries(beam.size());
+      vector<Expression> action_summaries(beam.size());
+      for (unsigned k = 0; k < beam.size(); ++k)
+        state_summaries(g, beam[k], &stack_summaries[k], &buffer_summaries[k], &action_summaries[k]);
+      action_scores(g, concatenate_to_batch(stack_summaries),
+                    concatenate_to_batch(buffer_summaries),
+                    concatenate_to_batch(action_summaries));
+      // scores of hypothesis k are in [k * ACTION_SIZE, (k + 1) * ACTION_SIZE)
+      vector<float> r = as_vector(hg->incremental_forward());
+      candidates.clear();
+      for (unsigned k = 0; k < beam.size(); ++k) {
+        valid_actions(beam[k], &current_valid_actions);
+        const float* rk = &r[k * ACTION_SIZE];
+        float m = rk[current_valid_actions[0]];
+        for (auto a : current_valid_actions) m = max(m, rk[a]);
+        double z = 0;
+        for (auto a : current_valid_actions) z += exp(rk[a] - m);
+        const double logz = m + log(z);
+        for (auto a : current_valid_actions)
+          candidates.push_back(Candidate{k, a, beam[k].score + rk[a] - logz});
+      }
+      const unsigned n = min((size_t) beam_size - completed.size(), candidates.size());
+      partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(),
+                   [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+      vector<ParserState> next;
+      for (unsigned j = 0; j < n; ++j) {
+        const Candidate& cand = candidates[j];
+        ParserState st = beam[cand.hyp];
+        apply_action(hg, g, st, cand.action);
+        st.score = cand.score;
+        if (st.is_final())
+          completed.push_back(st);
+        else
+          next.push_back(st);
+      }
+      beam.swap(next);
+    }
+    assert(completed.size() > 0);
+    const ParserState* best = &completed[0];
+    for (auto& st : completed)
+      if (st.score > best->score) best = &st;
+    assert(best->stack.size() == 2); // guard symbol, root
+    assert(best->bsize == 1); // guard symbol
+    *nlp = -best->score;
+    return best->results;
+  }
+
+  // for dev and test evaluation: encodes sent once, and from that encoding
+  // both scores correct_actions, setting *gold_nlp to their negative log
+  // probability (and counting correct predictions in *right), and decodes
+  // greedily or, if beam_size > 1, with beam search, setting *pred_nlp to the
+  // negative log probability of the decoded parse.
+  // greedy decoding follows the gold parse up to its first wrong prediction,
+  // so it is only continued separately from there
+  vector<unsigned> evaluate_parser(ComputationGraph* hg,
+                                   const parser::Sentence& sent,
+                                   const vector<int>& correct_actions,
+                                   unsigned beam_size,
+                                   double *right,
+                                   double *gold_nlp,
+                                   double *pred_nlp) {
+    SentenceGraph g;
+    new_sentence_graph(hg, sent, false, false, &g);
+    ParserState st = initial_state(hg, g);
+    ParserState pred; // the greedy parse, once it has left the gold parse
+    bool diverged = false;
+    vector<Expression> log_probs;
+    vector<Expression> pred_log_probs; // of the greedy parse, up to pred
+    unsigned action_count = 0;
+    vector<unsigned> current_valid_actions;
+    while(!st.is_final()) {
+      valid_actions(st, &current_valid_actions);
+      Expression stack_summary, buffer_summary, action_summary;
+      state_summaries(g, st, &stack_summary, &buffer_summary, &action_summary);
+      Expression adiste = action_log_probs(g, stack_summary, buffer_summary, action_summary, current_valid_actions);
+      vector<float> adist = as_vector(hg->incremental_forward());
+      unsigned model_action = current_valid_actions[0];
+      for (unsigned i = 1; i < current_valid_actions.size(); ++i)
+        if (adist[current_valid_actions[i]] > adist[model_action])
+          model_action = current_valid_actions[i];
+      if (action_count >= correct_actions.size()) {
+        cerr << "Correct action list exhausted, but not in final parser state.\n";
+        abort();
+      }
+      unsigned action = correct_actions[action_count++];
+      if (model_action == action) {
+        (*right)++;
+      } else if (!diverged && beam_size == 1) {
+        pred = st;
+        apply_action(hg, g, pred, model_action);
+        diverged = true;
+        pred_log_probs = log_probs;
+        pred_log_probs.push_back(pick(adiste, model_action));
+      }
+      log_probs.push_back(pick(adiste, action));
+      apply_action(hg, g, st, action);
+    }
+    if (action_count != correct_actions.size()) {
       cerr << "Unexecuted actions remain but final state reached!\n";
       abort();
     }
-    assert(stack.size() == 2); // guard symbol, root
-    assert(stacki.size() == 2);
-    assert(buffer.size() == 1); // guard symbol
-    assert(bufferi.size() == 1);
     Expression tot_neglogprob = -sum(log_probs);
-    assert(tot_neglogprob.pg != nullptr);
+    *gold_nlp = as_scalar(tot_neglogprob.value());
+    vector<unsigned> results;
+    if (beam_size > 1) {
+      results = run_beam_search(hg, g, beam_size, pred_nlp);
+    } else if (!diverged) {
+      results = st.results;
+      *pred_nlp = *gold_nlp;
+    } else {
+      Expression prefix_nlp = -sum(pred_log_probs);
+      results = run_parser(hg, g, pred, vector<int>(), right, false);
+      *pred_nlp = as_scalar(hg->incremental_forward()) + as_scalar(prefix_nlp.value());
+    }
     return results;
   }
-
 };
 
+// what is saved with binary models besides the parameters: the
+// vocabularies, the model options and the words that have pretrained
+// embeddings or are not UNKed, so that the model can be used without the
+// training oracle
+const unsigned kModelBundleVersion = 1;
+
+string ModelBundle(const unordered_set<string>& train_words) {
+  vector<unsigned> pretrained_words;
+  for (auto& p : pretrained) pretrained_words.push_back(p.first);
+  sort(pretrained_words.begin(), pretrained_words.end());
+  vector<string> words(train_words.begin(), train_words.end());
+  sort(words.begin(), words.end());
+  unsigned implicit_reduce_after_shift = IMPLICIT_REDUCE_AFTER_SHIFT;
+  bool use_pos = USE_POS;
+  ostringstream os;
+  boost::archive::text_oarchive oa(os);
+  oa << kModelBundleVersion;
+  oa << termdict << ntermdict << adict << posdict;
+  oa << LAYERS << INPUT_DIM << HIDDEN_DIM << ACTION_DIM << PRETRAINED_DIM << LSTM_INPUT_DIM << POS_DIM;
+  oa << implicit_reduce_after_shift << use_pos;
+  oa << pretrained_words << words;
+  return os.str();
+}
+
+void LoadModelBundle(const string& model_file, unordered_set<string>* train_words) {
+  string bundle;
+  if (cnn::is_binary_cnn_model(model_file)) bundle = cnn::read_cnn_model_metadata(model_file);
+  if (bundle.empty()) {
+    cerr << model_file << " does not include the vocabularies: please specify the training oracle with -T\n";
+    exit(1);
+  }
+  cerr << "Loading vocabularies and model options from " << model_file << endl;
+  istringstream is(bundle);
+  boost::archive::text_iarchive ia(is);
+  unsigned version;
+  ia >> version;
+  if (version != kModelBundleVersion) {
+    cerr << "Unsupported model bundle version " << version << " in " << model_file << endl;
+    exit(1);
+  }
+  vector<unsigned> pretrained_words;
+  vector<string> words;
+  ia >> termdict >> ntermdict >> adict >> posdict;
+  ia >> LAYERS >> INPUT_DIM >> HIDDEN_DIM >> ACTION_DIM >> PRETRAINED_DIM >> LSTM_INPUT_DIM >> POS_DIM;
+  ia >> IMPLICIT_REDUCE_AFTER_SHIFT >> USE_POS;
+  ia >> pretrained_words >> words;
+  pretrained.clear();
+  for (auto w : pretrained_words) pretrained[w]; // the values are model parameters
+  train_words->clear();
+  train_words->insert(words.begin(), words.end());
+}
+
+// the bracketed tree built by a sequence of parser actions, with tags[i] as
+// the preterminal of words[i] (unless preterminals are predicted as
+// nonterminals)
+string TreeString(const vector<unsigned>& actions, const vector<string>& words, const vector<string>& tags) {
+  ostringstream os;
+  unsigned ti = 0;
+  for (auto a : actions) {
+    const string& as = adict.Convert(a);
+    if (as[0] == 'N') {
+      os << " (" << ntermdict.Convert(action2NTindex.find(a)->second);
+    } else if (as[0] == 'S') {
+      if (IMPLICIT_REDUCE_AFTER_SHIFT)
+        os << ' ' << words[ti] << ')';
+      else
+        os << " (" << tags[ti] << ' ' << words[ti] << ')';
+      ++ti;
+    } else os << ')';
+  }
+  return os.str().substr(1);
+}
+
 void signal_callback_handler(int /* signum */) {
   if (requested_stop) {
     cerr << "\nReceived SIGINT again, quitting.\n";
@@ -537,6 +1551,14 @@ int main(int argc, char** argv) {
     cerr << "You specified --train but did not specify --dev_data FILE\n";
     return 1;
   }
+  if (conf.count("train") && conf.count("bracketing_dev_data") == 0) {
+    cerr << "You specified --train but did not specify --bracketing_dev_data FILE\n";
+    return 1;
+  }
+  if (conf.count("train") && conf.count("training_data") == 0) {
+    cerr << "You specified --train but did not specify --training_data FILE\n";
+    return 1;
+  }
   if (conf.count("alpha")) {
     ALPHA = conf["alpha"].as<float>();
     if (ALPHA <= 0.f) { cerr << "--alpha must be between 0 and +infty\n"; abort(); }
@@ -545,6 +1567,17 @@ int main(int argc, char** argv) {
     N_SAMPLES = conf["samples"].as<unsigned>();
     if (N_SAMPLES == 0) { cerr << "Please specify N>0 samples\n"; abort(); }
   }
+  const bool unique_samples = conf.count("unique_samples") > 0;
+  const bool without_replacement = conf.count("without_replacement") > 0;
+  if ((unique_samples || without_replacement) && conf.count("samples") == 0) {
+    cerr << "--unique_samples and --without_replacement require --samples N\n";
+    return 1;
+  }
+  const unsigned beam_size = conf["beam_size"].as<unsigned>();
+  if (beam_size == 0) { cerr << "--beam_size must be at least 1\n"; abort(); }
+  const unsigned batch_size = conf["batch_size"].as<unsigned>();
+  if (batch_size == 0) { cerr << "--batch_size must be at least 1\n"; abort(); }
+  const unsigned eval_workers = conf["eval_workers"].as<unsigned>();
 
   ostringstream os;
   os << conf["model_dir"].as<string>() << "/"
@@ -566,29 +1599,37 @@ int main(int argc, char** argv) {
   parser::TopDownOracle corpus(&termdict, &adict, &posdict, &ntermdict);
   parser::TopDownOracle dev_corpus(&termdict, &adict, &posdict, &ntermdict);
   parser::TopDownOracle test_corpus(&termdict, &adict, &posdict, &ntermdict);
-  corpus.load_oracle(conf["training_data"].as<string>(), true);
-  corpus.load_bdata(conf["bracketing_dev_data"].as<string>());
-
-  if (conf.count("words"))
-    parser::ReadEmbeddings_word2vec(conf["words"].as<string>(), &termdict, &pretrained);
-
-  // freeze dictionaries so we don't accidentaly load OOVs
-  termdict.Freeze();
-  termdict.SetUnk("UNK"); // we don't actually expect to use this often
-  // since the Oracles are required to be "pre-UNKified", but this prevents
-  // problems with UNKifying the lowercased data which needs to be loaded
-  adict.Freeze();
-  ntermdict.Freeze();
-  posdict.Freeze();
-
-  {  // compute the singletons in the parser's training data
-    unordered_map<unsigned, unsigned> counts;
-    for (auto& sent : corpus.sents)
-      for (auto word : sent.raw) counts[word]++;
-    singletons.resize(termdict.size(), false);
-    for (auto wc : counts)
-      if (wc.second == 1) singletons[wc.first] = true;
+  unordered_set<string> train_words; // training words that are not UNKed
+  if (conf.count("training_data")) {
+    corpus.load_oracle(conf["training_data"].as<string>(), true);
+
+    if (conf.count("words"))
+      parser::ReadEmbeddings_word2vec(conf["words"].as<string>(), &termdict, &pretrained);
+
+    // freeze dictionaries so we don't accidentaly load OOVs
+    termdict.Freeze();
+    termdict.SetUnk("UNK"); // we don't actually expect to use this often
+    // since the Oracles are required to be "pre-UNKified", but this prevents
+    // problems with UNKifying the lowercased data which needs to be loaded
+    adict.Freeze();
+    ntermdict.Freeze();
+    posdict.Freeze();
+
+    {  // compute the singletons in the parser's training data
+      unordered_map<unsigned, unsigned> counts;
+      for (auto& sent : corpus.sents)
+        for (auto word : sent.raw) counts[word]++;
+      singletons.resize(termdict.size(), false);
+      for (auto wc : counts) {
+        if (wc.second == 1) singletons[wc.first] = true;
+        else train_words.insert(termdict.Convert(wc.first));
+      }
+    }
+  } else {
+    LoadModelBundle(conf["model"].as<string>(), &train_words);
   }
+  if (conf.count("bracketing_dev_data"))
+    corpus.load_bdata(conf["bracketing_dev_data"].as<string>());
 
   if (conf.count("dev_data")) {
     cerr << "Loading validation set\n";
@@ -598,6 +1639,21 @@ int main(int argc, char** argv) {
     cerr << "Loading test set\n";
     test_corpus.load_oracle(conf["test_data"].as<string>(), false);
   }
+  // gold trees of the dev and test sets, for computing F1 (which is skipped
+  // for a set without them): -C holds those of the dev set, and unless they
+  // are given with --bracketing_test_data, also those of the test set
+  vector<parser::EvalTree> dev_trees, test_trees;
+  if (dev_corpus.size() > 0 && conf.count("bracketing_dev_data"))
+    parser::ReadEvalTrees(conf["bracketing_dev_data"].as<string>(), dev_corpus.size(), &dev_trees);
+  if (test_corpus.size() > 0) {
+    if (conf.count("bracketing_test_data"))
+      parser::ReadEvalTrees(conf["bracketing_test_data"].as<string>(), test_corpus.size(), &test_trees);
+    else if (conf.count("bracketing_dev_data")) {
+      if (dev_corpus.size() > 0)
+        cerr << "Warning: no --bracketing_test_data given, scoring the test set against -C\n";
+      parser::ReadEvalTrees(conf["bracketing_dev_data"].as<string>(), test_corpus.size(), &test_trees);
+    }
+  }
 
   for (unsigned i = 0; i < adict.size(); ++i) {
     const string& a = adict.Convert(i);
@@ -613,14 +1669,22 @@ int main(int argc, char** argv) {
   VOCAB_SIZE = termdict.size();
   ACTION_SIZE = adict.size();
   possible_actions.resize(adict.size());
-  for (unsigned i = 0; i < adict.size(); ++i)
+  action_type.resize(adict.size());
+  for (unsigned i = 0; i < adict.size(); ++i) {
     possible_actions[i] = i;
+    action_type[i] = adict.Convert(i)[0];
+  }
 
   ParserBuilder parser(&model, pretrained);
   if (conf.count("model")) {
-    ifstream in(conf["model"].as<string>().c_str());
-    boost::archive::text_iarchive ia(in);
-    ia >> model;
+    // when only decoding, the values of a binary model are read from the
+    // mapped file as needed
+    cnn::load_cnn_model(conf["model"].as<string>(), &model, conf.count("train") == 0);
+  }
+  if (conf.count("write_binary_model")) {
+    cnn::save_cnn_model(conf["write_binary_model"].as<string>(), &model, true, ModelBundle(train_words));
+    cerr << "Wrote " << conf["write_binary_model"].as<string>() << endl;
+    return 0;
   }
 
   if (conf.count("t2l_norm") || conf.count("w2l_norm")) {
@@ -650,6 +1714,110 @@ int main(int argc, char** argv) {
     return 0;
   }
 
+  // the parameters are fixed from here on unless training
+  if (conf.count("train") == 0) parser.build_inference_cache();
+
+  if (conf.count("serve") || conf.count("stream")) {
+    // without -P the tokens are only split into word/TAG if asked to, as
+    // words may contain slashes
+    const bool tagged_input = USE_POS || conf.count("tagged_input");
+    // parses each line of requests, or explains why it could not
+    auto handle_batch = [&](const vector<string>& requests, vector<string>* responses) {
+      const unsigned n = requests.size();
+      responses->assign(n, "");
+      vector<parser::Sentence> sents(n);
+      vector<vector<string>> words(n), tags(n);
+      vector<const parser::Sentence*> batch;
+      vector<unsigned> batch_index;
+      for (unsigned i = 0; i < n; ++i) {
+        (*responses)[i] = parser::SplitRequest(requests[i], tagged_input, &words[i], &tags[i]);
+        for (unsigned j = 0; j < words[i].size() && (*responses)[i].empty(); ++j) {
+          const string& word = words[i][j];
+          const string& tag = tags[i][j];
+          if (USE_POS && !posdict.Contains(tag)) {
+            (*responses)[i] = "ERROR: unknown POS tag " + tag;
+            break;
+          }
+          string lc = word;
+          for (auto& c : lc) c = tolower(c);
+          const int unk = termdict.Convert(parser::Unkify(word, train_words));
+          sents[i].raw.push_back(unk);
+          sents[i].unk.push_back(unk);
+          sents[i].lc.push_back(termdict.Convert(lc));
+          sents[i].pos.push_back(posdict.Contains(tag) ? posdict.Convert(tag) : 0);
+        }
+        if ((*responses)[i].empty()) {
+          batch.push_back(&sents[i]);
+          batch_index.push_back(i);
+        }
+      }
+      if (batch.empty()) return;
+      vector<vector<unsigned>> preds(batch.size());
+      if (beam_size > 1) {
+        for (unsigned j = 0; j < batch.size(); ++j) {
+          ComputationGraph hg;
+          double nlp;
+          preds[j] = parser.beam_search_parser(&hg, *batch[j], beam_size, &nlp);
+        }
+      } else {
+        ComputationGraph hg;
+        preds = parser.decode_batch(&hg, batch);
+      }
+      for (unsigned j = 0; j < batch.size(); ++j) {
+        const unsigned i = batch_index[j];
+        (*responses)[i] = TreeString(preds[j], words[i], tags[i]);
+      }
+    };
+    const unsigned max_batch = conf["serve_batch"].as<unsigned>();
+    if (conf.count("serve")) {
+      parser::LineServer server(max_batch, handle_batch);
+      if (conf.count("socket"))
+        server.ServeSocket(conf["socket"].as<string>());
+      else
+        server.ServeStdin();
+      return 0;
+    }
+    // stream: only max_batch sentences are held in memory at a time
+    const string stream_file = conf["stream"].as<string>();
+    unique_ptr<istream> file_in;
+    if (stream_file != "-") {
+      if (!ifstream(stream_file.c_str())) {
+        cerr << "Could not read " << stream_file << endl;
+        return 1;
+      }
+      file_in.reset(new cnn::compressed_ifstream(stream_file));
+    }
+    istream& in = file_in ? *file_in : cin;
+    auto t_start = chrono::high_resolution_clock::now();
+    vector<string> lines, trees;
+    unsigned lc = 0, nparsed = 0, nfailed = 0;
+    auto parse_lines = [&]() {
+      handle_batch(lines, &trees);
+      for (unsigned i = 0; i < lines.size(); ++i) {
+        if (trees[i].compare(0, 6, "ERROR:") == 0) { // keep the output aligned with the input
+          cerr << "Line " << lc - lines.size() + i + 1 << ": " << trees[i] << endl;
+          cout << endl;
+          ++nfailed;
+        } else {
+          cout << trees[i] << endl;
+          ++nparsed;
+        }
+      }
+      lines.clear();
+    };
+    string line;
+    while (getline(in, line)) {
+      ++lc;
+      lines.push_back(line);
+      if (lines.size() == max_batch) parse_lines();
+    }
+    if (lines.size() > 0) parse_lines();
+    auto t_end = chrono::high_resolution_clock::now();
+    cerr << "Parsed " << nparsed << " sentences (" << nfailed << " could not be parsed) in "
+         << chrono::duration<double, milli>(t_end - t_start).count() << " ms\n";
+    return 0;
+  }
+
   //TRAINING
   if (conf.count("train")) {
     signal(SIGINT, signal_callback_handler);
@@ -679,38 +1847,57 @@ int main(int argc, char** argv) {
     unsigned report_every = conf["report_every"].as<unsigned>();
     unsigned counter = 0;
     unsigned patience = conf["patience"].as<unsigned>();
+    // the correct predictions are counted after the forward pass of each batch
+    double* train_right = conf.count("no_train_accuracy") ? nullptr : &right;
     while(!requested_stop && counter < patience) {
       ++iter;
       auto time_start = chrono::system_clock::now();
-      for (unsigned sii = 0; sii < status_every_i_iterations; ++sii) {
-        if (si == corpus.sents.size()) {
-          si = 0;
-          if (first) { first = false; } else { sgd.update_epoch(); }
-          cerr << "**SHUFFLE\n";
-          random_shuffle(order.begin(), order.end());
+      for (unsigned sii = 0; sii < status_every_i_iterations; sii += batch_size) {
+        vector<unsigned> batch;
+        for (unsigned k = 0; k < batch_size && sii + k < status_every_i_iterations; ++k) {
+          if (si == corpus.sents.size()) {
+            si = 0;
+            if (first) { first = false; } else { sgd.update_epoch(); }
+            cerr << "**SHUFFLE\n";
+            random_shuffle(order.begin(), order.end());
+          }
+          tot_seen += 1;
+          batch.push_back(order[si]);
+          ++si;
         }
-        tot_seen += 1;
-        auto& sentence = corpus.sents[order[si]];
-        const vector<int>& actions=corpus.actions[order[si]];
         ComputationGraph hg;
-        parser.log_prob_parser(&hg,sentence,actions,&right,false);
-        double lp = as_scalar(hg.incremental_forward());
+        if (batch.size() == 1) {
+          parser.log_prob_parser(&hg,corpus.sents[batch[0]],corpus.actions[batch[0]],train_right,false);
+        } else {
+          vector<const parser::Sentence*> sentences;
+          vector<const vector<int>*> actions;
+          for (auto i : batch) {
+            sentences.push_back(&corpus.sents[i]);
+            actions.push_back(&corpus.actions[i]);
+          }
+          parser.log_prob_parser_batch(&hg,sentences,actions,train_right);
+        }
+        // the loss of a mini-batch is its mean over the sentences
+        double lp = as_scalar(hg.incremental_forward()) * batch.size();
         if (lp < 0) {
-          cerr << "Log prob < 0 on sentence " << order[si] << ": lp=" << lp << endl;
+          cerr << "Log prob < 0 on sentence batch starting at " << batch[0] << ": lp=" << lp << endl;
           assert(lp >= 0.0);
         }
         hg.backward();
         sgd.update(1.0);
         llh += lp;
-        ++si;
-        trs += actions.size();
-        words += sentence.size();
+        for (auto i : batch) {
+          trs += corpus.actions[i].size();
+          words += corpus.sents[i].size();
+        }
       }
       sgd.status();
       auto time_now = chrono::system_clock::now();
       auto dur = chrono::duration_cast<chrono::milliseconds>(time_now - time_start);
       cerr << "update #" << iter << " (epoch " << (tot_seen / corpus.sents.size()) <<
-        ") per-action-ppl: " << exp(llh / trs) << " per-input-ppl: " << exp(llh / words) << " per-sent-ppl: " << exp(llh / status_every_i_iterations) << " err: " << (trs - right) / trs << " [" << dur.count() / (double)status_every_i_iterations << "ms per instance]" << endl;
+        ") per-action-ppl: " << exp(llh / trs) << " per-input-ppl: " << exp(llh / words) << " per-sent-ppl: " << exp(llh / status_every_i_iterations);
+      if (train_right) cerr << " err: " << (trs - right) / trs;
+      cerr << " [" << dur.count() / (double)status_every_i_iterations << "ms per instance]" << endl;
       llh = trs = right = words = 0;
 
       static int logc = 0;
@@ -725,18 +1912,24 @@ int main(int argc, char** argv) {
         os << "/tmp/parser_dev_eval." << getpid() << ".txt";
         const string pfx = os.str();
         ofstream out(pfx.c_str());
+        parser::EvalbScorer evalb;
+        vector<parser::Bracket> brackets;
         auto t_start = chrono::high_resolution_clock::now();
+        vector<parser::EvalResult> results = cnn::mp::ParallelMap<parser::EvalResult>(dev_size, eval_workers, [&](unsigned sii) {
+          ComputationGraph hg;
+          parser::EvalResult r;
+          r.actions = parser.evaluate_parser(&hg,dev_corpus.sents[sii],dev_corpus.actions[sii],beam_size,&r.right,&r.nlp,&r.pred_nlp);
+          return r;
+        });
         for (unsigned sii = 0; sii < dev_size; ++sii) {
           const auto& sentence=dev_corpus.sents[sii];
           const vector<int>& actions=dev_corpus.actions[sii];
           dwords += sentence.size();
-          {  ComputationGraph hg;
-            parser.log_prob_parser(&hg,sentence,actions,&right,true);
-            double lp = as_scalar(hg.incremental_forward());
-            llh += lp;
-          }
-          ComputationGraph hg;
-          vector<unsigned> pred = parser.log_prob_parser(&hg,sentence,vector<int>(),&right,true);
+          const vector<unsigned>& pred = results[sii].actions;
+          right += results[sii].right;
+          llh += results[sii].nlp;
+          parser::ActionsToBrackets(pred, adict, IMPLICIT_REDUCE_AFTER_SHIFT, &brackets);
+          if (sii < dev_trees.size()) evalb.add(dev_trees[sii], brackets, sentence.size());
           int ti = 0;
           for (auto a : pred) {
             if (adict.Convert(a)[0] == 'N') {
@@ -761,32 +1954,7 @@ int main(int argc, char** argv) {
         out.close();
         double err = (trs - right) / trs;
         cerr << "Dev output in " << pfx << endl;
-        std::string pid = std::to_string(getpid());
-        std::string evaluable_fname = "evaluable-" + pid + ".txt";
-        std::string evalbout_fname = "evalbout-" + pid + ".txt";
-        std::string python = conf["python"].as<string>();
-        std::string command=python + " remove_dev_unk.py " +  corpus.devdata  + " " + pfx + " > " + evaluable_fname;
-        const char* cmd=command.c_str();
-        system(cmd);
-
-        std::string command2="EVALB/evalb -p EVALB/COLLINS.prm " + corpus.devdata + " " + evaluable_fname + ">" + evalbout_fname;
-        const char* cmd2=command2.c_str();
-
-        system(cmd2);
-
-        std::ifstream evalfile(evalbout_fname);
-        std::string lineS;
-        std::string brackstr="Bracketing FMeasure";
-        double newfmeasure=0.0;
-        std::string strfmeasure="";
-        while (getline(evalfile, lineS) && !newfmeasure){
-          if (lineS.compare(0, brackstr.length(), brackstr) == 0) {
-            strfmeasure=lineS.substr(lineS.size()-5, lineS.size());
-            std::string::size_type sz;     // alias of size_t
-
-            newfmeasure = std::stod (strfmeasure,&sz);
-          }
-        }
+        double newfmeasure = evalb.fmeasure();
 
         cerr << "  **dev (iter=" << iter << " epoch=" << (tot_seen / corpus.size()) << ")\tllh=" << llh << " ppl: " << exp(llh / dwords) << " f1: " << newfmeasure << " err: " << err << "\t[" << dev_size << " sents in " << chrono::duration<double, milli>(t_end-t_start).count() << " ms]" << endl;
         if (newfmeasure > bestf1) {
@@ -794,9 +1962,7 @@ int main(int argc, char** argv) {
           cerr << "  new best...writing model to " << fname << " ...\n";
           best_dev_err = err;
           bestf1=newfmeasure;
-          ofstream out(fname);
-          boost::archive::text_oarchive oa(out);
-          oa << model;
+          cnn::save_cnn_model(fname, &model, conf.count("binary_model"), ModelBundle(train_words));
           system((string("cp ") + pfx + string(" ") + pfx + string(".best")).c_str());
           // Create a soft link to the most recent model in order to make it
           // easier to refer to it in a shell script.
@@ -822,15 +1988,57 @@ int main(int argc, char** argv) {
     double trs = 0;
     double right = 0;
     double dwords = 0;
-    auto t_start = chrono::high_resolution_clock::now();
-    const vector<int> actions;
+    // every sentence is decoded (deterministically, so in parallel) and
+    // scored once, for both the output and the evaluation; sampling runs
+    // serially, so that the random draws are reproducible for a given seed
+    vector<parser::EvalResult> results = cnn::mp::ParallelMap<parser::EvalResult>(test_size, eval_workers, [&](unsigned sii) {
+      ComputationGraph hg;
+      parser::EvalResult r;
+      r.actions = parser.evaluate_parser(&hg,test_corpus.sents[sii],test_corpus.actions[sii],beam_size,&r.right,&r.nlp,&r.pred_nlp);
+      return r;
+    });
     for (unsigned sii = 0; sii < test_size; ++sii) {
       const auto& sentence=test_corpus.sents[sii];
-      dwords += sentence.size();
-      for (unsigned z = 0; z < N_SAMPLES; ++z) {
+      vector<vector<unsigned>> samples;
+      vector<double> sample_log_probs;
+      vector<unsigned> counts; // how often each of the samples was drawn
+      if (sample) {
         ComputationGraph hg;
-        vector<unsigned> pred = parser.log_prob_parser(&hg,sentence,actions,&right,sample,true);
-        double lp = as_scalar(hg.incremental_forward());
+        if (without_replacement)
+          samples = parser.sample_parser_without_replacement(&hg, sentence, N_SAMPLES, &sample_log_probs);
+        else
+          samples = parser.sample_parser(&hg, sentence, N_SAMPLES, &sample_log_probs);
+        counts.assign(samples.size(), 1);
+        if (unique_samples && !without_replacement) {
+          // keep the first occurrence of each tree
+          unordered_map<vector<unsigned>, unsigned, boost::hash<vector<unsigned>>> first;
+          unsigned nunique = 0;
+          for (unsigned z = 0; z < samples.size(); ++z) {
+            auto it = first.insert(make_pair(samples[z], nunique)).first;
+            if (it->second == nunique) {
+              samples[nunique] = samples[z];
+              sample_log_probs[nunique] = sample_log_probs[z];
+              counts[nunique++] = 1;
+            } else {
+              ++counts[it->second];
+            }
+          }
+          samples.resize(nunique);
+          sample_log_probs.resize(nunique);
+          counts.resize(nunique);
+        }
+      }
+      const unsigned nout = sample ? samples.size() : N_SAMPLES;
+      for (unsigned z = 0; z < nout; ++z) {
+        vector<unsigned> pred;
+        double lp;
+        if (sample) {
+          pred = samples[z];
+          lp = -sample_log_probs[z];
+        } else {
+          pred = results[sii].actions;
+          lp = results[sii].pred_nlp;
+        }
         cout << sii << " ||| " << -lp << " |||";
         int ti = 0;
         for (auto a : pred) {
@@ -849,6 +2057,9 @@ int main(int argc, char** argv) {
             }
           } else cout << ')';
         }
+        if (sample && unique_samples) cout << " ||| " << counts[z];
+        // marked, as they are not i.i.d. samples (so nt-parser-gen --proposals rejects them)
+        if (sample && without_replacement) cout << " ||| without_replacement";
         cout << endl;
       }
     }
@@ -856,18 +2067,17 @@ int main(int argc, char** argv) {
     os << "/tmp/parser_test_eval." << getpid() << ".txt";
     const string pfx = os.str();
     ofstream out(pfx.c_str());
-    t_start = chrono::high_resolution_clock::now();
+    parser::EvalbScorer evalb;
+    vector<parser::Bracket> brackets;
     for (unsigned sii = 0; sii < test_size; ++sii) {
       const auto& sentence=test_corpus.sents[sii];
       const vector<int>& actions=test_corpus.actions[sii];
       dwords += sentence.size();
-      {  ComputationGraph hg;
-        parser.log_prob_parser(&hg,sentence,actions,&right,true);
-        double lp = as_scalar(hg.incremental_forward());
-        llh += lp;
-      }
-      ComputationGraph hg;
-      vector<unsigned> pred = parser.log_prob_parser(&hg,sentence,vector<int>(),&right,true);
+      const vector<unsigned>& pred = results[sii].actions;
+      right += results[sii].right;
+      llh += results[sii].nlp;
+      parser::ActionsToBrackets(pred, adict, IMPLICIT_REDUCE_AFTER_SHIFT, &brackets);
+      if (sii < test_trees.size()) evalb.add(test_trees[sii], brackets, sentence.size());
       int ti = 0;
       for (auto a : pred) {
         if (adict.Convert(a)[0] == 'N') {
@@ -890,33 +2100,12 @@ int main(int argc, char** argv) {
     }
     out.close();
     cerr << "Test output in " << pfx << endl;
-    std::string pid = std::to_string(getpid());
-    std::string evaluable_fname = "evaluable-" + pid + ".txt";
-    std::string evalbout_fname = "evalbout-" + pid + ".txt";
-    std::string python = conf["python"].as<string>();
-    std::string command=python + " remove_dev_unk.py " +  corpus.devdata  + " " + pfx + " > " + evaluable_fname;
-    const char* cmd=command.c_str();
-    system(cmd);
-
-    std::string command2="EVALB/evalb -p EVALB/COLLINS.prm " + corpus.devdata + " " + evaluable_fname + ">" + evalbout_fname;
-    const char* cmd2=command2.c_str();
-
-    system(cmd2);
-
-    std::ifstream evalfile(evalbout_fname);
-    std::string lineS;
-    std::string brackstr="Bracketing FMeasure";
-    double newfmeasure=0.0;
-    std::string strfmeasure="";
-    while (getline(evalfile, lineS) && !newfmeasure){
-      if (lineS.compare(0, brackstr.length(), brackstr) == 0) {
-        strfmeasure=lineS.substr(lineS.size()-5, lineS.size());
-        std::string::size_type sz;
-        newfmeasure = std::stod (strfmeasure,&sz);
-      }
+    if (test_trees.size() > 0) {
+      if (evalb.errors > 0)
+        cerr << "  " << evalb.errors << " sentences could not be evaluated (length mismatch)\n";
+      cerr << "Bracketing recall: " << evalb.recall() << " precision: " << evalb.precision() << endl;
+      cerr<<"F1score: "<<evalb.fmeasure()<<"\n";
     }
 
-    cerr<<"F1score: "<<newfmeasure<<"\n";
-
   }
 }
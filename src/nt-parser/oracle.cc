@@ -1,7 +1,17 @@
 #include "nt-parser/oracle.h"
 
 #include <cassert>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "cnn/dict.h"
 #include "nt-parser/compressed-fstream.h"
@@ -12,6 +22,55 @@ namespace parser {
 
   Oracle::~Oracle() {}
 
+  inline bool ends_with(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  string Unkify(const string& word, const unordered_set<string>& words) {
+    if (word.empty()) return "UNK";
+    if (words.count(word)) return word;
+    unsigned num_caps = 0;
+    bool has_digit = false, has_dash = false, has_lower = false;
+    string lower = word;
+    for (auto& c : lower) {
+      const unsigned char uc = c;
+      if (isdigit(uc)) has_digit = true;
+      else if (c == '-') has_dash = true;
+      else if (islower(uc)) has_lower = true;
+      else if (isupper(uc)) ++num_caps;
+      c = tolower(uc);
+    }
+    string result = "UNK";
+    const unsigned char ch0 = word[0];
+    if (isupper(ch0)) {
+      if (num_caps == 1) {
+        result += "-INITC";
+        if (words.count(lower)) result += "-KNOWNLC";
+      } else {
+        result += "-CAPS";
+      }
+    } else if (!isalpha(ch0) && num_caps > 0) {
+      result += "-CAPS";
+    } else if (has_lower) {
+      result += "-LC";
+    }
+    if (has_digit) result += "-NUM";
+    if (has_dash) result += "-DASH";
+    if (lower.back() == 's' && lower.size() >= 3) {
+      const char ch2 = lower[lower.size() - 2];
+      if (ch2 != 's' && ch2 != 'i' && ch2 != 'u') result += "-s";
+    } else if (lower.size() >= 5 && !has_dash && !(has_digit && num_caps > 0)) {
+      static const char* suffixes[] = {"ed", "ing", "ion", "er", "est", "ly", "ity", "y", "al"};
+      for (auto suffix : suffixes) {
+        if (ends_with(lower, suffix)) {
+          result += string("-") + suffix;
+          break;
+        }
+      }
+    }
+    return result;
+  }
+
   inline bool is_ws(char x) { // check whether the character is a space or tab delimiter
     return (x == ' ' || x == '\t');
   }
@@ -35,12 +94,246 @@ namespace parser {
     assert(sent->size() > 0); // empty sentences not allowed
   }
 
+  namespace {
+
+    void PrintStats(const Oracle& oracle, cnn::Dict* nd) {
+      cerr << "Loaded " << oracle.sents.size() << " sentences\n";
+      cerr << "    cumulative      action vocab size: " << oracle.ad->size() << endl;
+      cerr << "    cumulative    terminal vocab size: " << oracle.d->size() << endl;
+      cerr << "    cumulative nonterminal vocab size: " << nd->size() << endl;
+      cerr << "    cumulative         pos vocab size: " << oracle.pd->size() << endl;
+    }
+
+    // an oracle file with the words as ids into its own dictionaries
+    // (terminals, actions, POS tags and nonterminals)
+    struct CompiledOracle {
+      vector<Sentence> sents;
+      vector<vector<int>> actions;
+      vector<string> words[4];
+    };
+
+    const char kCacheMagic[8] = {'R', 'N', 'N', 'G', 'O', 'R', 'C', 'L'};
+    const uint32_t kCacheVersion = 1;
+
+    // followed by uint32 arrays: the start of every sentence in the token
+    // arrays (and the end of the last), the raw, unk, lc and pos token
+    // arrays, the start of every sentence in the action array, the action
+    // array, and for every dictionary the start of every word in its
+    // characters; and then by the characters of every dictionary
+    struct CacheHeader {
+      char magic[8];
+      uint32_t version;
+      uint32_t kind;
+      uint64_t source_hash;
+      uint32_t nsents, ntokens, nactions;
+      uint32_t nwords[4];
+      uint32_t nchars[4];
+    };
+
+    // 64-bit FNV-1a hash of the content of file
+    bool HashFile(const string& file, uint64_t* hash) {
+      ifstream in(file.c_str(), ios::binary);
+      if (!in) return false;
+      uint64_t h = 14695981039346656037ULL;
+      vector<char> buf(1 << 16);
+      while (in.read(&buf[0], buf.size()) || in.gcount() > 0) {
+        const size_t n = in.gcount();
+        for (size_t i = 0; i < n; ++i) {
+          h ^= (unsigned char) buf[i];
+          h *= 1099511628211ULL;
+        }
+      }
+      *hash = h;
+      return true;
+    }
+
+    size_t CacheSize(const CacheHeader& h) {
+      size_t n = 2 * (h.nsents + 1) + 4 * (size_t) h.ntokens + h.nactions;
+      size_t nchars = 0;
+      for (unsigned k = 0; k < 4; ++k) {
+        n += h.nwords[k] + 1;
+        nchars += h.nchars[k];
+      }
+      return sizeof(CacheHeader) + n * sizeof(uint32_t) + nchars;
+    }
+
+    bool ReadCache(const string& file, uint64_t hash, uint32_t kind, CompiledOracle* c) {
+      int fd = open(file.c_str(), O_RDONLY);
+      if (fd < 0) return false;
+      struct stat st;
+      void* mapped = MAP_FAILED;
+      if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(CacheHeader))
+        mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (mapped == MAP_FAILED) return false;
+      const char* data = static_cast<const char*>(mapped);
+      CacheHeader h;
+      memcpy(&h, data, sizeof(h));
+      bool ok = memcmp(h.magic, kCacheMagic, sizeof(kCacheMagic)) == 0 && h.version == kCacheVersion &&
+          h.kind == kind && h.source_hash == hash && CacheSize(h) == (size_t) st.st_size;
+      if (ok) {
+        const uint32_t* sent_start = reinterpret_cast<const uint32_t*>(data + sizeof(h));
+        const uint32_t* views = sent_start + h.nsents + 1;
+        const uint32_t* act_start = views + 4 * (size_t) h.ntokens;
+        const uint32_t* acts = act_start + h.nsents + 1;
+        const uint32_t* word_start = acts + h.nactions;
+        const char* chars = reinterpret_cast<const char*>(word_start + h.nwords[0] + h.nwords[1] + h.nwords[2] + h.nwords[3] + 4);
+        c->sents.resize(h.nsents);
+        c->actions.resize(h.nsents);
+        for (unsigned i = 0; ok && i < h.nsents; ++i) {
+          const uint32_t b = sent_start[i], e = sent_start[i + 1], ab = act_start[i], ae = act_start[i + 1];
+          if (b > e || e > h.ntokens || ab > ae || ae > h.nactions) { ok = false; break; }
+          Sentence& s = c->sents[i];
+          s.raw.assign(views + b, views + e);
+          s.unk.assign(views + h.ntokens + b, views + h.ntokens + e);
+          s.lc.assign(views + 2 * h.ntokens + b, views + 2 * h.ntokens + e);
+          s.pos.assign(views + 3 * h.ntokens + b, views + 3 * h.ntokens + e);
+          c->actions[i].assign(acts + ab, acts + ae);
+        }
+        for (unsigned k = 0; ok && k < 4; ++k) {
+          c->words[k].resize(h.nwords[k]);
+          for (unsigned j = 0; j < h.nwords[k]; ++j) {
+            if (word_start[j] > word_start[j + 1] || word_start[j + 1] > h.nchars[k]) { ok = false; break; }
+            c->words[k][j].assign(chars + word_start[j], word_start[j + 1] - word_start[j]);
+          }
+          word_start += h.nwords[k] + 1;
+          chars += h.nchars[k];
+        }
+        for (unsigned i = 0; ok && i < h.nsents; ++i) {
+          const Sentence& s = c->sents[i];
+          for (unsigned j = 0; ok && j < s.size(); ++j)
+            ok = (size_t) s.raw[j] < h.nwords[0] && (size_t) s.unk[j] < h.nwords[0] &&
+                (size_t) s.lc[j] < h.nwords[0] && (size_t) s.pos[j] < h.nwords[kind <= 2 ? 2 : 0];
+          for (auto a : c->actions[i]) ok = ok && (size_t) a < h.nwords[1];
+        }
+      }
+      munmap(mapped, st.st_size);
+      return ok;
+    }
+
+    template <class T> void WriteArray(ostream& out, const vector<T>& v) {
+      vector<uint32_t> u(v.begin(), v.end());
+      out.write(reinterpret_cast<const char*>(u.data()), u.size() * sizeof(uint32_t));
+    }
+
+    // writes to a temporary file that is then renamed, so that concurrent
+    // readers only ever see complete caches
+    bool WriteCache(const string& file, uint64_t hash, uint32_t kind, const CompiledOracle& c) {
+      CacheHeader h;
+      memset(&h, 0, sizeof(h));
+      memcpy(h.magic, kCacheMagic, sizeof(kCacheMagic));
+      h.version = kCacheVersion;
+      h.kind = kind;
+      h.source_hash = hash;
+      h.nsents = c.sents.size();
+      vector<uint32_t> sent_start(1, 0), act_start(1, 0);
+      vector<int> views[4], acts;
+      for (unsigned i = 0; i < c.sents.size(); ++i) {
+        const Sentence& s = c.sents[i];
+        views[0].insert(views[0].end(), s.raw.begin(), s.raw.end());
+        views[1].insert(views[1].end(), s.unk.begin(), s.unk.end());
+        views[2].insert(views[2].end(), s.lc.begin(), s.lc.end());
+        views[3].insert(views[3].end(), s.pos.begin(), s.pos.end());
+        sent_start.push_back(views[0].size());
+        acts.insert(acts.end(), c.actions[i].begin(), c.actions[i].end());
+        act_start.push_back(acts.size());
+      }
+      h.ntokens = views[0].size();
+      h.nactions = acts.size();
+      vector<uint32_t> word_start[4];
+      string chars[4];
+      for (unsigned k = 0; k < 4; ++k) {
+        h.nwords[k] = c.words[k].size();
+        word_start[k].push_back(0);
+        for (auto& w : c.words[k]) {
+          chars[k] += w;
+          word_start[k].push_back(chars[k].size());
+        }
+        h.nchars[k] = chars[k].size();
+      }
+      ostringstream tmp;
+      tmp << file << ".tmp" << getpid();
+      {
+        ofstream out(tmp.str().c_str(), ios::binary);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        WriteArray(out, sent_start);
+        for (auto& v : views) WriteArray(out, v);
+        WriteArray(out, act_start);
+        WriteArray(out, acts);
+        for (auto& ws : word_start) WriteArray(out, ws);
+        for (auto& cs : chars) out.write(cs.data(), cs.size());
+        out.close();
+        if (!out) {
+          remove(tmp.str().c_str());
+          return false;
+        }
+      }
+      return rename(tmp.str().c_str(), file.c_str()) == 0;
+    }
+
+  } // namespace
+
+  void Oracle::load_compiled(const string& file, OracleKind kind, cnn::Dict* nd, const OracleParser& parse) {
+    // one compiled copy per kind, since the same file can be loaded e.g. as
+    // training and as test data
+    ostringstream cache_file_name;
+    cache_file_name << file << ".k" << kind << ".cache";
+    const string cache_file = cache_file_name.str();
+    uint64_t hash = 0;
+    const bool hashed = HashFile(file, &hash);
+    if (!hashed) {
+      cerr << "Could not read " << file << endl;
+      abort();
+    }
+    CompiledOracle c;
+    if (ReadCache(cache_file, hash, kind, &c)) {
+      cerr << "  using compiled oracle " << cache_file << endl;
+    } else {
+      cnn::Dict dicts[4];
+      parse(&dicts[0], &dicts[1], &dicts[2], &dicts[3], &c.sents, &c.actions);
+      for (unsigned k = 0; k < 4; ++k)
+        for (unsigned j = 0; j < dicts[k].size(); ++j)
+          c.words[k].push_back(dicts[k].Convert(j));
+      if (WriteCache(cache_file, hash, kind, c))
+        cerr << "  wrote compiled oracle " << cache_file << endl;
+    }
+    // the words are added to the dictionaries in the order in which parsing
+    // would have added them
+    cnn::Dict* dicts[4] = {d, ad, pd, nd};
+    vector<int> ids[4];
+    for (unsigned k = 0; k < 4; ++k)
+      for (auto& w : c.words[k]) ids[k].push_back(dicts[k]->Convert(w));
+    const vector<int>& pos_ids = (kind == kTopDownTraining || kind == kTopDownTest) ? ids[2] : ids[0];
+    for (unsigned i = 0; i < c.sents.size(); ++i) {
+      Sentence& s = c.sents[i];
+      for (auto& w : s.raw) w = ids[0][w];
+      for (auto& w : s.unk) w = ids[0][w];
+      for (auto& w : s.lc) w = ids[0][w];
+      for (auto& w : s.pos) w = pos_ids[w];
+      for (auto& a : c.actions[i]) a = ids[1][a];
+      sents.push_back(s);
+      actions.push_back(c.actions[i]);
+    }
+  }
+
   void TopDownOracle::load_bdata(const string& file) {
     devdata=file;
   }
 
   void TopDownOracle::load_oracle(const string& file, bool is_training) {
     cerr << "Loading top-down oracle from " << file << " [" << (is_training ? "training" : "non-training") << "] ...\n";
+    load_compiled(file, is_training ? kTopDownTraining : kTopDownTest, nd,
+                  [&](cnn::Dict* d, cnn::Dict* ad, cnn::Dict* pd, cnn::Dict* nd,
+                      vector<Sentence>* sents, vector<vector<int>>* actions) {
+      TopDownOracle oracle(d, ad, pd, nd);
+      oracle.parse_oracle(file, is_training);
+      sents->swap(oracle.sents);
+      actions->swap(oracle.actions);
+    });
+    PrintStats(*this, nd);
+  }
+
+  void TopDownOracle::parse_oracle(const string& file, bool is_training) {
     cnn::compressed_ifstream in(file.c_str());
     assert(in);
     const string kREDUCE = "REDUCE";
@@ -104,15 +397,22 @@ namespace parser {
         abort();
       }
     }
-    cerr << "Loaded " << sents.size() << " sentences\n";
-    cerr << "    cumulative      action vocab size: " << ad->size() << endl;
-    cerr << "    cumulative    terminal vocab size: " << d->size() << endl;
-    cerr << "    cumulative nonterminal vocab size: " << nd->size() << endl;
-    cerr << "    cumulative         pos vocab size: " << pd->size() << endl;
   }
 
   void TopDownOracleGen::load_oracle(const string& file) {
     cerr << "Loading top-down generative oracle from " << file << endl;
+    load_compiled(file, kTopDownGen, nd,
+                  [&](cnn::Dict* d, cnn::Dict* ad, cnn::Dict* pd, cnn::Dict* nd,
+                      vector<Sentence>* sents, vector<vector<int>>* actions) {
+      TopDownOracleGen oracle(d, ad, pd, nd);
+      oracle.parse_oracle(file);
+      sents->swap(oracle.sents);
+      actions->swap(oracle.actions);
+    });
+    PrintStats(*this, nd);
+  }
+
+  void TopDownOracleGen::parse_oracle(const string& file) {
     cnn::compressed_ifstream in(file.c_str());
     assert(in);
     const string kREDUCE = "REDUCE";
@@ -162,15 +462,22 @@ namespace parser {
         abort();
       }
     }
-    cerr << "Loaded " << sents.size() << " sentences\n";
-    cerr << "    cumulative      action vocab size: " << ad->size() << endl;
-    cerr << "    cumulative    terminal vocab size: " << d->size() << endl;
-    cerr << "    cumulative nonterminal vocab size: " << nd->size() << endl;
-    cerr << "    cumulative         pos vocab size: " << pd->size() << endl;
   }
 
   void TopDownOracleGen2::load_oracle(const string& file) {
     cerr << "Loading top-down generative oracle from " << file << endl;
+    load_compiled(file, kTopDownGen2, nd,
+                  [&](cnn::Dict* d, cnn::Dict* ad, cnn::Dict* pd, cnn::Dict* nd,
+                      vector<Sentence>* sents, vector<vector<int>>* actions) {
+      TopDownOracleGen2 oracle(d, ad, pd, nd);
+      oracle.parse_oracle(file);
+      sents->swap(oracle.sents);
+      actions->swap(oracle.actions);
+    });
+    PrintStats(*this, nd);
+  }
+
+  void TopDownOracleGen2::parse_oracle(const string& file) {
     cnn::compressed_ifstream in(file.c_str());
     assert(in);
     const int kREDUCE_INT = ad->Convert("REDUCE");
@@ -221,11 +528,6 @@ namespace parser {
       sents.back().pos = sents.back().lc = sents.back().unk = sents.back().raw;
       actions.push_back(cur_acts);
     }
-    cerr << "Loaded " << sents.size() << " sentences\n";
-    cerr << "    cumulative      action vocab size: " << ad->size() << endl;
-    cerr << "    cumulative    terminal vocab size: " << d->size() << endl;
-    cerr << "    cumulative nonterminal vocab size: " << nd->size() << endl;
-    cerr << "    cumulative         pos vocab size: " << pd->size() << endl;
   }
 
 } // namespace parser
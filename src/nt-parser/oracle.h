@@ -1,9 +1,11 @@
 #ifndef PARSER_ORACLE_H_
 #define PARSER_ORACLE_H_
 
+#include <functional>
 #include <iostream>
 #include <vector>
 #include <string>
+#include <unordered_set>
 
 namespace cnn { class Dict; }
 
@@ -17,6 +19,11 @@ namespace parser {
     std::vector<int> raw, unk, lc, pos;
   };
 
+  // maps a word that is not in words (the training words that occur more
+  // than once) to its UNK class, as get_oracle.py does; other words are
+  // returned unchanged
+  std::string Unkify(const std::string& word, const std::unordered_set<std::string>& words);
+
   // base class for transition based parse oracles
   struct Oracle {
     virtual ~Oracle();
@@ -30,6 +37,22 @@ namespace parser {
     std::vector<std::vector<int>> actions;
   protected:
     static void ReadSentenceView(const std::string& line, cnn::Dict* dict, std::vector<int>* sent);
+
+    // kinds of oracle files, which are compiled differently
+    enum OracleKind { kTopDownTraining = 1, kTopDownTest, kTopDownGen, kTopDownGen2 };
+    // parses an oracle file with the given (terminal, action, POS and
+    // nonterminal) dictionaries
+    typedef std::function<void(cnn::Dict* d, cnn::Dict* ad, cnn::Dict* pd, cnn::Dict* nd,
+                               std::vector<Sentence>* sents,
+                               std::vector<std::vector<int>>* actions)> OracleParser;
+    // appends the sentences and actions of file to sents and actions.
+    // they are read from a compiled copy of the oracle (file + ".k" + kind
+    // + ".cache", with the words as integers and its own dictionaries), which
+    // is made with parse the first time and whenever the content of file
+    // changes.
+    // the words are added to the dictionaries in the same order as when
+    // parsing file with them
+    void load_compiled(const std::string& file, OracleKind kind, cnn::Dict* nd, const OracleParser& parse);
   };
 
   // oracle that predicts nonterminal symbols with a NT(X) action
@@ -47,6 +70,8 @@ namespace parser {
     void load_bdata(const std::string& file);
     void load_oracle(const std::string& file, bool is_training);
     cnn::Dict* nd; // dictionary of nonterminal types
+  private:
+    void parse_oracle(const std::string& file, bool is_training);
   };
 
   // oracle that predicts nonterminal symbols with a NT(X) action
@@ -60,6 +85,8 @@ namespace parser {
       Oracle(termdict, adict, pdict), nd(nontermdict) {}
     void load_oracle(const std::string& file);
     cnn::Dict* nd; // dictionary of nonterminal types
+  private:
+    void parse_oracle(const std::string& file);
   };
 
   class TopDownOracleGen2 : public Oracle {
@@ -68,6 +95,8 @@ namespace parser {
       Oracle(termdict, adict, pdict), nd(nontermdict) {}
     void load_oracle(const std::string& file);
     cnn::Dict* nd; // dictionary of nonterminal types
+  private:
+    void parse_oracle(const std::string& file);
   };
 
 } // namespace parser
@@ -0,0 +1,199 @@
+#include "nt-parser/serve.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace parser {
+
+  typedef chrono::steady_clock Clock;
+
+  string SplitRequest(const string& line, bool tagged, vector<string>* words, vector<string>* tags) {
+    words->clear();
+    tags->clear();
+    istringstream in(line);
+    string token;
+    while (in >> token) {
+      if (!tagged) {
+        words->push_back(token);
+        tags->push_back("XX");
+        continue;
+      }
+      const size_t slash = token.rfind('/');
+      if (slash == string::npos || slash == 0 || slash + 1 == token.size())
+        return "ERROR: expected word/TAG, got " + token;
+      words->push_back(token.substr(0, slash));
+      tags->push_back(token.substr(slash + 1));
+    }
+    if (words->empty()) return "ERROR: empty sentence";
+    return "";
+  }
+
+  // a client: stdout if fd < 0
+  struct LineServer::Connection {
+    explicit Connection(int fd) : fd(fd), requests(), answered(), total_latency_ms() {}
+    ~Connection() {
+      if (answered > 0)
+        cerr << "[serve] " << (fd < 0 ? "end of input" : "connection closed") << ": answered "
+             << answered << " requests, mean latency " << total_latency_ms / answered << " ms\n";
+      if (fd >= 0) close(fd);
+    }
+    void Write(const string& s) {
+      if (fd < 0) {
+        cout << s;
+        return;
+      }
+      size_t done = 0;
+      while (done < s.size()) {
+        ssize_t r = send(fd, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+        if (r <= 0) return; // the client has gone away
+        done += r;
+      }
+    }
+    int fd;
+    unsigned requests; // read so far
+    unsigned answered;
+    double total_latency_ms;
+  };
+
+  struct LineServer::Request {
+    shared_ptr<Connection> conn;
+    unsigned id;
+    string line;
+    Clock::time_point arrival;
+  };
+
+  struct LineServer::Queue {
+    Queue() : closed() {}
+    void Push(const shared_ptr<Connection>& conn, const string& line) {
+      Request r{conn, conn->requests++, line, Clock::now()};
+      {
+        lock_guard<mutex> lock(m);
+        requests.push_back(r);
+      }
+      cv.notify_one();
+    }
+    void Close() {
+      {
+        lock_guard<mutex> lock(m);
+        closed = true;
+      }
+      cv.notify_one();
+    }
+    mutex m;
+    condition_variable cv;
+    deque<Request> requests;
+    bool closed; // no more requests will be pushed
+  };
+
+  void LineServer::Answer(Queue* queue) {
+    vector<Request> batch;
+    vector<string> lines, responses;
+    while (true) {
+      batch.clear();
+      {
+        unique_lock<mutex> lock(queue->m);
+        queue->cv.wait(lock, [queue] { return queue->requests.size() > 0 || queue->closed; });
+        if (queue->requests.empty()) return;
+        while (queue->requests.size() > 0 && batch.size() < max_batch) {
+          batch.push_back(queue->requests.front());
+          queue->requests.pop_front();
+        }
+      }
+      lines.clear();
+      for (auto& r : batch) lines.push_back(r.line);
+      responses.clear();
+      handle_batch(lines, &responses);
+      if (responses.size() != batch.size()) {
+        cerr << "[serve] " << responses.size() << " responses to " << batch.size() << " requests\n";
+        abort();
+      }
+      const Clock::time_point now = Clock::now();
+      for (unsigned i = 0; i < batch.size(); ++i) {
+        const double latency_ms = chrono::duration<double, milli>(now - batch[i].arrival).count();
+        ostringstream os;
+        os << batch[i].id << " ||| " << latency_ms << " ||| " << responses[i] << '\n';
+        batch[i].conn->Write(os.str());
+        batch[i].conn->answered++;
+        batch[i].conn->total_latency_ms += latency_ms;
+      }
+      cout.flush();
+      batch.clear(); // close the connections that have gone away
+    }
+  }
+
+  void LineServer::ServeStdin() {
+    Queue queue;
+    thread reader([&queue] {
+      auto conn = make_shared<Connection>(-1);
+      string line;
+      while (getline(cin, line))
+        queue.Push(conn, line);
+      queue.Close();
+    });
+    Answer(&queue);
+    reader.join();
+  }
+
+  void LineServer::ServeSocket(const string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      cerr << "Socket path is too long: " << path << endl;
+      abort();
+    }
+    strcpy(addr.sun_path, path.c_str());
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (server < 0 || ::bind(server, (sockaddr*) &addr, sizeof(addr)) < 0 || listen(server, 64) < 0) {
+      cerr << "Could not listen on " << path << ": " << strerror(errno) << endl;
+      abort();
+    }
+    cerr << "[serve] listening on " << path << endl;
+    Queue queue;
+    thread acceptor([&queue, server] {
+      while (true) {
+        int fd = accept(server, nullptr, nullptr);
+        if (fd < 0) {
+          if (errno == EINTR || errno == ECONNABORTED) continue;
+          cerr << "accept failed: " << strerror(errno) << endl;
+          abort();
+        }
+        auto conn = make_shared<Connection>(fd);
+        thread([&queue, conn] {
+          char buf[4096];
+          string pending;
+          ssize_t n;
+          while ((n = recv(conn->fd, buf, sizeof(buf), 0)) > 0) {
+            pending.append(buf, n);
+            size_t start = 0, end;
+            while ((end = pending.find('\n', start)) != string::npos) {
+              queue.Push(conn, pending.substr(start, end - start));
+              start = end + 1;
+            }
+            pending.erase(0, start);
+          }
+          if (pending.size() > 0) queue.Push(conn, pending);
+        }).detach();
+      }
+    });
+    Answer(&queue);
+    acceptor.join();
+  }
+
+} // namespace parser
@@ -0,0 +1,54 @@
+#ifndef PARSER_SERVE_H_
+#define PARSER_SERVE_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace parser {
+
+  // computes the response to each of a micro-batch of request lines
+  typedef std::function<void(const std::vector<std::string>& requests,
+                             std::vector<std::string>* responses)> BatchHandler;
+
+  // splits a request line into its words. if tagged, every token must be
+  // word/TAG (split at its last slash); otherwise tokens are words as they
+  // are, even if they contain a slash, and get the tag XX. returns an
+  // "ERROR: ..." message for a malformed line, or "" if it is well formed
+  std::string SplitRequest(const std::string& line, bool tagged,
+                           std::vector<std::string>* words,
+                           std::vector<std::string>* tags);
+
+  // a server that reads one request per line, from stdin (answering on
+  // stdout) or from the clients of a Unix domain socket (answering each
+  // client on its connection), and answers them in micro-batches: whenever
+  // handle_batch is free, all the requests that have arrived since it was
+  // last called (at most max_batch) are passed to it together.
+  // every response is a line of the form
+  //   [request number] ||| [latency in ms] ||| [response]
+  // where requests are numbered from 0 on each connection, and the latency
+  // is the time from reading the request to writing its response.
+  // requests are answered in the order in which they were read
+  class LineServer {
+   public:
+    LineServer(unsigned max_batch, const BatchHandler& handle_batch) :
+      max_batch(max_batch), handle_batch(handle_batch) {}
+    // returns at the end of stdin
+    void ServeStdin();
+    // never returns
+    void ServeSocket(const std::string& path);
+
+   private:
+    struct Request;
+    struct Connection;
+    struct Queue;
+    // answers the requests in queue until it is closed and empty
+    void Answer(Queue* queue);
+
+    unsigned max_batch;
+    BatchHandler handle_batch;
+  };
+
+} // namespace parser
+
+#endif
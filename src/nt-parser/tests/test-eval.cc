@@ -0,0 +1,135 @@
+#include <boost/test/unit_test.hpp>
+#include <string>
+#include <vector>
+
+#include "cnn/dict.h"
+#include "nt-parser/eval.h"
+
+using namespace std;
+
+namespace {
+
+  parser::EvalTree Tree(const string& line) {
+    parser::EvalTree tree;
+    BOOST_REQUIRE(parser::ParseEvalTree(line, &tree));
+    return tree;
+  }
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(eval_test);
+
+BOOST_AUTO_TEST_CASE( parse_tree ) {
+  parser::EvalTree tree = Tree("(TOP (S (NP (DT the) (NN cat)) (VP (VBD sat))))");
+  vector<string> expected_words = {"the", "cat", "sat"};
+  vector<string> expected_tags = {"DT", "NN", "VBD"};
+  BOOST_CHECK(tree.words == expected_words);
+  BOOST_CHECK(tree.tags == expected_tags);
+  // the constituents other than the preterminals, children first
+  BOOST_REQUIRE_EQUAL(tree.brackets.size(), 4u);
+  BOOST_CHECK_EQUAL(tree.brackets[0].label, "NP");
+  BOOST_CHECK_EQUAL(tree.brackets[0].start, 0u);
+  BOOST_CHECK_EQUAL(tree.brackets[0].end, 2u);
+  BOOST_CHECK_EQUAL(tree.brackets[3].label, "TOP");
+  BOOST_CHECK_EQUAL(tree.brackets[3].end, 3u);
+  BOOST_CHECK(!parser::ParseEvalTree("(S (NP (DT the) (NN cat))", &tree));
+  BOOST_CHECK(!parser::ParseEvalTree("(S (NP (DT the))) (NN cat)", &tree));
+}
+
+// the words tagged as punctuation in the gold tree are deleted, whatever
+// the predicted constituents that contain them (here VP and X)
+BOOST_AUTO_TEST_CASE( punctuation_deleted_by_gold_tag ) {
+  parser::EvalTree gold = Tree("(TOP (S (NP (DT the) (NN cat)) (VP (VBD sat)) (: --) (. .)))");
+  vector<parser::Bracket> test = {{"NP", 0, 2}, {"VP", 2, 4}, {"X", 3, 5}, {"S", 0, 5}};
+  parser::EvalbScorer evalb;
+  evalb.add(gold, test, 5);
+  BOOST_CHECK_EQUAL(evalb.matched, 3u);
+  BOOST_CHECK_EQUAL(evalb.gold, 3u);
+  BOOST_CHECK_EQUAL(evalb.test, 3u);
+  BOOST_CHECK_CLOSE(evalb.fmeasure(), 100.0, 1e-9);
+}
+
+BOOST_AUTO_TEST_CASE( function_tags_stripped ) {
+  parser::EvalTree gold = Tree("(S-TPC-1 (NP-SBJ=2 (PRP he)) (VP (VBD ran) (ADVP-TMP (RB today))))");
+  vector<parser::Bracket> test = {{"NP", 0, 1}, {"ADVP", 2, 3}, {"VP", 1, 3}, {"S", 0, 3}};
+  parser::EvalbScorer evalb;
+  evalb.add(gold, test, 3);
+  BOOST_CHECK_EQUAL(evalb.matched, 4u);
+  BOOST_CHECK_EQUAL(evalb.gold, 4u);
+  BOOST_CHECK_EQUAL(evalb.test, 4u);
+}
+
+BOOST_AUTO_TEST_CASE( advp_equals_prt ) {
+  parser::EvalTree gold = Tree("(S (NP (PRP he)) (VP (VBD gave) (PRT (RP up)) (ADVP (RB again))))");
+  vector<parser::Bracket> test = {{"NP", 0, 1}, {"ADVP", 2, 3}, {"PRT", 3, 4}, {"VP", 1, 4}, {"S", 0, 4}};
+  parser::EvalbScorer evalb;
+  evalb.add(gold, test, 4);
+  BOOST_CHECK_EQUAL(evalb.matched, 5u);
+  BOOST_CHECK_CLOSE(evalb.recall(), 100.0, 1e-9);
+  BOOST_CHECK_CLOSE(evalb.precision(), 100.0, 1e-9);
+}
+
+// each predicted bracket matches at most one gold bracket
+BOOST_AUTO_TEST_CASE( duplicate_brackets ) {
+  parser::EvalTree gold = Tree("(S (NP (NP (NN cats))) (VP (VBD sat)))");
+  parser::EvalbScorer evalb;
+  evalb.add(gold, {{"NP", 0, 1}, {"VP", 1, 2}, {"S", 0, 2}}, 2);
+  BOOST_CHECK_EQUAL(evalb.matched, 3u);
+  BOOST_CHECK_EQUAL(evalb.gold, 4u);
+  BOOST_CHECK_EQUAL(evalb.test, 3u);
+  BOOST_CHECK_CLOSE(evalb.recall(), 75.0, 1e-9);
+  BOOST_CHECK_CLOSE(evalb.precision(), 100.0, 1e-9);
+  BOOST_CHECK_CLOSE(evalb.fmeasure(), 600.0 / 7, 1e-9);
+
+  parser::EvalTree gold2 = Tree("(S (NP (NN cats)) (VP (VBD sat)))");
+  parser::EvalbScorer evalb2;
+  evalb2.add(gold2, {{"NP", 0, 1}, {"NP", 0, 1}, {"VP", 1, 2}, {"S", 0, 2}}, 2);
+  BOOST_CHECK_EQUAL(evalb2.matched, 3u);
+  BOOST_CHECK_CLOSE(evalb2.recall(), 100.0, 1e-9);
+  BOOST_CHECK_CLOSE(evalb2.precision(), 75.0, 1e-9);
+}
+
+// as in EVALB, a sentence of another length is an error and is not scored
+BOOST_AUTO_TEST_CASE( length_mismatch_is_error ) {
+  parser::EvalTree gold = Tree("(S (NP (NN cats)) (VP (VBD sat)))");
+  parser::EvalbScorer evalb;
+  evalb.add(gold, {{"NP", 0, 1}, {"VP", 1, 3}, {"S", 0, 3}}, 3);
+  BOOST_CHECK_EQUAL(evalb.errors, 1u);
+  BOOST_CHECK_EQUAL(evalb.sentences, 0u);
+  BOOST_CHECK_EQUAL(evalb.gold, 0u);
+  BOOST_CHECK_EQUAL(evalb.test, 0u);
+  evalb.add(gold, {{"NP", 0, 1}, {"S", 0, 2}}, 2);
+  BOOST_CHECK_EQUAL(evalb.errors, 1u);
+  BOOST_CHECK_EQUAL(evalb.sentences, 1u);
+  BOOST_CHECK_CLOSE(evalb.recall(), 200.0 / 3, 1e-9);
+  BOOST_CHECK_CLOSE(evalb.precision(), 100.0, 1e-9);
+}
+
+// the constituents closed by REDUCE, in the order in which they are closed
+BOOST_AUTO_TEST_CASE( actions_to_brackets ) {
+  cnn::Dict adict;
+  vector<unsigned> actions;
+  for (const char* a : {"NT(S)", "NT(NP)", "SHIFT", "SHIFT", "REDUCE", "NT(VP)", "SHIFT", "REDUCE", "REDUCE"})
+    actions.push_back(adict.Convert(a));
+  vector<parser::Bracket> brackets;
+  parser::ActionsToBrackets(actions, adict, false, &brackets);
+  BOOST_REQUIRE_EQUAL(brackets.size(), 3u);
+  BOOST_CHECK_EQUAL(brackets[0].label, "NP");
+  BOOST_CHECK_EQUAL(brackets[0].start, 0u);
+  BOOST_CHECK_EQUAL(brackets[0].end, 2u);
+  BOOST_CHECK_EQUAL(brackets[1].label, "VP");
+  BOOST_CHECK_EQUAL(brackets[1].start, 2u);
+  BOOST_CHECK_EQUAL(brackets[2].label, "S");
+  BOOST_CHECK_EQUAL(brackets[2].end, 3u);
+
+  // with implicit reduces, the preterminals are opened with NT and closed by SHIFT
+  actions.clear();
+  for (const char* a : {"NT(S)", "NT(NN)", "SHIFT", "NT(VBD)", "SHIFT", "REDUCE"})
+    actions.push_back(adict.Convert(a));
+  parser::ActionsToBrackets(actions, adict, true, &brackets);
+  BOOST_REQUIRE_EQUAL(brackets.size(), 1u);
+  BOOST_CHECK_EQUAL(brackets[0].label, "S");
+  BOOST_CHECK_EQUAL(brackets[0].end, 2u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,168 @@
+#include <boost/test/unit_test.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cnn/dict.h"
+#include "nt-parser/oracle.h"
+
+using namespace std;
+
+namespace {
+
+  const char kOracle[] =
+      "# (S (NP (DT The) (NN cat)) (VP (VBD sat)))\n"
+      "DT NN VBD\n"
+      "The cat sat\n"
+      "the cat sat\n"
+      "The cat UNK\n"
+      "NT(S)\nNT(NP)\nSHIFT\nSHIFT\nREDUCE\nNT(VP)\nSHIFT\nREDUCE\nREDUCE\n"
+      "\n"
+      "# (S (VP (VBD Sat)))\n"
+      "VBD\n"
+      "Sat\n"
+      "sat\n"
+      "Sat\n"
+      "NT(S)\nNT(VP)\nSHIFT\nREDUCE\nREDUCE\n"
+      "\n";
+
+  // an oracle file in a fresh directory, removed with its compiled copies
+  struct OracleFile {
+    OracleFile() {
+      char dir_template[] = "/tmp/test-oracle-XXXXXX";
+      BOOST_REQUIRE(mkdtemp(dir_template));
+      dir = dir_template;
+      file = dir + "/train.oracle";
+      write(kOracle);
+    }
+    ~OracleFile() {
+      remove(file.c_str());
+      remove((file + ".k1.cache").c_str());
+      remove((file + ".k2.cache").c_str());
+      rmdir(dir.c_str());
+    }
+    void write(const string& content) const {
+      ofstream out(file.c_str());
+      out << content;
+    }
+    string dir, file;
+  };
+
+  // the inode of file, which changes whenever the cache is (re)written,
+  // since it is written to a temporary file that is renamed; 0 if there is no file
+  ino_t Inode(const string& file) {
+    struct stat st;
+    return stat(file.c_str(), &st) == 0 ? st.st_ino : 0;
+  }
+
+  struct Dicts {
+    cnn::Dict term, action, pos, nt;
+  };
+
+  vector<string> Words(cnn::Dict& d, const vector<int>& ids) {
+    vector<string> words;
+    for (int id : ids) words.push_back(d.Convert(id));
+    return words;
+  }
+
+  // checks that the two oracles hold the same sentences and actions, whatever
+  // the ids of their words
+  void CheckSameOracle(parser::TopDownOracle& a, Dicts& da, parser::TopDownOracle& b, Dicts& db) {
+    BOOST_REQUIRE_EQUAL(a.size(), b.size());
+    for (unsigned i = 0; i < a.size(); ++i) {
+      const parser::Sentence& sa = a.sents[i];
+      const parser::Sentence& sb = b.sents[i];
+      BOOST_CHECK(Words(da.term, sa.raw) == Words(db.term, sb.raw));
+      BOOST_CHECK(Words(da.term, sa.unk) == Words(db.term, sb.unk));
+      BOOST_CHECK(Words(da.term, sa.lc) == Words(db.term, sb.lc));
+      BOOST_CHECK(Words(da.pos, sa.pos) == Words(db.pos, sb.pos));
+      BOOST_CHECK(Words(da.action, a.actions[i]) == Words(db.action, b.actions[i]));
+    }
+    BOOST_CHECK_EQUAL(da.nt.size(), db.nt.size());
+  }
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(oracle_test);
+
+BOOST_AUTO_TEST_CASE( compiled_oracle_matches_text ) {
+  OracleFile f;
+  const string cache = f.file + ".k1.cache";
+  Dicts parsed;
+  parser::TopDownOracle first(&parsed.term, &parsed.action, &parsed.pos, &parsed.nt);
+  first.load_oracle(f.file, true);
+  BOOST_REQUIRE_EQUAL(first.size(), 2u);
+  BOOST_CHECK(Words(parsed.term, first.sents[0].raw) == vector<string>({"The", "cat", "sat"}));
+  BOOST_CHECK(Words(parsed.term, first.sents[0].unk) == vector<string>({"The", "cat", "UNK"}));
+  BOOST_CHECK_EQUAL(first.actions[1].size(), 5u);
+  const ino_t written = Inode(cache);
+  BOOST_REQUIRE(written != 0);
+
+  // the same ids as parsing gives, with the words added in the same order
+  Dicts cached;
+  parser::TopDownOracle second(&cached.term, &cached.action, &cached.pos, &cached.nt);
+  second.load_oracle(f.file, true);
+  BOOST_CHECK_EQUAL(Inode(cache), written);
+  for (unsigned i = 0; i < first.size(); ++i) {
+    BOOST_CHECK(first.sents[i].raw == second.sents[i].raw);
+    BOOST_CHECK(first.sents[i].unk == second.sents[i].unk);
+    BOOST_CHECK(first.sents[i].lc == second.sents[i].lc);
+    BOOST_CHECK(first.sents[i].pos == second.sents[i].pos);
+    BOOST_CHECK(first.actions[i] == second.actions[i]);
+  }
+  CheckSameOracle(first, parsed, second, cached);
+
+  // ids remapped into dictionaries that already hold other words
+  Dicts prefilled;
+  for (const char* w : {"dog", "sat", "UNK"}) prefilled.term.Convert(w);
+  prefilled.action.Convert("SHIFT");
+  prefilled.action.Convert("NT(VP)");
+  prefilled.pos.Convert("VBD");
+  prefilled.nt.Convert("NP");
+  parser::TopDownOracle third(&prefilled.term, &prefilled.action, &prefilled.pos, &prefilled.nt);
+  third.load_oracle(f.file, true);
+  BOOST_CHECK_EQUAL(Inode(cache), written);
+  CheckSameOracle(first, parsed, third, prefilled);
+  BOOST_CHECK_EQUAL(third.sents[0].raw[2], prefilled.term.Convert("sat"));
+  BOOST_CHECK_EQUAL(prefilled.term.size(), parsed.term.size() + 1);
+}
+
+BOOST_AUTO_TEST_CASE( cache_per_kind ) {
+  OracleFile f;
+  Dicts train_dicts, test_dicts;
+  parser::TopDownOracle train(&train_dicts.term, &train_dicts.action, &train_dicts.pos, &train_dicts.nt);
+  train.load_oracle(f.file, true);
+  const ino_t train_cache = Inode(f.file + ".k1.cache");
+  parser::TopDownOracle test(&test_dicts.term, &test_dicts.action, &test_dicts.pos, &test_dicts.nt);
+  test.load_oracle(f.file, false);
+  BOOST_CHECK(Inode(f.file + ".k2.cache") != 0);
+  BOOST_CHECK_EQUAL(Inode(f.file + ".k1.cache"), train_cache);
+  // at test time the raw tokens are the UNKed ones
+  BOOST_CHECK(Words(test_dicts.term, test.sents[0].raw) == vector<string>({"The", "cat", "UNK"}));
+}
+
+BOOST_AUTO_TEST_CASE( stale_cache_rejected ) {
+  OracleFile f;
+  const string cache = f.file + ".k1.cache";
+  Dicts first_dicts;
+  parser::TopDownOracle first(&first_dicts.term, &first_dicts.action, &first_dicts.pos, &first_dicts.nt);
+  first.load_oracle(f.file, true);
+  const ino_t written = Inode(cache);
+
+  string edited = kOracle;
+  edited.replace(edited.find("The cat sat\n"), 12, "The dog sat\n");
+  f.write(edited);
+  Dicts dicts;
+  parser::TopDownOracle second(&dicts.term, &dicts.action, &dicts.pos, &dicts.nt);
+  second.load_oracle(f.file, true);
+  BOOST_CHECK(Inode(cache) != written);
+  BOOST_REQUIRE_EQUAL(second.size(), 2u);
+  BOOST_CHECK(Words(dicts.term, second.sents[0].raw) == vector<string>({"The", "dog", "sat"}));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,60 @@
+#define BOOST_TEST_MODULE NTParserServeTest
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "nt-parser/serve.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(serve_test);
+
+BOOST_AUTO_TEST_CASE( untagged_tokens_keep_slashes ) {
+  vector<string> words, tags;
+  BOOST_CHECK_EQUAL(parser::SplitRequest("cats and/or dogs 1/2 http://a.b/c", false, &words, &tags), "");
+  vector<string> expected_words = {"cats", "and/or", "dogs", "1/2", "http://a.b/c"};
+  vector<string> expected_tags(5, "XX");
+  BOOST_CHECK(words == expected_words);
+  BOOST_CHECK(tags == expected_tags);
+}
+
+BOOST_AUTO_TEST_CASE( tagged_tokens_split_at_last_slash ) {
+  vector<string> words, tags;
+  BOOST_CHECK_EQUAL(parser::SplitRequest("and/or/CC 1/2/CD", true, &words, &tags), "");
+  vector<string> expected_words = {"and/or", "1/2"};
+  vector<string> expected_tags = {"CC", "CD"};
+  BOOST_CHECK(words == expected_words);
+  BOOST_CHECK(tags == expected_tags);
+  BOOST_CHECK_EQUAL(parser::SplitRequest("cats/NNS and", true, &words, &tags),
+                    "ERROR: expected word/TAG, got and");
+  BOOST_CHECK_EQUAL(parser::SplitRequest(" ", false, &words, &tags), "ERROR: empty sentence");
+}
+
+// a line with slashes goes through the stdin server (as with --serve or
+// --stream without -P) as the same words
+BOOST_AUTO_TEST_CASE( serve_untagged_line ) {
+  istringstream in("and/or 1/2\n");
+  ostringstream out;
+  streambuf* cin_buf = cin.rdbuf(in.rdbuf());
+  streambuf* cout_buf = cout.rdbuf(out.rdbuf());
+  parser::LineServer server(32, [](const vector<string>& requests, vector<string>* responses) {
+    responses->clear();
+    for (auto& r : requests) {
+      vector<string> words, tags;
+      string response = parser::SplitRequest(r, false, &words, &tags);
+      for (unsigned i = 0; i < words.size(); ++i)
+        response += "(" + tags[i] + " " + words[i] + ")";
+      responses->push_back(response);
+    }
+  });
+  server.ServeStdin();
+  cin.rdbuf(cin_buf);
+  cout.rdbuf(cout_buf);
+  const string response = out.str();
+  BOOST_CHECK_EQUAL(response.compare(0, 6, "0 ||| "), 0);
+  BOOST_CHECK(response.find(" ||| (XX and/or)(XX 1/2)\n") != string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()